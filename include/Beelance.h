@@ -47,6 +47,8 @@ extern Mycila::TaskManager loopTaskManager;
 extern Mycila::TaskManager modemTaskManager;
 
 extern Mycila::Task espConnectTask;
+extern Mycila::Task hx711CompensationTask;
+extern Mycila::Task hx711ConfigTask;
 extern Mycila::Task hx711ScaleTask;
 extern Mycila::Task hx711TareTask;
 extern Mycila::Task hx711Task;
@@ -70,3 +72,4 @@ extern Mycila::Task serialDebugATTask;
 extern Mycila::Task modemLoopTask;
 
 extern float calibrationWeight;
+extern float compensationWeight;
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <BeelanceHistory.h>
+#include <BeelanceMacros.h>
+#include <FS.h>
+
+#include <string>
+#include <vector>
+
+namespace Beelance {
+  // Compresses a block of records in 3 columns:
+  //   - timestamps: zig-zag delta-of-delta, in variable bit buckets (1 bit when the interval does not change)
+  //   - weights: zig-zag varint deltas
+  //   - temperatures: zig-zag deltas of the centi-degrees, in variable bit buckets (1 bit when it does not change)
+  //
+  // Payload: [timestamps length (u16)][weights length (u16)][timestamps][weights][temperatures]
+  class HistoryBlockCodec {
+    public:
+      static void encode(const HistoryRecord* records, size_t count, std::vector<uint8_t>& payload);
+      // returns false if the payload is truncated
+      static bool decode(const uint8_t* payload, size_t length, size_t count, HistoryRecord* records);
+  };
+
+  // Long-term history: compressed blocks of records evicted from the history file.
+  //
+  // Blocks are appended to segment files (/archive/<sequence of the first record>) of at most BEELANCE_ARCHIVE_SEGMENT_SIZE bytes.
+  // When the archive exceeds its max size, the oldest segment is deleted: the archive never has to be rewritten.
+  // Each block has a header with its record count, the sequence number of its first record and a CRC:
+  // a block torn by a power loss ends the scan of its segment, and the next blocks go to a new segment.
+  class HistoryArchive {
+    public:
+      HistoryArchive(const char* directory, uint32_t maxSize) : _directory(directory), _maxSize(maxSize) {}
+
+      // lists and scans the segments
+      bool begin(fs::FS& fs);
+      // archives the records, the first one having the given sequence number. Records already archived are skipped
+      bool append(const HistoryRecord* records, size_t count, uint32_t sequence);
+      // decodes the records block by block, from the oldest to the newest.
+      // Blocks without any record between from and to (inclusive) are skipped without being decoded
+      void forEach(HistoryRecordCallback callback, uint32_t from = 0, uint32_t to = UINT32_MAX);
+      // copies at most count records, starting at the given position (0 is the oldest archived record).
+      // Blocks before the position are skipped without being decoded
+      size_t read(uint32_t position, HistoryRecord* records, size_t count);
+      bool clear();
+
+      // takes effect at the next append
+      void setMaxSize(uint32_t maxSize) { _maxSize = maxSize; }
+
+      uint32_t getCount() const { return _count; }
+      uint32_t getSize() const;
+      uint32_t getMaxSize() const { return _maxSize; }
+      uint32_t getNextSequence() const { return _nextSequence; }
+
+    private:
+      typedef struct __attribute__((packed)) {
+          uint16_t magic;
+          uint16_t count;
+          uint16_t length;   // payload bytes
+          uint16_t crc;      // CRC16 of the payload
+          uint32_t sequence; // sequence number of the first record
+      } BlockHeader;
+
+      typedef struct {
+          uint32_t from; // oldest timestamp of the block
+          uint32_t to;   // newest timestamp of the block
+      } BlockRange;
+
+      typedef struct {
+          uint32_t sequence; // first record, also the file name
+          uint32_t size;     // bytes of valid blocks
+          uint32_t count;    // records
+          bool torn;
+          std::vector<BlockRange> ranges; // of each valid block
+      } Segment;
+
+      const char* _directory;
+      uint32_t _maxSize;
+      fs::FS* _fs = nullptr;
+      std::vector<Segment> _segments; // oldest first
+      uint32_t _count = 0;
+      uint32_t _nextSequence = 0;
+
+    private:
+      std::string _path(uint32_t sequence) const;
+      void _scan(Segment& segment);
+      bool _appendBlock(const HistoryRecord* records, size_t count, uint32_t sequence);
+      static BlockRange _range(const HistoryRecord* records, size_t count);
+  };
+} // namespace Beelance
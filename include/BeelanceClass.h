@@ -5,29 +5,28 @@
 #pragma once
 
 #include <Beelance.h>
+#include <BeelanceArchive.h>
+#include <BeelanceCodec.h>
+#include <BeelanceHistory.h>
+#include <BeelanceMacros.h>
+#include <BeelanceQueue.h>
 
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
 
 namespace Beelance {
-  typedef struct {
-      std::string time;
-      float temperature;
-      int32_t weight;
-  } Measurement;
-
   class BeelanceClass {
     public:
-      BeelanceClass();
-
       void begin() {
         _initConfig();
         _initTasks();
         _initEventHandlers();
         _initWebsite();
         _initREST();
-        _loadHistory();
+        _initHistory();
+        _initQueue();
       }
 
       bool isNightModeActive() const;
@@ -35,11 +34,30 @@ namespace Beelance {
 
       void sleep(uint32_t seconds);
       void updateWebsite();
-      bool sendMeasurements();
+      // measurements which cannot be sent are queued and sent with the next ones
+      bool sendMeasurements(bool connected);
       void toJson(const JsonObject& root) const;
-      void historyToJson(const JsonObject& root) const;
+      // streams the history as JSON between a prefix and a suffix, see HistoryJsonStream
+      std::shared_ptr<HistoryJsonStream> historyJsonStream(std::string prefix = "", std::string suffix = "") {
+        loadHistory();
+        return std::make_shared<HistoryJsonStream>(latestHistory, hourlyHistory, dailyHistory, _mutex, std::move(prefix), std::move(suffix));
+      }
+      // copy of the newest buckets of a series (oldest first), taken under the lock: the series are updated and reallocated by other tasks
+      std::vector<HistoryBucket> getHistory(HistoryResolution resolution, size_t maxBuckets);
       void clearHistory();
+      void clearQueue() { _uploadQueue.clear(); }
+      // the history is only loaded from the filesystem when needed (website, API), not on every wake up
+      void loadHistory() {
+        if (!_historyLoaded)
+          _loadHistory();
+      }
+      bool isHistoryLoaded() const { return _historyLoaded; }
+      std::vector<HistoryPoint> queryHistory(uint32_t from, uint32_t to, size_t maxPoints, HistoryAggregation aggregation, size_t& selected) { return _historyStore.query(from, to, maxPoints, aggregation, selected); }
+      // raw records, oldest first (archive included), see HistoryStore::read()
+      size_t readHistory(uint32_t position, HistoryRecord* records, size_t count) { return _historyStore.read(position, records, count); }
       bool mustSleep() const;
+      // short key identifying the device in the uplinks: CRC32 of the chip ID
+      uint32_t getDeviceKey() const;
 
     private:
       void _initConfig();
@@ -48,17 +66,37 @@ namespace Beelance {
       void _initWebsite();
       void _initREST();
       void _recordMeasurement(const time_t timestamp, const float temperature, const int32_t weight);
+      void _aggregateMeasurement(const time_t timestamp, const float temperature, const int32_t weight);
+      void _initHistory();
+      void _allocateHistory();
       void _loadHistory();
-      void _saveHistory();
+      void _initQueue();
+      // returns the error of the transport, ESP_OK once sent
+      int _post(JsonVariantConst measurements);
+      // applies the settings of a Json object received on the MQTT downlink topic
+      void _applyRemoteConfig(const std::string& payload);
+      // sends the queued measurements, oldest first, in batches
+      bool _sendQueue();
+      static uint32_t _metadataHash(const JsonObjectConst& root);
+      bool _mustSendMetadata(uint32_t hash, uint32_t now) const;
+      void _metadataSent(uint32_t hash, uint32_t now);
+      // a sudden weight change might be a moved hive: its position is refreshed
+      void _checkWeightChange(int32_t weight);
 
     private:
       static float _round2(float v);
 
     public:
-      std::vector<Measurement> latestHistory;
-      std::vector<Measurement> hourlyHistory;
-      std::vector<Measurement> dailyHistory;
+      HistorySeries latestHistory{HistoryResolution::MINUTE};
+      HistorySeries hourlyHistory{HistoryResolution::HOUR};
+      HistorySeries dailyHistory{HistoryResolution::DAY};
       std::mutex _mutex;
+
+    private:
+      HistoryArchive _historyArchive{DIR_HISTORY_ARCHIVE, BEELANCE_ARCHIVE_MAX_SIZE};
+      HistoryStore _historyStore{FILE_HISTORY, FILE_HISTORY_JOURNAL, FILE_HISTORY_TMP};
+      bool _historyLoaded = false;
+      UploadQueue _uploadQueue{FILE_QUEUE, FILE_QUEUE_TMP, BEELANCE_QUEUE_MAX_SIZE};
   };
 
   extern BeelanceClass Beelance;
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <ArduinoJson.h>
+
+#include <string>
+
+#define BEELANCE_FRAME_VERSION 3
+#define BEELANCE_FRAME_SIZE    41
+
+namespace Beelance {
+  enum class PayloadCodec {
+    JSON,
+    CBOR,
+    MSGPACK,
+    // fixed-layout little-endian frame, see BEELANCE_FRAME_SIZE. A batch is a concatenation of frames
+    BINARY,
+  };
+
+  // Binary frame (version 3):
+  //
+  //   offset  size  field
+  //   0       1     version
+  //   1       1     flags: bit 0 = external power (pow == "ext"), bit 1 = eco mode, bit 2 = location present (a fix gave lat, long, alt),
+  //                        bit 3 = location from the cells (fix_src == "lbs")
+  //   2       4     ts     unix time (u32)
+  //   6       2     temp   centi-degrees C (i16)
+  //   8       4     wt     grams (i32)
+  //   12      4     lat    micro-degrees (i32)
+  //   16      4     long   micro-degrees (i32)
+  //   20      2     alt    meters (i16)
+  //   22      4     boot   boot count (u32)
+  //   26      4     up     uptime in seconds (u32)
+  //   30      1     bat    battery level % (u8)
+  //   31      2     volt   battery millivolts (u16)
+  //   33      4     k      device key (u32)
+  //   37      4     fix_age seconds since the fix of the location (u32), 0xFFFFFFFF if unknown
+  //
+  // Strings (bh, sim, op, ver) and fix_acc are not sent: the backend identifies the device with k.
+  // Version 2 had no fix_age (37 bytes), version 1 had the 48-bit chip ID (dev) instead of k (39 bytes).
+
+  // json (default), cbor, msgpack, binary
+  PayloadCodec toPayloadCodec(const std::string& name);
+  const char* toContentType(PayloadCodec codec);
+
+  // encodes a payload (object) or a batch of payloads (array of objects)
+  bool encodePayload(PayloadCodec codec, JsonVariantConst payload, std::string& out);
+} // namespace Beelance
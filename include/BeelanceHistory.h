@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <BeelanceMacros.h>
+#include <FS.h>
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Beelance {
+  class HistoryArchive;
+
+  typedef struct __attribute__((packed)) {
+      uint32_t timestamp;  // unix time
+      int16_t temperature; // centi-degrees C
+      int32_t weight;      // grams
+  } HistoryRecord;
+
+  typedef std::function<void(const HistoryRecord& record)> HistoryRecordCallback;
+
+  // Measurements staged in RTC memory (RTC_NOINIT): they survive deep sleep and are only written to flash by batches.
+  // The content is lost on power loss: the CRC detects it.
+  typedef struct {
+      uint32_t magic;
+      uint32_t count;
+      uint32_t cycles; // boots since the last flush
+      HistoryRecord records[BEELANCE_HISTORY_STAGING_SIZE];
+      uint32_t crc; // CRC32 of the fields above
+  } HistoryStaging;
+
+  enum class HistoryAggregation {
+    // Largest-Triangle-Three-Buckets: keeps the measurements that best preserve the shape of the weight curve
+    LTTB,
+    // min, max and average of the measurements in equal time buckets
+    BUCKET,
+  };
+
+  typedef struct {
+      uint32_t timestamp;
+      float temperature;
+      float temperatureMin;
+      float temperatureMax;
+      int32_t weight;
+      int32_t weightMin;
+      int32_t weightMax;
+  } HistoryPoint;
+
+  enum class HistoryResolution {
+    MINUTE,
+    HOUR,
+    DAY,
+  };
+
+  typedef struct {
+      uint32_t start; // unix time of the beginning of the bucket
+      uint32_t count;
+      float temperatureMin;
+      float temperatureMax;
+      float temperatureSum;
+      int32_t weightMin;
+      int32_t weightMax;
+      int64_t weightSum;
+
+      float getTemperature() const { return count ? temperatureSum / count : 0; }
+      int32_t getWeight() const { return count ? static_cast<int32_t>(weightSum / static_cast<int64_t>(count)) : 0; }
+  } HistoryBucket;
+
+  // start of the local time bucket (minute, hour or day) containing the timestamp
+  uint32_t toBucketStart(HistoryResolution resolution, time_t timestamp);
+  // local time label of a bucket: 15:02, 15:00 or 2024-04-12
+  std::string toBucketLabel(HistoryResolution resolution, uint32_t start);
+
+  // Circular array of time buckets, keyed by the unix time of their start.
+  // Measurements are expected in chronological order: they update the newest bucket or open a new one, evicting the oldest (O(1)).
+  // A late measurement still updates its bucket if it is retained, otherwise it is dropped.
+  // Each bucket keeps the min, max, sum and count of the measurements so that the average is available without loss.
+  // The buckets are allocated once in PSRAM when available, otherwise in internal RAM.
+  class HistorySeries {
+    public:
+      explicit HistorySeries(HistoryResolution resolution) : _resolution(resolution) {}
+      ~HistorySeries() { end(); }
+
+      // (re)allocates the buckets: the series is cleared
+      bool begin(size_t capacity);
+      void end();
+
+      void add(uint32_t start, float temperature, int32_t weight);
+
+      void clear() {
+        _head = 0;
+        _count = 0;
+      }
+
+      size_t size() const { return _count; }
+      size_t capacity() const { return _capacity; }
+      bool isPSRAM() const { return _psram; }
+      HistoryResolution getResolution() const { return _resolution; }
+
+      // 0 is the oldest bucket
+      const HistoryBucket& operator[](size_t index) const { return _buckets[(_head + _capacity - _count + index) % _capacity]; }
+
+      std::string getLabel(size_t index) const { return toBucketLabel(_resolution, operator[](index).start); }
+
+    private:
+      HistoryResolution _resolution;
+      HistoryBucket* _buckets = nullptr;
+      size_t _capacity = 0;
+      size_t _head = 0; // next bucket to write
+      size_t _count = 0;
+      bool _psram = false;
+
+    private:
+      HistoryBucket& _at(size_t index) { return _buckets[(_head + _capacity - _count + index) % _capacity]; }
+      static void _init(HistoryBucket& bucket, uint32_t start, float temperature, int32_t weight);
+      static void _update(HistoryBucket& bucket, float temperature, int32_t weight);
+  };
+
+  // Writes the history as JSON into successive buffers (chunked response), one bucket at a time:
+  //   <prefix>{"latest":[{...},...],"hourly":[...],"daily":[...]}<suffix>
+  // Memory is constant whatever the size of the history: only the current bucket is formatted.
+  // The series are read under the mutex for each chunk, so that they can be updated or reallocated in between.
+  class HistoryJsonStream {
+    public:
+      HistoryJsonStream(const HistorySeries& latest, const HistorySeries& hourly, const HistorySeries& daily, std::mutex& mutex, std::string prefix = "", std::string suffix = "")
+          : _series{&latest, &hourly, &daily}, _mutex(mutex), _prefix(std::move(prefix)), _suffix(std::move(suffix)) {}
+
+      // returns the number of bytes written, 0 when done
+      size_t read(uint8_t* buffer, size_t maxLen);
+
+    private:
+      enum class State {
+        PREFIX,
+        SERIES_OPEN,
+        BUCKET,
+        SERIES_CLOSE,
+        SUFFIX,
+        DONE,
+      };
+
+      const HistorySeries* _series[3];
+      std::mutex& _mutex;
+      std::string _prefix;
+      std::string _suffix;
+      // next piece to write
+      State _state = State::PREFIX;
+      size_t _seriesIndex = 0;
+      size_t _bucketIndex = 0;
+      // current piece, partially written when it did not fit in the buffer
+      char _buffer[256];
+      const char* _piece = nullptr;
+      size_t _pieceLength = 0;
+      size_t _pieceOffset = 0;
+
+    private:
+      bool _next();
+  };
+
+  // Measurement records persisted in 2 files:
+  //
+  //   snapshot: [header][record 0][record 1]...[record count - 1]    oldest first, at most capacity records
+  //   journal:  [entry][entry]...                                   entry: [sequence][record][CRC16]
+  //
+  // Appending only adds a 16-byte entry at the end of the journal.
+  // When the journal is full, the snapshot and the journal are compacted into a new snapshot written aside,
+  // which atomically replaces the previous one by a rename before the journal is removed.
+  // At any time, a power loss leaves either the previous or the new snapshot, plus a journal:
+  // the journal is replayed up to the first torn entry, skipping the entries already in the snapshot (sequence numbers).
+  //
+  // With a staging area, records are first appended in RTC memory and moved to the journal when the staging area is full
+  // or after a number of boots (deep sleep cycles), so that most wake ups do not touch the filesystem at all.
+  // The files are only loaded on the first operation which needs them.
+  //
+  // With an archive, the records evicted from the snapshot by a compaction are compressed into the archive (by blocks)
+  // instead of being dropped: the snapshot keeps the recent records and the archive the long-term history.
+  class HistoryStore {
+    public:
+      HistoryStore(const char* path, const char* journalPath, const char* tmpPath) : _path(path), _journalPath(journalPath), _tmpPath(tmpPath) {}
+
+      // does not access the filesystem. Counts a boot cycle in the staging area
+      void begin(fs::FS& fs, uint32_t capacity, uint32_t journalCapacity, HistoryStaging* staging = nullptr, uint32_t flushCycles = 0, HistoryArchive* archive = nullptr);
+      bool append(const HistoryRecord& record);
+      // moves the staged records to the journal
+      bool flush();
+      void setFlushCycles(uint32_t cycles) { _flushCycles = cycles; }
+      // iterates over the records from the oldest to the newest, starting with the archived ones.
+      // Archived blocks without any record between from and to are skipped, other records are not filtered
+      void forEach(HistoryRecordCallback callback, uint32_t from = 0, uint32_t to = UINT32_MAX);
+      // copies at most count records, starting at the given position (0 is the oldest record, archive included).
+      // Each call takes the lock: the records can be streamed by chunks while measurements are appended
+      size_t read(uint32_t position, HistoryRecord* records, size_t count);
+      bool clear();
+
+      // selects the records between from and to (inclusive) and downsamples them to at most maxPoints points.
+      // selected receives the number of records in the time window
+      std::vector<HistoryPoint> query(uint32_t from, uint32_t to, size_t maxPoints, HistoryAggregation aggregation, size_t& selected);
+
+      uint32_t getCapacity() const { return _capacity; }
+      // only accurate once the files are loaded
+      uint32_t getCount() const;
+      uint32_t getJournalCount() const { return _journal.size(); }
+      uint32_t getStagedCount() const { return _staging ? _staging->count : 0; }
+      bool isLoaded() const { return _loaded; }
+      const char* getPath() const { return _path; }
+
+    private:
+      typedef struct __attribute__((packed)) {
+          uint32_t magic;
+          uint16_t version;
+          uint16_t recordSize;
+          uint32_t count;
+          uint32_t sequence; // sequence number of the record following the snapshot
+          uint32_t crc;      // CRC32 of the fields above
+      } Header;
+
+      typedef struct __attribute__((packed)) {
+          uint32_t sequence;
+          HistoryRecord record;
+          uint16_t crc; // CRC16 of the fields above
+      } JournalEntry;
+
+      const char* _path;
+      const char* _journalPath;
+      const char* _tmpPath;
+      fs::FS* _fs = nullptr;
+      uint32_t _capacity = 0;
+      uint32_t _journalCapacity = 0;
+      HistoryStaging* _staging = nullptr;
+      uint32_t _flushCycles = 0;
+      HistoryArchive* _archive = nullptr;
+      bool _loaded = false;
+      Header _header = {};
+      std::vector<HistoryRecord> _journal;
+      std::mutex _mutex;
+
+    private:
+      bool _load();
+      // records of the snapshot, the journal and the staging area which are not in the archive yet
+      void _forEachRecent(HistoryRecordCallback callback);
+      // returns the number of records written
+      size_t _appendJournal(const HistoryRecord* records, size_t count);
+      bool _flushStaging();
+      // returns false if the journal has a torn or corrupted entry
+      bool _replayJournal();
+      void _resetStaging();
+      bool _compact();
+      // archives the oldest records of the snapshot and the journal
+      void _archiveOldest(uint32_t count);
+      // number of snapshot and journal records already in the archive (interrupted compaction)
+      uint32_t _archivedCount() const;
+      static uint32_t _crc(const Header& header);
+      static uint16_t _crc(const JournalEntry& entry);
+      static uint32_t _crc(const HistoryStaging& staging);
+  };
+} // namespace Beelance
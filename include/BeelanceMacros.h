@@ -17,21 +17,36 @@
 #define KEY_AP_MODE_ENABLE         "ap_mode_enable"
 #define KEY_BEEHIVE_NAME           "bh_name"
 #define KEY_DEBUG_ENABLE           "debug_enable"
+#define KEY_HISTORY_DAILY_SIZE     "hist_daily"
+#define KEY_HISTORY_FLUSH_CYCLES   "hist_flush"
+#define KEY_HISTORY_HOURLY_SIZE    "hist_hourly"
+#define KEY_HISTORY_LATEST_SIZE    "hist_latest"
+#define KEY_HX711_CALIBRATION_PTS  "hx711_cal_pts"
 #define KEY_HX711_CLOCK_PIN        "hx711_clk_pin"
 #define KEY_HX711_DATA_PIN         "hx711_dt_pin"
+#define KEY_HX711_DATA_PINS_EXTRA  "hx711_dt_pins"
+#define KEY_HX711_FILTER           "hx711_filter"
 #define KEY_HX711_OFFSET           "hx711_offset"
+#define KEY_HX711_SAMPLES          "hx711_samples"
 #define KEY_HX711_SCALE            "hx711_scale"
+#define KEY_HX711_SETTLE_THRESHOLD "hx711_settle"
 #define KEY_MODEM_APN              "modem_apn"
 #define KEY_MODEM_BANDS_LTE_M      "bands_ltem"
 #define KEY_MODEM_BANDS_NB_IOT     "bands_nbiot"
+#define KEY_MODEM_GPS_LBS          "gps_lbs"
+#define KEY_MODEM_GPS_REFRESH      "gps_refresh"
 #define KEY_MODEM_GPS_SYNC_TIMEOUT "gps_timeout"
+#define KEY_MODEM_GPS_WEIGHT_DELTA "gps_wt_delta"
 #define KEY_MODEM_MODE             "modem_mode"
 #define KEY_MODEM_PIN              "modem_pin"
 #define KEY_NIGHT_START_TIME       "night_start"
 #define KEY_NIGHT_STOP_TIME        "night_end"
 #define KEY_PREVENT_SLEEP_ENABLE   "no_sleep_enable"
 #define KEY_PMU_CHARGING_CURRENT   "pmu_chg_current"
+#define KEY_SEND_BATCH_SIZE        "send_batch"
+#define KEY_SEND_CODEC             "send_codec"
 #define KEY_SEND_INTERVAL          "send_delay"
+#define KEY_SEND_METADATA_INTERVAL "send_meta_itvl"
 #define KEY_SEND_URL               "send_url"
 #define KEY_TEMPERATURE_PIN        "temp_pin"
 #define KEY_TIMEZONE_INFO          "tz_info"
@@ -64,8 +79,109 @@
   #define BEELANCE_HX711_DATA_PIN 14
 #endif
 
-#ifndef BEELANCE_MAX_HISTORY_SIZE
-  #define BEELANCE_MAX_HISTORY_SIZE 10
+// default number of buckets kept per history resolution
+#ifndef BEELANCE_HISTORY_LATEST_SIZE
+  #define BEELANCE_HISTORY_LATEST_SIZE 10
 #endif
 
-#define FILE_HISTORY "/history.json"
+#ifndef BEELANCE_HISTORY_HOURLY_SIZE
+  #define BEELANCE_HISTORY_HOURLY_SIZE 336
+#endif
+
+#ifndef BEELANCE_HISTORY_DAILY_SIZE
+  #define BEELANCE_HISTORY_DAILY_SIZE 60
+#endif
+
+// max number of buckets per history resolution
+#ifndef BEELANCE_HISTORY_MAX_SIZE
+  #define BEELANCE_HISTORY_MAX_SIZE 8760
+#endif
+
+// max memory used by the history buckets when they are allocated in internal RAM (no PSRAM)
+#ifndef BEELANCE_HISTORY_DRAM_BUDGET
+  #define BEELANCE_HISTORY_DRAM_BUDGET 16384
+#endif
+
+// default and max number of points returned by /api/beelance/history/query
+#ifndef BEELANCE_HISTORY_QUERY_POINTS
+  #define BEELANCE_HISTORY_QUERY_POINTS 100
+#endif
+
+#ifndef BEELANCE_HISTORY_QUERY_MAX_POINTS
+  #define BEELANCE_HISTORY_QUERY_MAX_POINTS 500
+#endif
+
+// number of buckets shown in the dashboard charts
+#ifndef BEELANCE_CHART_SIZE
+  #define BEELANCE_CHART_SIZE 10
+#endif
+
+// max number of measurements kept in the history file, older ones are moved to the archive
+#ifndef BEELANCE_HISTORY_CAPACITY
+  #define BEELANCE_HISTORY_CAPACITY 512
+#endif
+
+// number of measurements appended to the journal before it is compacted into the history file
+#ifndef BEELANCE_HISTORY_JOURNAL_SIZE
+  #define BEELANCE_HISTORY_JOURNAL_SIZE 32
+#endif
+
+// number of measurements kept in RTC memory between deep sleeps before being written to the journal
+#ifndef BEELANCE_HISTORY_STAGING_SIZE
+  #define BEELANCE_HISTORY_STAGING_SIZE 48
+#endif
+
+// default number of boots after which the staged measurements are written to flash
+#ifndef BEELANCE_HISTORY_FLUSH_CYCLES
+  #define BEELANCE_HISTORY_FLUSH_CYCLES 12
+#endif
+
+// number of measurements compressed together in an archive block
+#ifndef BEELANCE_ARCHIVE_BLOCK_SIZE
+  #define BEELANCE_ARCHIVE_BLOCK_SIZE 128
+#endif
+
+// max size of an archive segment file (one LittleFS block)
+#ifndef BEELANCE_ARCHIVE_SEGMENT_SIZE
+  #define BEELANCE_ARCHIVE_SEGMENT_SIZE 4096
+#endif
+
+// max size of the archive, the oldest segments are deleted above: 128 KB hold about 46000 measurements (10 months every 10 minutes)
+#ifndef BEELANCE_ARCHIVE_MAX_SIZE
+  #define BEELANCE_ARCHIVE_MAX_SIZE 131072
+#endif
+
+// space of the fs partition not available to the archive, which is reduced at startup if the partition is too small.
+// 13 blocks of 4 KB: 2 for the root directory, 2 for /archive, 2 for the history file and 2 for its compaction copy,
+// 3 for the queue, 1 for the copy-on-write of an append and 1 for the archive segment created before the oldest is dropped
+#ifndef BEELANCE_FS_RESERVED_SIZE
+  #define BEELANCE_FS_RESERVED_SIZE 53248
+#endif
+
+// max size of the queue of measurements waiting to be sent, the oldest ones are dropped above
+#ifndef BEELANCE_QUEUE_MAX_SIZE
+  #define BEELANCE_QUEUE_MAX_SIZE 8192
+#endif
+
+// max time the measurements wait for the weight of the cycle before being sent: a reading takes at most 32 samples at 10 SPS
+#ifndef BEELANCE_WEIGHT_TIMEOUT
+  #define BEELANCE_WEIGHT_TIMEOUT 5000
+#endif
+
+// default max number of queued measurements sent in one request
+#ifndef BEELANCE_SEND_BATCH_SIZE
+  #define BEELANCE_SEND_BATCH_SIZE 10
+#endif
+
+// MQTT topic receiving the configuration changes: the publish topic followed by this suffix
+#ifndef BEELANCE_MQTT_DOWNLINK_SUFFIX
+  #define BEELANCE_MQTT_DOWNLINK_SUFFIX "/config"
+#endif
+
+#define DIR_HISTORY_ARCHIVE  "/archive"
+#define FILE_HISTORY         "/history.bin"
+#define FILE_HISTORY_JOURNAL "/history.jnl"
+#define FILE_HISTORY_LEGACY  "/history.json"
+#define FILE_HISTORY_TMP     "/history.tmp"
+#define FILE_QUEUE           "/queue.bin"
+#define FILE_QUEUE_TMP       "/queue.tmp"
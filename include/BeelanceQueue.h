@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <ArduinoJson.h>
+#include <FS.h>
+
+#include <vector>
+
+namespace Beelance {
+  // Payloads which could not be sent, kept in a file until the next successful data session:
+  //
+  //   [entry][entry]...    entry: [length (u16)][CRC16 (u16)][payload as MessagePack]    oldest first
+  //
+  // Pushing only appends an entry at the end of the file.
+  // Removing the sent entries, or the oldest ones when the queue is full, writes the remaining entries aside
+  // in a new file which atomically replaces the previous one by a rename.
+  // A torn entry at the end (power loss while pushing) is dropped when the file is loaded.
+  // The file is only loaded on the first operation which needs it.
+  class UploadQueue {
+    public:
+      UploadQueue(const char* path, const char* tmpPath, uint32_t maxSize) : _path(path), _tmpPath(tmpPath), _maxSize(maxSize) {}
+
+      // does not access the filesystem
+      void begin(fs::FS& fs) {
+        _fs = &fs;
+        _loaded = false;
+      }
+
+      // drops the oldest payloads when the queue would exceed its max size
+      bool push(const JsonDocument& payload);
+      // adds the oldest payloads (at most maxCount) to the batch and returns their number
+      size_t peek(size_t maxCount, const JsonArray& batch);
+      // removes the oldest payloads
+      bool pop(size_t count);
+      bool clear();
+
+      size_t getCount();
+      uint32_t getSize();
+
+    private:
+      typedef struct __attribute__((packed)) {
+          uint16_t length;
+          uint16_t crc; // CRC16 of the payload
+      } EntryHeader;
+
+      const char* _path;
+      const char* _tmpPath;
+      uint32_t _maxSize;
+      fs::FS* _fs = nullptr;
+      bool _loaded = false;
+      std::vector<uint32_t> _offsets; // file offset of each entry, oldest first
+      uint32_t _size = 0;             // bytes of valid entries
+
+    private:
+      bool _load();
+      // keeps the entries starting at the given index
+      bool _rewrite(size_t from);
+  };
+} // namespace Beelance
@@ -17,17 +17,17 @@ namespace Beelance {
       void disableTemperature();
 
     private:
-      std::string _chartLatestX[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartLatestWeightY[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartLatestTempY[BEELANCE_MAX_HISTORY_SIZE];
+      std::string _chartLatestX[BEELANCE_CHART_SIZE];
+      float _chartLatestWeightY[BEELANCE_CHART_SIZE];
+      float _chartLatestTempY[BEELANCE_CHART_SIZE];
 
-      std::string _chartHourlyX[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartHourlyWeightY[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartHourlyTempY[BEELANCE_MAX_HISTORY_SIZE];
+      std::string _chartHourlyX[BEELANCE_CHART_SIZE];
+      float _chartHourlyWeightY[BEELANCE_CHART_SIZE];
+      float _chartHourlyTempY[BEELANCE_CHART_SIZE];
 
-      std::string _chartDailyX[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartDailyWeightY[BEELANCE_MAX_HISTORY_SIZE];
-      float _chartDailyTempY[BEELANCE_MAX_HISTORY_SIZE];
+      std::string _chartDailyX[BEELANCE_CHART_SIZE];
+      float _chartDailyWeightY[BEELANCE_CHART_SIZE];
+      float _chartDailyTempY[BEELANCE_CHART_SIZE];
 
       bool _requestChartUpdate = true;
 
@@ -5,6 +5,11 @@
 #include <MycilaHX711.h>
 #include <MycilaLogger.h>
 
+#include <driver/gpio.h>
+
+#include <algorithm>
+#include <vector>
+
 #define TAG "HX711"
 
 #ifndef GPIO_IS_VALID_GPIO
@@ -12,31 +17,80 @@
                                       (((1ULL << (gpio_num)) & SOC_GPIO_VALID_GPIO_MASK) != 0))
 #endif
 
+// 10 SPS => a sample every 100 ms: this timeout only guards against a missed edge
+#define MYCILA_HX711_SAMPLER_WAIT_MS 250
+
 extern Mycila::Logger logger;
 
-void Mycila::HX711::begin(const uint8_t dataPin, const uint8_t clockPin) {
+static portMUX_TYPE hx711Mux = portMUX_INITIALIZER_UNLOCKED;
+
+Mycila::HX711::HX711() {
+  for (size_t i = 0; i < MYCILA_HX711_MAX_CHANNELS; i++) {
+    _channels[i].dataPin = GPIO_NUM_NC;
+    _channels[i].scale = 1.0;
+  }
+}
+
+void Mycila::HX711::begin(const uint8_t* dataPins, size_t count, const uint8_t clockPin) {
   if (_enabled)
     return;
 
-  if (GPIO_IS_VALID_GPIO(dataPin)) {
-    _dataPin = (gpio_num_t)dataPin;
-  } else {
-    logger.error(TAG, "Disable HX711: Invalid DATA pin: %u", dataPin);
-    _dataPin = GPIO_NUM_NC;
+  if (!count || count > MYCILA_HX711_MAX_CHANNELS) {
+    logger.error(TAG, "Disable HX711: Invalid number of channels: %u", count);
     return;
   }
 
+  for (size_t i = 0; i < count; i++) {
+    if (GPIO_IS_VALID_GPIO(dataPins[i])) {
+      _channels[i].dataPin = (gpio_num_t)dataPins[i];
+    } else {
+      logger.error(TAG, "Disable HX711: Invalid DATA pin: %u", dataPins[i]);
+      for (size_t j = 0; j < count; j++)
+        _channels[j].dataPin = GPIO_NUM_NC;
+      return;
+    }
+  }
+
   if (GPIO_IS_VALID_GPIO(clockPin)) {
     _clockPin = (gpio_num_t)clockPin;
   } else {
     logger.error(TAG, "Disable HX711: Invalid CLOCK pin: %u", clockPin);
     _clockPin = GPIO_NUM_NC;
+    for (size_t j = 0; j < count; j++)
+      _channels[j].dataPin = GPIO_NUM_NC;
     return;
   }
 
-  _hx711.begin(_dataPin, _clockPin, true);
+  _channelCount = count;
+
+  pinMode(_clockPin, OUTPUT);
+  digitalWrite(_clockPin, LOW);
+  for (size_t i = 0; i < _channelCount; i++)
+    pinMode(_channels[i].dataPin, INPUT);
 
-  logger.info(TAG, "Enable HX711...");
+  logger.info(TAG, "Enable HX711 with %u channel(s)...", _channelCount);
+
+  _samples.clear();
+  _filter.reset();
+  _powerDown = false;
+
+#ifndef MYCILA_SIMULATION
+  _samplerRunning = true;
+  TaskHandle_t samplerTask = nullptr;
+  if (xTaskCreatePinnedToCore(_samplerLoop, "hx711_sampler", MYCILA_HX711_SAMPLER_STACK_SIZE, this, MYCILA_HX711_SAMPLER_PRIORITY, &samplerTask, MYCILA_HX711_SAMPLER_CORE) != pdPASS) {
+    logger.error(TAG, "Disable HX711: Unable to start sampler task");
+    _samplerRunning = false;
+    for (size_t i = 0; i < _channelCount; i++)
+      _channels[i].dataPin = GPIO_NUM_NC;
+    _channelCount = 0;
+    _clockPin = GPIO_NUM_NC;
+    return;
+  }
+  _samplerTask = samplerTask;
+  // the chips are not synchronized: each edge wakes up the sampler which waits for all of them to be ready
+  for (size_t i = 0; i < _channelCount; i++)
+    attachInterruptArg(_channels[i].dataPin, _onDataReady, this, FALLING);
+#endif
 
   _enabled = true;
 }
@@ -45,46 +99,373 @@ void Mycila::HX711::end() {
   if (_enabled) {
     logger.info(TAG, "Disable HX711...");
     _enabled = false;
+
+#ifndef MYCILA_SIMULATION
+    for (size_t i = 0; i < _channelCount; i++)
+      detachInterrupt(_channels[i].dataPin);
+    // the sampler task exits by itself at its next wakeup and notifies us back:
+    // the pins and channels must not be released while it is still clocking the chips
+    TaskHandle_t samplerTask = _samplerTask;
+    _endingTask = xTaskGetCurrentTaskHandle();
+    _samplerRunning = false;
+    if (samplerTask) {
+      xTaskNotifyGive(samplerTask);
+      do {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      } while (_samplerTask);
+    }
+    _endingTask = nullptr;
+#endif
+
     _weight = 0;
     _lastUpdate = 0;
-    _dataPin = GPIO_NUM_NC;
+    for (size_t i = 0; i < _channelCount; i++) {
+      _channels[i].dataPin = GPIO_NUM_NC;
+      _channels[i].weight = 0;
+    }
+    _channelCount = 0;
     _clockPin = GPIO_NUM_NC;
   }
 }
 
+void Mycila::HX711::setOffsets(const std::string& offsets) {
+  const char* p = offsets.c_str();
+  for (size_t i = 0; i < MYCILA_HX711_MAX_CHANNELS && *p; i++) {
+    char* end;
+    _channels[i].offset = strtol(p, &end, 10);
+    p = *end == ',' ? end + 1 : end;
+  }
+}
+
+void Mycila::HX711::setScales(const std::string& scales) {
+  const char* p = scales.c_str();
+  for (size_t i = 0; i < MYCILA_HX711_MAX_CHANNELS && *p; i++) {
+    char* end;
+    _channels[i].scale = strtof(p, &end);
+    p = *end == ',' ? end + 1 : end;
+  }
+}
+
+std::string Mycila::HX711::getOffsets() const {
+  std::string offsets;
+  for (size_t i = 0; i < std::max(_channelCount, static_cast<size_t>(1)); i++) {
+    if (i)
+      offsets += ',';
+    offsets += std::to_string(_channels[i].offset);
+  }
+  return offsets;
+}
+
+std::string Mycila::HX711::getScales() const {
+  std::string scales;
+  char buffer[24];
+  for (size_t i = 0; i < std::max(_channelCount, static_cast<size_t>(1)); i++) {
+    if (i)
+      scales += ',';
+    snprintf(buffer, sizeof(buffer), "%.7g", _channels[i].scale);
+    scales += buffer;
+  }
+  return scales;
+}
+
+float Mycila::HX711::getTare() const {
+  float tare = 0;
+  for (size_t i = 0; i < std::max(_channelCount, static_cast<size_t>(1)); i++)
+    tare -= _channels[i].offset * _channels[i].scale;
+  return tare;
+}
+
 float Mycila::HX711::read() {
   if (!_enabled)
     return 0;
 #ifdef MYCILA_SIMULATION
   _weight = random(15, 30) * 1000;
+  _lastUpdate = millis();
+  _acquisitionRequested = false;
 #else
-  float f = (_hx711.read_average(30) - _offset) * _scale;
-  _weight = f < 0 ? 0 : f;
+  if (_powerDown) {
+    if (_powerSave && !_acquisitionRequested)
+      return _weight;
+    _powerUp();
+  }
+
+  HX711Sample sample;
+  while (_samples.pop(sample)) {
+    if (!_filter.count()) {
+      _acquisitionStart = sample.time;
+      for (size_t i = 0; i < _channelCount; i++)
+        _channelSums[i] = 0;
+    }
+
+    float grams = 0;
+    for (size_t i = 0; i < _channelCount; i++) {
+      const float g = (sample.raw[i] - _channels[i].offset) * _channels[i].scale;
+      _channelSums[i] += g;
+      grams += g;
+    }
+
+    grams = _compensation.apply(grams);
+    _filter.add(grams);
+
+    const size_t n = _filter.count();
+    _settleWindow[(n - 1) % MYCILA_HX711_SETTLE_WINDOW] = grams;
+    const bool settled = _settleThreshold > 0 && n >= MYCILA_HX711_SETTLE_WINDOW && _settleVariance() <= _settleThreshold * _settleThreshold;
+
+    if (settled || n >= _maxSamples) {
+      float f = _filter.value();
+      _weight = f < 0 ? 0 : f;
+      _lastUpdate = millis();
+      _settled = settled;
+      _settleSamples = n;
+      _settleTime = sample.time - _acquisitionStart;
+      for (size_t i = 0; i < _channelCount; i++)
+        _channels[i].weight = _channelSums[i] / n;
+      _filter.clearWindow();
+      _acquisitionRequested = false;
+
+      // the next samples are not needed until another acquisition is requested
+      if (_powerSave) {
+        _powerDown = true;
+        xTaskNotifyGive(_samplerTask);
+        break;
+      }
+    }
+  }
 #endif
-  _lastUpdate = millis();
   return _weight;
 }
 
 int32_t Mycila::HX711::tare() {
   if (!_enabled)
-    return _offset;
-  _scale = 1;
-  _offset = _hx711.read_average(30);
-  return _offset;
+    return _channels[0].offset;
+  int32_t averages[MYCILA_HX711_MAX_CHANNELS];
+  if (_collect(_maxSamples, averages)) {
+    for (size_t i = 0; i < _channelCount; i++) {
+      _channels[i].scale = 1;
+      _channels[i].offset = averages[i];
+    }
+    // the points were measured with the previous base calibration
+    _compensation.clear();
+  }
+  return _channels[0].offset;
 }
 
 float Mycila::HX711::calibrate(float expectedWeight) {
   if (!_enabled)
-    return _scale;
-  _scale = expectedWeight / (_hx711.read_average(30) - _offset);
-  return _scale;
+    return _channels[0].scale;
+  int32_t averages[MYCILA_HX711_MAX_CHANNELS];
+  if (_collect(_maxSamples, averages)) {
+    int64_t total = 0;
+    for (size_t i = 0; i < _channelCount; i++)
+      total += averages[i] - _channels[i].offset;
+    if (total) {
+      const float scale = expectedWeight / total;
+      for (size_t i = 0; i < _channelCount; i++)
+        _channels[i].scale = scale;
+      // the points were measured with the previous base calibration
+      _compensation.clear();
+    }
+  }
+  return _channels[0].scale;
+}
+
+bool Mycila::HX711::addCalibrationPoint(float expectedWeight, float temperature) {
+  if (!_enabled)
+    return false;
+  int32_t averages[MYCILA_HX711_MAX_CHANNELS];
+  if (!_collect(_maxSamples, averages))
+    return false;
+  float measured = 0;
+  for (size_t i = 0; i < _channelCount; i++)
+    measured += (averages[i] - _channels[i].offset) * _channels[i].scale;
+  if (!_compensation.addPoint(measured, expectedWeight, temperature)) {
+    logger.error(TAG, "Unable to add calibration point: max %u points", MYCILA_HX711_MAX_CALIBRATION_POINTS);
+    return false;
+  }
+  logger.info(TAG, "Calibration point: measured = %.1f g, expected = %.1f g, temperature = %.2f C. Fitted terms: %u", measured, expectedWeight, temperature, _compensation.getTermCount());
+  return true;
 }
 
 void Mycila::HX711::toJson(const JsonObject& root) const {
   root["enabled"] = _enabled;
-  root["offset"] = _offset;
-  root["scale"] = _scale;
+  root["filter"] = HX711Filter::name(_filter.getType());
+  root["offset"] = getOffset();
+  root["overruns"] = _overruns.load();
+  root["power_save"] = _powerSave;
+  root["powered_down"] = _powerDown.load();
+  root["scale"] = getScale();
+  root["settle_samples"] = _settleSamples;
+  root["settle_threshold"] = _settleThreshold;
+  root["settle_time"] = _settleTime;
+  root["settled"] = _settled;
   root["tare"] = getTare();
   root["valid"] = isValid();
   root["weight"] = _weight;
+  JsonObject compensation = root["compensation"].to<JsonObject>();
+  compensation["points"] = _compensation.getPointCount();
+  compensation["terms"] = _compensation.getTermCount();
+  compensation["ref_temp"] = _compensation.getReferenceTemperature();
+  JsonArray coefficients = compensation["coefficients"].to<JsonArray>();
+  for (size_t i = 0; i < 4; i++)
+    coefficients.add(_compensation.getCoefficients()[i]);
+  JsonArray channels = root["channels"].to<JsonArray>();
+  for (size_t i = 0; i < _channelCount; i++) {
+    JsonObject channel = channels.add<JsonObject>();
+    channel["pin"] = static_cast<int>(_channels[i].dataPin);
+    channel["offset"] = _channels[i].offset;
+    channel["scale"] = _channels[i].scale;
+    channel["weight"] = _channels[i].weight;
+  }
+}
+
+bool Mycila::HX711::_collect(size_t count, int32_t* averages) {
+#ifdef MYCILA_SIMULATION
+  for (size_t i = 0; i < _channelCount; i++)
+    averages[i] = _channels[i].offset;
+  return true;
+#else
+  if (_powerDown)
+    _powerUp();
+
+  // only fresh samples: the ones already buffered might have been taken before the load changed
+  // offset and scale are about to change: the filter state is not valid anymore
+  _samples.clear();
+  _filter.reset();
+
+  count = std::min(count, static_cast<size_t>(MYCILA_HX711_FILTER_WINDOW));
+  // one row of samples per channel
+  std::vector<float> values(count * _channelCount);
+  size_t n = 0;
+  const uint32_t start = millis();
+
+  while (n < count) {
+    HX711Sample sample;
+    if (_samples.pop(sample)) {
+      for (size_t i = 0; i < _channelCount; i++)
+        values[i * count + n] = sample.raw[i];
+      n++;
+    } else if (millis() - start >= MYCILA_HX711_COLLECT_TIMEOUT) {
+      logger.error(TAG, "Timeout collecting samples: %u / %u", n, count);
+      return false;
+    } else {
+      // yield to the other tasks while the sampler fills the ring
+      delay(10);
+    }
+  }
+
+  // streaming filters have no meaning on a one-shot collection: use the robust trimmed mean instead
+  HX711FilterType type = _filter.getType();
+  if (type == HX711FilterType::EMA || type == HX711FilterType::KALMAN)
+    type = HX711FilterType::TRIMMED_MEAN;
+
+  for (size_t i = 0; i < _channelCount; i++)
+    averages[i] = static_cast<int32_t>(HX711Filter::reduce(type, &values[i * count], n));
+  return true;
+#endif
+}
+
+bool Mycila::HX711::_isReady() const {
+  // DOUT goes low when a conversion is ready
+  for (size_t i = 0; i < _channelCount; i++)
+    if (gpio_get_level(_channels[i].dataPin))
+      return false;
+  return true;
+}
+
+void Mycila::HX711::_readRaw(int32_t* raw) {
+  uint32_t values[MYCILA_HX711_MAX_CHANNELS] = {};
+
+  // PD_SCK must not stay high more than 60 us or the chips power down
+  portENTER_CRITICAL(&hx711Mux);
+  for (int bit = 23; bit >= 0; bit--) {
+    gpio_set_level(_clockPin, 1);
+    delayMicroseconds(1);
+    for (size_t i = 0; i < _channelCount; i++)
+      values[i] |= static_cast<uint32_t>(gpio_get_level(_channels[i].dataPin)) << bit;
+    gpio_set_level(_clockPin, 0);
+    delayMicroseconds(1);
+  }
+  // 25th pulse: next conversion on channel A with a gain of 128
+  gpio_set_level(_clockPin, 1);
+  delayMicroseconds(1);
+  gpio_set_level(_clockPin, 0);
+  portEXIT_CRITICAL(&hx711Mux);
+
+  // 24-bit two's complement
+  for (size_t i = 0; i < _channelCount; i++)
+    raw[i] = static_cast<int32_t>(values[i] & 0x800000 ? values[i] | 0xFF000000 : values[i]);
+}
+
+float Mycila::HX711::_settleVariance() const {
+  float mean = 0;
+  for (size_t i = 0; i < MYCILA_HX711_SETTLE_WINDOW; i++)
+    mean += _settleWindow[i];
+  mean /= MYCILA_HX711_SETTLE_WINDOW;
+  float m2 = 0;
+  for (size_t i = 0; i < MYCILA_HX711_SETTLE_WINDOW; i++)
+    m2 += (_settleWindow[i] - mean) * (_settleWindow[i] - mean);
+  return m2 / (MYCILA_HX711_SETTLE_WINDOW - 1);
+}
+
+void Mycila::HX711::_powerUp() {
+  // the buffered samples were taken before the chips were powered down
+  _samples.clear();
+  _powerDown = false;
+  xTaskNotifyGive(_samplerTask);
+}
+
+void Mycila::HX711::_samplerLoop(void* params) {
+  HX711* self = reinterpret_cast<HX711*>(params);
+
+  while (self->_samplerRunning) {
+    if (self->_powerDown) {
+      // PD_SCK high for more than 60 us: the chips power down until it goes low again
+      for (size_t i = 0; i < self->_channelCount; i++)
+        detachInterrupt(self->_channels[i].dataPin);
+      gpio_set_level(self->_clockPin, 1);
+      while (self->_powerDown && self->_samplerRunning)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      if (!self->_samplerRunning)
+        break;
+      // the chips reset: the first conversion is ready after the settling time (400 ms at 10 SPS)
+      gpio_set_level(self->_clockPin, 0);
+      for (size_t i = 0; i < self->_channelCount; i++)
+        attachInterruptArg(self->_channels[i].dataPin, _onDataReady, self, FALLING);
+      continue;
+    }
+
+    // woken up by a DOUT falling edge, or by the timeout in case an edge was missed
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(MYCILA_HX711_SAMPLER_WAIT_MS));
+
+    // spurious edges are caused by our own clocking, and the chips are ready at slightly different times
+    if (!self->_samplerRunning || !self->_isReady())
+      continue;
+
+    HX711Sample sample = {};
+    for (size_t i = 0; i < self->_channelCount; i++)
+      gpio_intr_disable(self->_channels[i].dataPin);
+    self->_readRaw(sample.raw);
+    sample.time = millis();
+    for (size_t i = 0; i < self->_channelCount; i++)
+      gpio_intr_enable(self->_channels[i].dataPin);
+
+    if (!self->_samples.push(sample))
+      self->_overruns++;
+  }
+
+  TaskHandle_t endingTask = self->_endingTask;
+  self->_samplerTask = nullptr;
+  if (endingTask)
+    xTaskNotifyGive(endingTask);
+  vTaskDelete(NULL);
+}
+
+void IRAM_ATTR Mycila::HX711::_onDataReady(void* params) {
+  HX711* self = reinterpret_cast<HX711*>(params);
+  BaseType_t woken = pdFALSE;
+  TaskHandle_t samplerTask = self->_samplerTask;
+  if (samplerTask)
+    vTaskNotifyGiveFromISR(samplerTask, &woken);
+  if (woken)
+    portYIELD_FROM_ISR();
 }
@@ -4,53 +4,218 @@
  */
 #pragma once
 
-#include "HX711.h"
+#include "MycilaHX711Compensation.h"
+#include "MycilaHX711Filter.h"
+#include "MycilaSPSCRing.h"
+#include <Arduino.h>
 #include <ArduinoJson.h>
 
+#include <atomic>
+#include <string>
+
 #ifndef MYCILA_WEIGHT_EXPIRATION_DELAY
 #define MYCILA_WEIGHT_EXPIRATION_DELAY 60
 #endif
 
+// max number of HX711 chips sharing the same clock line
+#ifndef MYCILA_HX711_MAX_CHANNELS
+#define MYCILA_HX711_MAX_CHANNELS 4
+#endif
+
+// default max number of samples filtered to compute a weight
+#ifndef MYCILA_HX711_SAMPLES
+#define MYCILA_HX711_SAMPLES 30
+#endif
+
+static_assert(MYCILA_HX711_SAMPLES <= MYCILA_HX711_FILTER_WINDOW, "MYCILA_HX711_SAMPLES must fit in the filter window");
+
+// number of latest samples whose standard deviation must drop below the settle threshold for the weight to be considered as settled
+#ifndef MYCILA_HX711_SETTLE_WINDOW
+#define MYCILA_HX711_SETTLE_WINDOW 5
+#endif
+
+static_assert(MYCILA_HX711_SETTLE_WINDOW >= 2, "MYCILA_HX711_SETTLE_WINDOW must hold at least 2 samples to compute a variance");
+
+// raw samples buffered between the sampler task and the consumer (must be a power of 2)
+#ifndef MYCILA_HX711_RING_SIZE
+#define MYCILA_HX711_RING_SIZE 64
+#endif
+
+#ifndef MYCILA_HX711_SAMPLER_CORE
+#define MYCILA_HX711_SAMPLER_CORE 0
+#endif
+
+#ifndef MYCILA_HX711_SAMPLER_PRIORITY
+#define MYCILA_HX711_SAMPLER_PRIORITY 2
+#endif
+
+#ifndef MYCILA_HX711_SAMPLER_STACK_SIZE
+#define MYCILA_HX711_SAMPLER_STACK_SIZE 2048
+#endif
+
+// max time to wait for enough samples during tare and calibration
+#ifndef MYCILA_HX711_COLLECT_TIMEOUT
+#define MYCILA_HX711_COLLECT_TIMEOUT 10000
+#endif
+
 namespace Mycila {
+  typedef struct {
+      int32_t raw[MYCILA_HX711_MAX_CHANNELS];
+      uint32_t time; // millis() when the conversion was read
+  } HX711Sample;
+
+  typedef struct {
+      gpio_num_t dataPin;
+      int32_t offset;
+      float scale;
+      float weight; // mean of the last acquisition
+  } HX711Channel;
+
+  // A scale made of one or several HX711 chips (one per load cell) sharing the same clock line.
+  // All the data lines are read in the same bit loop, so acquisition time does not grow with the number of cells.
+  // The weight is the sum of the channel weights: (raw - offset) * scale, corrected for the temperature drift
+  // by a model fitted on calibration points taken at different temperatures (see HX711Compensation).
+  //
+  // The chips are sampled by a dedicated pinned task woken up by the DOUT falling edges (data ready).
+  // Raw counts are pushed into a lock-free ring which is consumed by read(), tare() and calibrate().
+  // These 3 methods must be called from the same task (single consumer),
+  // as well as the setters of the offsets, scales, calibration points, filter and acquisition settings once begin() was called.
+  //
+  // An acquisition completes early as soon as the standard deviation of its last MYCILA_HX711_SETTLE_WINDOW samples
+  // drops below the settle threshold, or when it reaches the max number of samples.
+  // Only the latest samples are checked: the transient of a load change at the start of an acquisition does not delay it.
+  //
+  // In power save mode, the sampler pauses once an acquisition completes: the interrupts are detached and PD_SCK stays high,
+  // which powers the chips down. The last weight stays valid. The sampler restarts at the next read() after requestAcquisition().
   class HX711 {
     public:
+      HX711();
       ~HX711() { end(); }
 
-      void setOffset(int32_t offset) { _offset = offset; }
-      void setScale(float scale) { _scale = scale; }
+      void setOffset(int32_t offset, size_t channel = 0) {
+        if (channel < MYCILA_HX711_MAX_CHANNELS)
+          _channels[channel].offset = offset;
+      }
+      void setScale(float scale, size_t channel = 0) {
+        if (channel < MYCILA_HX711_MAX_CHANNELS)
+          _channels[channel].scale = scale;
+      }
+      // comma-separated list, one value per channel
+      void setOffsets(const std::string& offsets);
+      void setScales(const std::string& scales);
+      // current temperature of the load cells, used for the drift compensation
+      void setTemperature(float temperature) { _compensation.setTemperature(temperature); }
+      // comma-separated list, see HX711Compensation
+      void setCalibrationPoints(const std::string& points) { _compensation.setPoints(points); }
       void setExpirationDelay(uint32_t expirationDelay) { _expirationDelay = expirationDelay; }
+      void setFilter(HX711FilterType type) { _filter.setType(type); }
+      // standard deviation in grams under which the weight is considered stable: 0 to always take the max number of samples
+      void setSettleThreshold(float threshold) { _settleThreshold = threshold; }
+      void setMaxSamples(size_t samples) { _maxSamples = samples < 1 ? 1 : (samples > MYCILA_HX711_FILTER_WINDOW ? MYCILA_HX711_FILTER_WINDOW : samples); }
+      // for a device which wakes up for one reading: the chips are powered down once the weight is acquired
+      void setPowerSave(bool enable) { _powerSave = enable; }
 
-      int32_t getOffset() const { return _offset; }
-      float getScale() const { return _scale; }
-      float getTare() const { return -_offset * _scale; }
+      int32_t getOffset(size_t channel = 0) const { return channel < MYCILA_HX711_MAX_CHANNELS ? _channels[channel].offset : 0; }
+      float getScale(size_t channel = 0) const { return channel < MYCILA_HX711_MAX_CHANNELS ? _channels[channel].scale : 0; }
+      float getTare() const;
+      // comma-separated list, one value per channel
+      std::string getOffsets() const;
+      std::string getScales() const;
+      std::string getCalibrationPoints() const { return _compensation.getPoints(); }
+      const HX711Compensation& getCompensation() const { return _compensation; }
       uint32_t getExpirationDelay() const { return _expirationDelay; }
+      HX711FilterType getFilter() const { return _filter.getType(); }
+      float getSettleThreshold() const { return _settleThreshold; }
+      size_t getMaxSamples() const { return _maxSamples; }
+      bool isPowerSave() const { return _powerSave; }
 
-      void begin(const uint8_t dataPin, const uint8_t clockPin);
+      void begin(const uint8_t dataPin, const uint8_t clockPin) { begin(&dataPin, 1, clockPin); }
+      void begin(const uint8_t* dataPins, size_t count, const uint8_t clockPin);
+      // blocks until the sampler task has exited
       void end();
 
+      // non-blocking: consumes the buffered samples and updates the weight once enough samples were collected
       float read();
+      // blocking (yielding) until enough fresh samples are collected.
+      // Tares all the channels and returns the offset of the first one
       int32_t tare();
+      // blocking (yielding) until enough fresh samples are collected.
+      // The reference weight can only give one factor: the same scale is applied to all the channels (identical cells).
+      // Returns the scale
       float calibrate(float expectedWeight);
+      // blocking (yielding) until enough fresh samples are collected.
+      // Records a temperature compensation point with the known weight currently on the scale.
+      // Returns false if the samples could not be collected or if the list of points is full.
+      bool addCalibrationPoint(float expectedWeight, float temperature);
+      void clearCalibrationPoints() { _compensation.clear(); }
+      // can be called from any task: the chips are powered up at the next read() if needed, until an acquisition completes
+      void requestAcquisition() { _acquisitionRequested = true; }
+      bool isAcquisitionPending() const { return _acquisitionRequested; }
+      bool isPoweredDown() const { return _powerDown; }
 
       float getWeight() const { return _weight; }
       bool isEnabled() const { return _enabled; }
-      bool isValid() const { return _expirationDelay == 0 ? _enabled : (millis() - _lastUpdate < _expirationDelay * 1000); }
+      // a weight was acquired and did not expire: the weight of powered down chips does not expire
+      bool isValid() const { return _expirationDelay == 0 ? _enabled : (_lastUpdate && (_powerDown || millis() - _lastUpdate < _expirationDelay * 1000)); }
       uint32_t getLastUpdate() const { return _lastUpdate; }
+      uint32_t getOverruns() const { return _overruns; }
 
-      gpio_num_t getDataPin() const { return _dataPin; };
+      // last completed acquisition
+      bool isSettled() const { return _settled; }
+      size_t getSettleSamples() const { return _settleSamples; }
+      uint32_t getSettleTime() const { return _settleTime; }
+
+      size_t getChannelCount() const { return _channelCount; }
+      const HX711Channel& getChannel(size_t channel) const { return _channels[channel]; }
+      gpio_num_t getDataPin(size_t channel = 0) const { return channel < _channelCount ? _channels[channel].dataPin : GPIO_NUM_NC; };
       gpio_num_t getClockPin() const { return _clockPin; };
 
       void toJson(const JsonObject& root) const;
 
     private:
       bool _enabled = false;
-      gpio_num_t _dataPin = GPIO_NUM_NC;
       gpio_num_t _clockPin = GPIO_NUM_NC;
+      size_t _channelCount = 0;
+      HX711Channel _channels[MYCILA_HX711_MAX_CHANNELS] = {};
       float _weight = 0;
       uint32_t _lastUpdate = 0;
       uint32_t _expirationDelay = 0;
-      int32_t _offset = 0;
-      float _scale = 1.0;
-      ::HX711 _hx711;
+
+    private:
+      // sampler
+      std::atomic<TaskHandle_t> _samplerTask{nullptr}; // also read by the DOUT interrupt
+      std::atomic<TaskHandle_t> _endingTask{nullptr};  // end() waiting for the sampler to exit
+      std::atomic<bool> _samplerRunning{false};
+      std::atomic<uint32_t> _overruns{0};
+      std::atomic<bool> _powerDown{false}; // requested by the consumer, applied by the sampler
+      std::atomic<bool> _acquisitionRequested{false};
+      bool _powerSave = false;
+      SPSCRing<HX711Sample, MYCILA_HX711_RING_SIZE> _samples;
+
+    private:
+      // acquisition in progress, in grams
+      HX711Filter _filter;
+      HX711Compensation _compensation;
+      float _settleThreshold = 0;
+      size_t _maxSamples = MYCILA_HX711_SAMPLES;
+      uint32_t _acquisitionStart = 0;
+      float _settleWindow[MYCILA_HX711_SETTLE_WINDOW] = {}; // last samples, circular
+      float _channelSums[MYCILA_HX711_MAX_CHANNELS] = {};
+
+    private:
+      // last completed acquisition
+      bool _settled = false;
+      size_t _settleSamples = 0;
+      uint32_t _settleTime = 0;
+
+    private:
+      bool _collect(size_t count, int32_t* averages);
+      bool _isReady() const;
+      void _readRaw(int32_t* raw);
+      // sample variance of the settle window, in g^2
+      float _settleVariance() const;
+      void _powerUp();
+      static void _samplerLoop(void* params);
+      static void IRAM_ATTR _onDataReady(void* params);
   };
 } // namespace Mycila
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <MycilaHX711Compensation.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+bool Mycila::HX711Compensation::addPoint(float measured, float expected, float temperature) {
+  if (_count >= MYCILA_HX711_MAX_CALIBRATION_POINTS)
+    return false;
+  _points[_count++] = {measured, expected, temperature};
+  _fit();
+  return true;
+}
+
+void Mycila::HX711Compensation::clear() {
+  _count = 0;
+  _fit();
+}
+
+void Mycila::HX711Compensation::setPoints(const std::string& points) {
+  _count = 0;
+  const char* p = points.c_str();
+  while (*p && _count < MYCILA_HX711_MAX_CALIBRATION_POINTS) {
+    char* end;
+    HX711CalibrationPoint point;
+    point.measured = strtof(p, &end);
+    if (*end != ':')
+      break;
+    point.expected = strtof(end + 1, &end);
+    if (*end != ':')
+      break;
+    point.temperature = strtof(end + 1, &end);
+    _points[_count++] = point;
+    if (*end != ';')
+      break;
+    p = end + 1;
+  }
+  _fit();
+}
+
+std::string Mycila::HX711Compensation::getPoints() const {
+  std::string points;
+  char buffer[48];
+  for (size_t i = 0; i < _count; i++) {
+    snprintf(buffer, sizeof(buffer), "%s%.1f:%.1f:%.2f", i ? ";" : "", _points[i].measured, _points[i].expected, _points[i].temperature);
+    points += buffer;
+  }
+  return points;
+}
+
+void Mycila::HX711Compensation::setTemperature(float temperature) {
+  _temperature = temperature;
+  const double dT = temperature - _referenceTemperature;
+  _gain = _c[1] + _c[3] * dT;
+  _offset = _c[0] + _c[2] * dT;
+}
+
+void Mycila::HX711Compensation::_fit() {
+  _c[0] = 0;
+  _c[1] = 1;
+  _c[2] = 0;
+  _c[3] = 0;
+  _terms = 0;
+  _referenceTemperature = 0;
+
+  if (_count) {
+    float minT = _points[0].temperature;
+    float maxT = _points[0].temperature;
+    double sumT = 0;
+    for (size_t i = 0; i < _count; i++) {
+      minT = std::min(minT, _points[i].temperature);
+      maxT = std::max(maxT, _points[i].temperature);
+      sumT += _points[i].temperature;
+    }
+    _referenceTemperature = sumT / _count;
+
+    const bool spread = maxT - minT >= MYCILA_HX711_MIN_TEMPERATURE_SPREAD;
+    size_t terms = 0;
+    if (spread && _count >= 5)
+      terms = 4;
+    else if (spread && _count >= 3)
+      terms = 3;
+    else if (_count >= 2)
+      terms = 2;
+
+    // degrade to a simpler model when the points do not allow to determine all the terms
+    while (terms >= 2 && !_solve(terms))
+      terms--;
+    _terms = terms < 2 ? 0 : terms;
+  }
+
+  setTemperature(_temperature);
+}
+
+bool Mycila::HX711Compensation::_solve(size_t terms) {
+  // normal equations A^T A x = A^T y, with weights in kg to keep the system well conditioned
+  double m[4][5] = {};
+  for (size_t i = 0; i < _count; i++) {
+    const double x = _points[i].measured / 1000.0;
+    const double dT = _points[i].temperature - _referenceTemperature;
+    const double f[4] = {1, x, dT, x * dT};
+    const double y = _points[i].expected / 1000.0;
+    for (size_t r = 0; r < terms; r++) {
+      for (size_t c = 0; c < terms; c++)
+        m[r][c] += f[r] * f[c];
+      m[r][terms] += f[r] * y;
+    }
+  }
+
+  // Gauss-Jordan elimination with partial pivoting
+  for (size_t col = 0; col < terms; col++) {
+    size_t pivot = col;
+    for (size_t r = col + 1; r < terms; r++)
+      if (fabs(m[r][col]) > fabs(m[pivot][col]))
+        pivot = r;
+    if (fabs(m[pivot][col]) < 1e-9)
+      return false;
+    if (pivot != col)
+      for (size_t c = 0; c <= terms; c++)
+        std::swap(m[col][c], m[pivot][c]);
+    for (size_t r = 0; r < terms; r++) {
+      if (r == col)
+        continue;
+      const double factor = m[r][col] / m[col][col];
+      for (size_t c = col; c <= terms; c++)
+        m[r][c] -= factor * m[col][c];
+    }
+  }
+
+  double a[4] = {0, 1, 0, 0};
+  for (size_t r = 0; r < terms; r++)
+    a[r] = m[r][terms] / m[r][r];
+
+  // back to grams
+  _c[0] = a[0] * 1000.0;
+  _c[1] = a[1];
+  _c[2] = a[2] * 1000.0;
+  _c[3] = a[3];
+  return true;
+}
@@ -0,0 +1,69 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#ifndef MYCILA_HX711_MAX_CALIBRATION_POINTS
+#define MYCILA_HX711_MAX_CALIBRATION_POINTS 8
+#endif
+
+// min temperature spread (C) between the calibration points to fit a temperature dependency
+#ifndef MYCILA_HX711_MIN_TEMPERATURE_SPREAD
+#define MYCILA_HX711_MIN_TEMPERATURE_SPREAD 2.0f
+#endif
+
+namespace Mycila {
+  typedef struct {
+      float measured;    // weight computed with the base offset and scale (g)
+      float expected;    // real weight on the scale (g)
+      float temperature; // C
+  } HX711CalibrationPoint;
+
+  // Corrects the weight computed from the base offset and scale with a model fitted by least squares on calibration points:
+  //   weight = c0 + c1 * measured + c2 * dT + c3 * measured * dT     with dT = temperature - reference temperature
+  // which is a gain and an offset both linear with the temperature.
+  // Terms are only fitted when there are enough points and enough temperature spread, otherwise they stay at identity.
+  // The gain and offset are precomputed for the current temperature so that apply() costs a multiply and an add.
+  class HX711Compensation {
+    public:
+      // returns false if the point was not added because the list is full
+      bool addPoint(float measured, float expected, float temperature);
+      void clear();
+      size_t getPointCount() const { return _count; }
+      const HX711CalibrationPoint& getPoint(size_t index) const { return _points[index]; }
+
+      // serialized as: measured:expected:temperature;measured:expected:temperature;...
+      void setPoints(const std::string& points);
+      std::string getPoints() const;
+
+      void setTemperature(float temperature);
+
+      float apply(float measured) const { return _offset + _gain * measured; }
+
+      const double* getCoefficients() const { return _c; }
+      float getReferenceTemperature() const { return _referenceTemperature; }
+      size_t getTermCount() const { return _terms; }
+
+    private:
+      HX711CalibrationPoint _points[MYCILA_HX711_MAX_CALIBRATION_POINTS];
+      size_t _count = 0;
+      // model
+      double _c[4] = {0, 1, 0, 0};
+      size_t _terms = 0;
+      float _referenceTemperature = 0;
+      float _temperature = 0;
+      // precomputed for the current temperature
+      float _gain = 1;
+      float _offset = 0;
+
+    private:
+      void _fit();
+      bool _solve(size_t terms);
+  };
+} // namespace Mycila
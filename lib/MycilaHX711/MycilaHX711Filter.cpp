@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <MycilaHX711Filter.h>
+
+#include <algorithm>
+#include <cstring>
+
+void Mycila::HX711Filter::setType(HX711FilterType type) {
+  if (_type != type) {
+    _type = type;
+    reset();
+  }
+}
+
+void Mycila::HX711Filter::reset() {
+  _count = 0;
+  _initialized = false;
+  _estimate = 0;
+  _errorCovariance = 0;
+}
+
+void Mycila::HX711Filter::add(float sample) {
+  if (_count < MYCILA_HX711_FILTER_WINDOW)
+    _window[_count++] = sample;
+
+  switch (_type) {
+    case HX711FilterType::EMA:
+      _estimate = _initialized ? _estimate + MYCILA_HX711_FILTER_EMA_ALPHA * (sample - _estimate) : sample;
+      _initialized = true;
+      break;
+
+    case HX711FilterType::KALMAN:
+      if (!_initialized) {
+        _estimate = sample;
+        _errorCovariance = MYCILA_HX711_FILTER_KALMAN_R;
+        _initialized = true;
+      } else {
+        // predict: weight is assumed constant, uncertainty grows with the process noise
+        _errorCovariance += MYCILA_HX711_FILTER_KALMAN_Q;
+        // update
+        const float gain = _errorCovariance / (_errorCovariance + MYCILA_HX711_FILTER_KALMAN_R);
+        _estimate += gain * (sample - _estimate);
+        _errorCovariance *= 1 - gain;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+float Mycila::HX711Filter::value() {
+  switch (_type) {
+    case HX711FilterType::EMA:
+    case HX711FilterType::KALMAN:
+      return _estimate;
+    default:
+      return reduce(_type, _window, _count);
+  }
+}
+
+float Mycila::HX711Filter::reduce(HX711FilterType type, float* values, size_t count) {
+  if (!count)
+    return 0;
+
+  switch (type) {
+    case HX711FilterType::MEDIAN: {
+      const size_t mid = count / 2;
+      std::nth_element(values, values + mid, values + count);
+      if (count & 1)
+        return values[mid];
+      // even count: average of the 2 middle values
+      const float upper = values[mid];
+      const float lower = *std::max_element(values, values + mid);
+      return (lower + upper) / 2;
+    }
+
+    case HX711FilterType::TRIMMED_MEAN: {
+      std::sort(values, values + count);
+      size_t trim = static_cast<size_t>(count * MYCILA_HX711_FILTER_TRIM);
+      if (trim * 2 >= count)
+        trim = (count - 1) / 2;
+      double sum = 0;
+      for (size_t i = trim; i < count - trim; i++)
+        sum += values[i];
+      return sum / (count - 2 * trim);
+    }
+
+    default: {
+      double sum = 0;
+      for (size_t i = 0; i < count; i++)
+        sum += values[i];
+      return sum / count;
+    }
+  }
+}
+
+Mycila::HX711FilterType Mycila::HX711Filter::parse(const char* name) {
+  if (name) {
+    if (!strcmp(name, "median"))
+      return HX711FilterType::MEDIAN;
+    if (!strcmp(name, "trimmed"))
+      return HX711FilterType::TRIMMED_MEAN;
+    if (!strcmp(name, "ema"))
+      return HX711FilterType::EMA;
+    if (!strcmp(name, "kalman"))
+      return HX711FilterType::KALMAN;
+  }
+  return HX711FilterType::MEAN;
+}
+
+const char* Mycila::HX711Filter::name(HX711FilterType type) {
+  switch (type) {
+    case HX711FilterType::MEDIAN:
+      return "median";
+    case HX711FilterType::TRIMMED_MEAN:
+      return "trimmed";
+    case HX711FilterType::EMA:
+      return "ema";
+    case HX711FilterType::KALMAN:
+      return "kalman";
+    default:
+      return "mean";
+  }
+}
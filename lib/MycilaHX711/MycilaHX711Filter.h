@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// max number of samples in a filter window
+#ifndef MYCILA_HX711_FILTER_WINDOW
+#define MYCILA_HX711_FILTER_WINDOW 32
+#endif
+
+// fraction of the sorted samples dropped at each end by the trimmed mean
+#ifndef MYCILA_HX711_FILTER_TRIM
+#define MYCILA_HX711_FILTER_TRIM 0.2f
+#endif
+
+// smoothing factor of the exponential moving average
+#ifndef MYCILA_HX711_FILTER_EMA_ALPHA
+#define MYCILA_HX711_FILTER_EMA_ALPHA 0.2f
+#endif
+
+// Kalman process noise (g^2 per sample): how fast the real weight is expected to move
+#ifndef MYCILA_HX711_FILTER_KALMAN_Q
+#define MYCILA_HX711_FILTER_KALMAN_Q 1.0f
+#endif
+
+// Kalman measurement noise (g^2): variance of a single HX711 sample
+#ifndef MYCILA_HX711_FILTER_KALMAN_R
+#define MYCILA_HX711_FILTER_KALMAN_R 400.0f
+#endif
+
+namespace Mycila {
+  enum class HX711FilterType {
+    // arithmetic mean of the window
+    MEAN = 0,
+    // median of the window: insensitive to spikes
+    MEDIAN,
+    // mean of the window after dropping the lowest and highest samples
+    TRIMMED_MEAN,
+    // exponential moving average, state kept across windows
+    EMA,
+    // 1-D Kalman filter (constant weight model), state kept across windows
+    KALMAN,
+  };
+
+  // Reduces the samples of an acquisition window to a single value.
+  // Batch filters (mean, median, trimmed mean) only look at the current window.
+  // Streaming filters (EMA, Kalman) update their state on each sample and keep it across windows until reset().
+  class HX711Filter {
+    public:
+      void setType(HX711FilterType type);
+      HX711FilterType getType() const { return _type; }
+
+      // clears the window and the streaming state
+      void reset();
+      // clears the window only: starts a new acquisition
+      void clearWindow() { _count = 0; }
+
+      void add(float sample);
+      size_t count() const { return _count; }
+      float value();
+
+      static float reduce(HX711FilterType type, float* values, size_t count);
+      static HX711FilterType parse(const char* name);
+      static const char* name(HX711FilterType type);
+
+    private:
+      HX711FilterType _type = HX711FilterType::MEAN;
+      float _window[MYCILA_HX711_FILTER_WINDOW];
+      size_t _count = 0;
+      // streaming state
+      bool _initialized = false;
+      float _estimate = 0;
+      float _errorCovariance = 0;
+  };
+} // namespace Mycila
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace Mycila {
+  // Lock-free single-producer / single-consumer ring buffer.
+  // One task (or ISR) pushes, one task pops: no lock is needed as long as this contract is respected.
+  // N must be a power of 2. One slot is always kept free to distinguish full from empty.
+  template <typename T, size_t N>
+  class SPSCRing {
+      static_assert(N >= 2 && (N & (N - 1)) == 0, "SPSCRing size must be a power of 2");
+
+    public:
+      // producer side
+      bool push(const T& value) {
+        const size_t head = _head.load(std::memory_order_relaxed);
+        const size_t next = (head + 1) & (N - 1);
+        if (next == _tail.load(std::memory_order_acquire))
+          return false; // full: newest sample is dropped
+        _buffer[head] = value;
+        _head.store(next, std::memory_order_release);
+        return true;
+      }
+
+      // consumer side
+      bool pop(T& value) {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire))
+          return false; // empty
+        value = _buffer[tail];
+        _tail.store((tail + 1) & (N - 1), std::memory_order_release);
+        return true;
+      }
+
+      // consumer side
+      void clear() { _tail.store(_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+      size_t size() const { return (_head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire)) & (N - 1); }
+      bool isEmpty() const { return size() == 0; }
+      constexpr size_t capacity() const { return N - 1; }
+
+    private:
+      T _buffer[N];
+      std::atomic<size_t> _head{0};
+      std::atomic<size_t> _tail{0};
+  };
+} // namespace Mycila
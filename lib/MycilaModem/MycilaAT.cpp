@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include "MycilaAT.h"
+
+#include <utility>
+
+namespace {
+  bool startsWith(const std::string& s, const std::string& prefix) {
+    return s.length() >= prefix.length() && s.compare(0, prefix.length(), prefix) == 0;
+  }
+} // namespace
+
+std::vector<std::string> Mycila::AT::split(const std::string& values) {
+  std::vector<std::string> out;
+  std::string value;
+  bool quoted = false;
+  for (char c : values) {
+    if (c == '"')
+      quoted = !quoted;
+    else if (c == ',' && !quoted) {
+      out.push_back(value);
+      value.clear();
+    } else
+      value += c;
+  }
+  out.push_back(value);
+  return out;
+}
+
+std::vector<std::string> Mycila::AT::parameters(const std::string& line) {
+  const size_t colon = line.find(':');
+  if (colon == std::string::npos)
+    return std::vector<std::string>();
+  const size_t start = line.find_first_not_of(' ', colon + 1);
+  if (start == std::string::npos)
+    return std::vector<std::string>();
+  return split(line.substr(start));
+}
+
+void Mycila::AT::Engine::enqueue(const std::string& command, uint32_t timeoutMs, ResponseCallback callback, const std::string& responsePrefix) {
+  _queue.push_back({command, timeoutMs, callback, responsePrefix});
+}
+
+void Mycila::AT::Engine::enqueueWait(const std::string& prefix, uint32_t timeoutMs, ResponseCallback callback) {
+  // no command to send
+  _queue.push_back({std::string(), timeoutMs, callback, prefix});
+}
+
+void Mycila::AT::Engine::loop() {
+  for (int c = _read(); c >= 0; c = _read()) {
+    if (c == '\n') {
+      if (!_overflow && !_rx.empty())
+        _onLine(_rx);
+      _rx.clear();
+      _overflow = false;
+      // a wait queued by a callback gets the next lines
+      if (!_inFlight && !_queue.empty() && _queue.front().command.empty())
+        _next();
+    } else if (c != '\r') {
+      if (_rx.length() < MYCILA_AT_MAX_LINE_LENGTH)
+        _rx += static_cast<char>(c);
+      else
+        _overflow = true;
+    }
+  }
+
+  if (_inFlight && std::chrono::steady_clock::now() - _sentAt >= std::chrono::milliseconds(_queue.front().timeoutMs))
+    _complete(AT_TIMEOUT);
+
+  if (!_inFlight && !_queue.empty())
+    _next();
+}
+
+void Mycila::AT::Engine::clear() {
+  _queue.clear();
+  _lines.clear();
+  _inFlight = false;
+}
+
+void Mycila::AT::Engine::_onLine(const std::string& line) {
+  if (!_inFlight) {
+    _dispatch(line);
+    return;
+  }
+
+  const Command& command = _queue.front();
+
+  // wait for a URC: the other lines are not a response
+  if (command.command.empty()) {
+    if (startsWith(line, command.responsePrefix)) {
+      _lines.push_back(line);
+      _complete(AT_OK);
+    } else {
+      _dispatch(line);
+    }
+    return;
+  }
+
+  // echo (ATE1)
+  if (line == command.command)
+    return;
+
+  if (line == "OK") {
+    _complete(AT_OK);
+    return;
+  }
+
+  if (line == "ERROR" || startsWith(line, "+CME ERROR") || startsWith(line, "+CMS ERROR")) {
+    _lines.push_back(line);
+    _complete(AT_ERROR);
+    return;
+  }
+
+  if (!command.responsePrefix.empty() && startsWith(line, command.responsePrefix)) {
+    _lines.push_back(line);
+    return;
+  }
+
+  if (!_dispatch(line) && command.responsePrefix.empty())
+    _lines.push_back(line);
+}
+
+bool Mycila::AT::Engine::_dispatch(const std::string& line) {
+  bool handled = false;
+  for (const Handler& handler : _handlers) {
+    if (startsWith(line, handler.prefix)) {
+      handler.callback(line);
+      handled = true;
+    }
+  }
+  return handled;
+}
+
+void Mycila::AT::Engine::_next() {
+  _lines.clear();
+  const Command& command = _queue.front();
+  if (command.command.empty()) {
+    _inFlight = true;
+    _sentAt = std::chrono::steady_clock::now();
+    return;
+  }
+  const std::string line = command.command + "\r\n";
+  if (_write(reinterpret_cast<const uint8_t*>(line.data()), line.length())) {
+    _inFlight = true;
+    _sentAt = std::chrono::steady_clock::now();
+  } else {
+    _complete(AT_ERROR);
+  }
+}
+
+void Mycila::AT::Engine::_complete(Result result) {
+  // the callback can queue the next commands
+  Command command = std::move(_queue.front());
+  std::vector<std::string> lines = std::move(_lines);
+  _queue.pop_front();
+  _lines.clear();
+  _inFlight = false;
+  if (command.callback)
+    command.callback(result, lines);
+}
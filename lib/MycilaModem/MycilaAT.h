@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+// default time given to a command to complete with its final result code (ms)
+#ifndef MYCILA_AT_TIMEOUT
+#define MYCILA_AT_TIMEOUT 10000
+#endif
+
+// longer lines are dropped
+#ifndef MYCILA_AT_MAX_LINE_LENGTH
+#define MYCILA_AT_MAX_LINE_LENGTH 1024
+#endif
+
+// Non-blocking AT command engine: the commands are queued and sent one at a time, each one with its own timeout,
+// and the received bytes are split into lines which either belong to the response of the command in progress
+// or are unsolicited result codes (URC) dispatched to the handlers registered for their prefix.
+// Nothing waits: loop() only consumes the bytes already received and the callbacks are called from loop().
+// Portable (no Arduino dependency): the bytes go through callbacks, like for Mycila::CoAP and Mycila::MQTT.
+namespace Mycila {
+  namespace AT {
+    typedef enum {
+      AT_OK = 0,
+      AT_ERROR,   // ERROR, +CME ERROR or +CMS ERROR
+      AT_TIMEOUT, // no final result code in time
+    } Result;
+
+    // writes all the bytes
+    typedef std::function<bool(const uint8_t* data, size_t size)> WriteCallback;
+    // next received byte, -1 if there is none (must not wait)
+    typedef std::function<int()> ReadCallback;
+    // response lines of a command: OK is excluded, the error result codes are included
+    typedef std::function<void(Result result, const std::vector<std::string>& lines)> ResponseCallback;
+    typedef std::function<void(const std::string& line)> URCCallback;
+
+    // values of a line like +CEREG: 1,"1A2B",7 (from the first space after the colon), without quotes
+    std::vector<std::string> parameters(const std::string& line);
+    // values separated by commas outside quotes, without quotes
+    std::vector<std::string> split(const std::string& values);
+
+    class Engine {
+      public:
+        Engine(WriteCallback write, ReadCallback read) : _write(write), _read(read) {}
+
+        // Queues a complete command line like AT+COPS=? (without CRLF).
+        // The lines starting with the response prefix (if any) always belong to the response,
+        // the other lines are dispatched to the URC handlers first, so that the reports of a query (AT+CEREG?)
+        // and the unsolicited ones (+CEREG: 5) are handled at the same place.
+        void enqueue(const std::string& command, uint32_t timeoutMs = MYCILA_AT_TIMEOUT, ResponseCallback callback = nullptr, const std::string& responsePrefix = "");
+        // Queues a wait for a URC, like the result of a command running in the background (+HTTPTOFS: 200,1234).
+        // The URC is the only response line. Queued from the callback of the command, the wait starts before the next line is read.
+        void enqueueWait(const std::string& prefix, uint32_t timeoutMs, ResponseCallback callback);
+        // handler for the lines starting with a prefix like +CEREG:
+        void onURC(const std::string& prefix, URCCallback callback) { _handlers.push_back({prefix, callback}); }
+
+        // reads the received lines, completes or times out the command in progress and sends the next one
+        void loop();
+        // drops the queued commands and forgets the one in progress, without calling their callbacks
+        void clear();
+
+        // a command is in progress or queued: the serial line must not be read by someone else
+        bool isBusy() const { return _inFlight || !_queue.empty(); }
+        size_t getQueueSize() const { return _queue.size(); }
+
+      private:
+        typedef struct {
+            std::string command;
+            uint32_t timeoutMs;
+            ResponseCallback callback;
+            std::string responsePrefix;
+        } Command;
+
+        typedef struct {
+            std::string prefix;
+            URCCallback callback;
+        } Handler;
+
+        WriteCallback _write;
+        ReadCallback _read;
+        std::deque<Command> _queue;
+        std::vector<Handler> _handlers;
+        bool _inFlight = false;
+        std::chrono::steady_clock::time_point _sentAt;
+        std::vector<std::string> _lines;
+        std::string _rx;
+        bool _overflow = false;
+
+      private:
+        void _onLine(const std::string& line);
+        bool _dispatch(const std::string& line);
+        void _complete(Result result);
+        void _next();
+    };
+  } // namespace AT
+} // namespace Mycila
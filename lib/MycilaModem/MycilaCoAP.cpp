@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include "MycilaCoAP.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define COAP_VERSION 1
+
+#define COAP_CODE_EMPTY 0
+#define COAP_CODE_POST  2
+
+#define COAP_OPTION_URI_HOST       3
+#define COAP_OPTION_URI_PATH       11
+#define COAP_OPTION_CONTENT_FORMAT 12
+#define COAP_OPTION_URI_QUERY      15
+
+#define COAP_PAYLOAD_MARKER 0xff
+
+namespace {
+  // option extended value: 13 => 1 more byte, 14 => 2 more bytes
+  uint8_t optionNibble(size_t value) { return value < 13 ? value : value < 269 ? 13 : 14; }
+
+  void optionExtended(std::string& out, size_t value) {
+    if (value >= 269) {
+      out += static_cast<char>((value - 269) >> 8);
+      out += static_cast<char>(value - 269);
+    } else if (value >= 13) {
+      out += static_cast<char>(value - 13);
+    }
+  }
+
+  void addOption(std::string& out, uint16_t& last, uint16_t number, const std::string& value) {
+    const uint16_t delta = number - last;
+    last = number;
+    out += static_cast<char>(optionNibble(delta) << 4 | optionNibble(value.length()));
+    optionExtended(out, delta);
+    optionExtended(out, value.length());
+    out += value;
+  }
+
+  // adds an option for each part of the value separated by the separator
+  void addOptions(std::string& out, uint16_t& last, uint16_t number, const std::string& value, char separator) {
+    size_t start = 0;
+    while (start < value.length()) {
+      size_t end = value.find(separator, start);
+      if (end == std::string::npos)
+        end = value.length();
+      if (end > start)
+        addOption(out, last, number, value.substr(start, end - start));
+      start = end + 1;
+    }
+  }
+
+  bool readExtended(const std::string& in, size_t& pos, uint8_t nibble, size_t& value) {
+    if (nibble < 13) {
+      value = nibble;
+    } else if (nibble == 13) {
+      if (pos + 1 > in.length())
+        return false;
+      value = static_cast<uint8_t>(in[pos++]) + 13;
+    } else if (nibble == 14) {
+      if (pos + 2 > in.length())
+        return false;
+      value = (static_cast<uint8_t>(in[pos]) << 8 | static_cast<uint8_t>(in[pos + 1])) + 269;
+      pos += 2;
+    } else {
+      return false;
+    }
+    return true;
+  }
+} // namespace
+
+bool Mycila::CoAP::parseURL(const std::string& url, URL& out) {
+  const size_t sep = url.find("://");
+  if (sep == std::string::npos)
+    return false;
+
+  out.scheme = url.substr(0, sep);
+  std::transform(out.scheme.begin(), out.scheme.end(), out.scheme.begin(), ::tolower);
+  if (out.scheme != "coap" && out.scheme != "coaps")
+    return false;
+
+  const size_t hostStart = sep + 3;
+  size_t hostEnd = url.find_first_of(":/?", hostStart);
+  if (hostEnd == std::string::npos)
+    hostEnd = url.length();
+  out.host = url.substr(hostStart, hostEnd - hostStart);
+  if (out.host.empty())
+    return false;
+
+  size_t pos = hostEnd;
+  out.port = out.scheme == "coaps" ? MYCILA_COAPS_PORT : MYCILA_COAP_PORT;
+  if (pos < url.length() && url[pos] == ':') {
+    const size_t portEnd = std::min(url.find_first_of("/?", pos), url.length());
+    const long port = strtol(url.substr(pos + 1, portEnd - pos - 1).c_str(), nullptr, 10);
+    if (port <= 0 || port > 65535)
+      return false;
+    out.port = port;
+    pos = portEnd;
+  }
+
+  out.path.clear();
+  out.query.clear();
+  if (pos < url.length() && url[pos] == '/') {
+    const size_t pathEnd = std::min(url.find('?', pos), url.length());
+    out.path = url.substr(pos + 1, pathEnd - pos - 1);
+    pos = pathEnd;
+  }
+  if (pos < url.length() && url[pos] == '?')
+    out.query = url.substr(pos + 1);
+
+  return true;
+}
+
+int Mycila::CoAP::toContentFormat(const char* contentType) {
+  if (!contentType)
+    return -1;
+  if (strcmp(contentType, "text/plain") == 0)
+    return 0;
+  if (strcmp(contentType, "application/octet-stream") == 0)
+    return 42;
+  if (strcmp(contentType, "application/json") == 0)
+    return 50;
+  if (strcmp(contentType, "application/cbor") == 0)
+    return 60;
+  // not registered (application/msgpack)
+  return -1;
+}
+
+std::string Mycila::CoAP::encode(const Message& message, const URL& url, int contentFormat) {
+  std::string out;
+  out.reserve(16 + url.host.length() + url.path.length() + url.query.length() + message.payload.length());
+
+  out += static_cast<char>(COAP_VERSION << 6 | message.type << 4 | message.token.length());
+  out += static_cast<char>(message.code);
+  out += static_cast<char>(message.messageId >> 8);
+  out += static_cast<char>(message.messageId);
+  out += message.token;
+
+  // empty messages (ACK, RST) have no options
+  if (message.code == COAP_CODE_EMPTY)
+    return out;
+
+  // options by increasing number
+  uint16_t last = 0;
+  if (!url.host.empty())
+    addOption(out, last, COAP_OPTION_URI_HOST, url.host);
+  addOptions(out, last, COAP_OPTION_URI_PATH, url.path, '/');
+  if (contentFormat >= 0) {
+    // uint option: minimal number of bytes
+    std::string value;
+    if (contentFormat > 0xff)
+      value += static_cast<char>(contentFormat >> 8);
+    if (contentFormat > 0)
+      value += static_cast<char>(contentFormat);
+    addOption(out, last, COAP_OPTION_CONTENT_FORMAT, value);
+  }
+  addOptions(out, last, COAP_OPTION_URI_QUERY, url.query, '&');
+
+  if (!message.payload.empty()) {
+    out += static_cast<char>(COAP_PAYLOAD_MARKER);
+    out += message.payload;
+  }
+
+  return out;
+}
+
+bool Mycila::CoAP::decode(const std::string& datagram, Message& message) {
+  if (datagram.length() < 4)
+    return false;
+
+  const uint8_t header = datagram[0];
+  const uint8_t tokenLength = header & 0x0f;
+  if (header >> 6 != COAP_VERSION || tokenLength > 8 || datagram.length() < 4u + tokenLength)
+    return false;
+
+  message.type = static_cast<MessageType>(header >> 4 & 0x03);
+  message.code = datagram[1];
+  message.messageId = static_cast<uint8_t>(datagram[2]) << 8 | static_cast<uint8_t>(datagram[3]);
+  message.token = datagram.substr(4, tokenLength);
+  message.payload.clear();
+
+  // skip the options
+  size_t pos = 4 + tokenLength;
+  while (pos < datagram.length()) {
+    const uint8_t b = datagram[pos++];
+    if (b == COAP_PAYLOAD_MARKER) {
+      message.payload = datagram.substr(pos);
+      break;
+    }
+    size_t delta;
+    size_t length;
+    if (!readExtended(datagram, pos, b >> 4, delta) || !readExtended(datagram, pos, b & 0x0f, length) || pos + length > datagram.length())
+      return false;
+    pos += length;
+  }
+
+  return true;
+}
+
+Mycila::CoAP::Result Mycila::CoAP::post(const URL& url,
+                                        const std::string& payload,
+                                        int contentFormat,
+                                        uint16_t messageId,
+                                        const std::string& token,
+                                        SendCallback send,
+                                        ReceiveCallback receive,
+                                        Message& response,
+                                        uint32_t ackTimeoutMs,
+                                        uint8_t maxRetransmit) {
+  Message request;
+  request.type = COAP_CON;
+  request.code = COAP_CODE_POST;
+  request.messageId = messageId;
+  request.token = token;
+  request.payload = payload;
+  const std::string datagram = encode(request, url, contentFormat);
+
+  Message message;
+  std::string received;
+  uint32_t timeout = ackTimeoutMs;
+  bool acknowledged = false;
+
+  for (uint8_t attempt = 0; attempt <= maxRetransmit; attempt++, timeout *= 2) {
+    if (!acknowledged && !send(datagram))
+      return COAP_SEND_FAILED;
+
+    while (receive(received, timeout)) {
+      if (!decode(received, message))
+        continue;
+
+      if (message.type == COAP_RST && message.messageId == messageId)
+        return COAP_RESET;
+
+      if (message.type == COAP_ACK && message.messageId == messageId) {
+        // piggybacked response
+        if (message.code != COAP_CODE_EMPTY) {
+          response = message;
+          return COAP_OK;
+        }
+        // separate response will follow: no more retransmissions
+        acknowledged = true;
+        continue;
+      }
+
+      // separate response (RFC 7252 §5.2.2), matched by token
+      if ((message.type == COAP_CON || message.type == COAP_NON) && message.code != COAP_CODE_EMPTY && message.token == token) {
+        if (message.type == COAP_CON) {
+          Message ack;
+          ack.type = COAP_ACK;
+          ack.code = COAP_CODE_EMPTY;
+          ack.messageId = message.messageId;
+          send(encode(ack, url));
+        }
+        response = message;
+        return COAP_OK;
+      }
+    }
+  }
+
+  return COAP_TIMEOUT;
+}
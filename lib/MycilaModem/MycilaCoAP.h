@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+// CoAP transmission parameters (RFC 7252 §4.8), ACK timeout raised for NB-IoT latency
+#ifndef MYCILA_COAP_ACK_TIMEOUT
+#define MYCILA_COAP_ACK_TIMEOUT 4000
+#endif
+
+#ifndef MYCILA_COAP_MAX_RETRANSMIT
+#define MYCILA_COAP_MAX_RETRANSMIT 4
+#endif
+
+#ifndef MYCILA_COAP_PORT
+#define MYCILA_COAP_PORT 5683
+#endif
+
+#ifndef MYCILA_COAPS_PORT
+#define MYCILA_COAPS_PORT 5684
+#endif
+
+// Minimal CoAP client (RFC 7252): confirmable POST with retransmissions, piggybacked and separate responses.
+// Portable (no Arduino dependency): the datagrams are sent and received through callbacks,
+// so that it runs over the modem UDP sockets as well as over a Linux socket against a local CoAP server.
+namespace Mycila {
+  namespace CoAP {
+    typedef enum {
+      COAP_CON = 0,
+      COAP_NON = 1,
+      COAP_ACK = 2,
+      COAP_RST = 3,
+    } MessageType;
+
+    typedef enum {
+      COAP_OK = 0,
+      COAP_TIMEOUT,     // no response after all the retransmissions
+      COAP_RESET,       // the server rejected the message
+      COAP_SEND_FAILED, // the datagram could not be sent
+    } Result;
+
+    typedef struct {
+        std::string scheme; // coap or coaps
+        std::string host;
+        uint16_t port = 0;
+        std::string path;  // without leading /
+        std::string query; // without leading ?
+    } URL;
+
+    typedef struct {
+        MessageType type = COAP_CON;
+        uint8_t code = 0; // class << 5 | detail: 0.02 (POST) = 2, 2.04 (Changed) = 68
+        uint16_t messageId = 0;
+        std::string token;
+        std::string payload;
+    } Message;
+
+    // sends a datagram
+    typedef std::function<bool(const std::string& datagram)> SendCallback;
+    // waits at most timeoutMs for a datagram, returns false on timeout
+    typedef std::function<bool(std::string& datagram, uint32_t timeoutMs)> ReceiveCallback;
+
+    // coap://host[:port][/path][?query], also coaps://
+    bool parseURL(const std::string& url, URL& out);
+    // Content-Format option for a content type, -1 if there is none
+    int toContentFormat(const char* contentType);
+
+    std::string encode(const Message& message, const URL& url, int contentFormat = -1);
+    bool decode(const std::string& datagram, Message& message);
+
+    // class of a response code: 2 for success, 4 for client errors, 5 for server errors
+    inline uint8_t codeClass(uint8_t code) { return code >> 5; }
+
+    // sends a confirmable POST and waits for its response
+    Result post(const URL& url,
+                const std::string& payload,
+                int contentFormat,
+                uint16_t messageId,
+                const std::string& token,
+                SendCallback send,
+                ReceiveCallback receive,
+                Message& response,
+                uint32_t ackTimeoutMs = MYCILA_COAP_ACK_TIMEOUT,
+                uint8_t maxRetransmit = MYCILA_COAP_MAX_RETRANSMIT);
+  } // namespace CoAP
+} // namespace Mycila
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include "MycilaFrame.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+  uint32_t elapsedSince(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+} // namespace
+
+bool Mycila::Frame::parseURL(const std::string& url, URL& out) {
+  const size_t sep = url.find("://");
+  if (sep == std::string::npos)
+    return false;
+
+  std::string scheme = url.substr(0, sep);
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+  if (scheme != "tcp" && scheme != "udp")
+    return false;
+  out.udp = scheme == "udp";
+
+  // no default port for connectors
+  const size_t hostStart = sep + 3;
+  const size_t colon = url.find(':', hostStart);
+  if (colon == std::string::npos)
+    return false;
+  out.host = url.substr(hostStart, colon - hostStart);
+
+  const size_t portEnd = std::min(url.find('/', colon), url.length());
+  const long port = strtol(url.substr(colon + 1, portEnd - colon - 1).c_str(), nullptr, 10);
+  if (port <= 0 || port > 65535)
+    return false;
+  out.port = port;
+
+  return !out.host.empty();
+}
+
+std::string Mycila::Frame::encode(uint16_t sequence, const std::string& payload) {
+  std::string frame;
+  frame.reserve(MYCILA_FRAME_HEADER_SIZE + payload.length());
+  frame += static_cast<char>(payload.length() >> 8);
+  frame += static_cast<char>(payload.length());
+  frame += static_cast<char>(sequence >> 8);
+  frame += static_cast<char>(sequence);
+  frame += payload;
+  return frame;
+}
+
+void Mycila::Frame::decodeHeader(const uint8_t* data, uint16_t& length, uint16_t& sequence) {
+  length = data[0] << 8 | data[1];
+  sequence = data[2] << 8 | data[3];
+}
+
+Mycila::Frame::Result Mycila::Frame::send(uint16_t sequence, const std::string& payload, WriteCallback write, ReadCallback read, uint32_t timeoutMs) {
+  const std::string frame = encode(sequence, payload);
+  if (!write(reinterpret_cast<const uint8_t*>(frame.data()), frame.length()))
+    return FRAME_IO_ERROR;
+
+  const auto start = std::chrono::steady_clock::now();
+  uint8_t header[MYCILA_FRAME_HEADER_SIZE];
+  uint16_t length;
+  uint16_t ack;
+
+  for (uint32_t elapsed = 0; elapsed < timeoutMs; elapsed = elapsedSince(start)) {
+    size_t n = 0;
+    while (n < MYCILA_FRAME_HEADER_SIZE) {
+      const size_t r = read(header + n, MYCILA_FRAME_HEADER_SIZE - n, timeoutMs - std::min(timeoutMs, elapsedSince(start)));
+      if (!r)
+        return n ? FRAME_PROTOCOL_ERROR : FRAME_TIMEOUT;
+      n += r;
+    }
+
+    decodeHeader(header, length, ack);
+
+    // frames with a payload are not expected from the server: skipped
+    uint8_t skipped[32];
+    while (length) {
+      const size_t r = read(skipped, std::min(length, static_cast<uint16_t>(sizeof(skipped))), timeoutMs - std::min(timeoutMs, elapsedSince(start)));
+      if (!r)
+        return FRAME_PROTOCOL_ERROR;
+      length -= r;
+    }
+
+    // late ACKs of previous frames are ignored
+    if (ack == sequence)
+      return FRAME_OK;
+  }
+
+  return FRAME_TIMEOUT;
+}
+
+Mycila::Frame::Result Mycila::Frame::send(uint16_t sequence,
+                                          const std::string& payload,
+                                          SendCallback send,
+                                          ReceiveCallback receive,
+                                          uint32_t ackTimeoutMs,
+                                          uint8_t maxRetransmit) {
+  const std::string frame = encode(sequence, payload);
+  std::string received;
+  uint16_t length;
+  uint16_t ack;
+
+  uint32_t timeout = ackTimeoutMs;
+  for (uint8_t attempt = 0; attempt <= maxRetransmit; attempt++, timeout *= 2) {
+    if (!send(frame))
+      return FRAME_IO_ERROR;
+
+    while (receive(received, timeout)) {
+      if (received.length() < MYCILA_FRAME_HEADER_SIZE)
+        continue;
+      decodeHeader(reinterpret_cast<const uint8_t*>(received.data()), length, ack);
+      if (!length && ack == sequence)
+        return FRAME_OK;
+    }
+  }
+
+  return FRAME_TIMEOUT;
+}
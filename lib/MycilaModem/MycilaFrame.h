@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+// ACK timeout of a datagram, doubled at each retransmission
+#ifndef MYCILA_FRAME_ACK_TIMEOUT
+#define MYCILA_FRAME_ACK_TIMEOUT 4000
+#endif
+
+#ifndef MYCILA_FRAME_MAX_RETRANSMIT
+#define MYCILA_FRAME_MAX_RETRANSMIT 2
+#endif
+
+#define MYCILA_FRAME_HEADER_SIZE 4
+
+// Length-prefixed frames with an application ACK, for connector-style servers over raw TCP or UDP sockets:
+//
+//   frame: [payload length (u16, big endian)][sequence (u16, big endian)][payload]
+//   ACK:   [0x0000][sequence]    an empty frame echoing the sequence of the received frame
+//
+// Over TCP the frames follow each other on the stream, over UDP each frame is one datagram (retransmitted until ACKed).
+// Portable (no Arduino dependency): the bytes go through callbacks, like for Mycila::CoAP and Mycila::MQTT.
+namespace Mycila {
+  namespace Frame {
+    typedef enum {
+      FRAME_OK = 0,
+      FRAME_TIMEOUT,        // not acknowledged in time
+      FRAME_PROTOCOL_ERROR, // malformed frame on the stream
+      FRAME_IO_ERROR,       // the bytes could not be written
+    } Result;
+
+    typedef struct {
+        bool udp = false; // udp:// or tcp://
+        std::string host;
+        uint16_t port = 0;
+    } URL;
+
+    // tcp://host:port or udp://host:port
+    bool parseURL(const std::string& url, URL& out);
+
+    std::string encode(uint16_t sequence, const std::string& payload);
+    // decodes the header at the beginning of data (at least MYCILA_FRAME_HEADER_SIZE bytes)
+    void decodeHeader(const uint8_t* data, uint16_t& length, uint16_t& sequence);
+
+    // writes all the bytes
+    typedef std::function<bool(const uint8_t* data, size_t size)> WriteCallback;
+    // reads at most size bytes, waiting at most timeoutMs for them, and returns the number of bytes read
+    typedef std::function<size_t(uint8_t* data, size_t size, uint32_t timeoutMs)> ReadCallback;
+    // sends a datagram
+    typedef std::function<bool(const std::string& datagram)> SendCallback;
+    // waits at most timeoutMs for a datagram, returns false on timeout
+    typedef std::function<bool(std::string& datagram, uint32_t timeoutMs)> ReceiveCallback;
+
+    // sends a frame on a stream and waits for its ACK
+    Result send(uint16_t sequence, const std::string& payload, WriteCallback write, ReadCallback read, uint32_t timeoutMs);
+    // sends a frame in a datagram and waits for its ACK, retransmitting it
+    Result send(uint16_t sequence,
+                const std::string& payload,
+                SendCallback send,
+                ReceiveCallback receive,
+                uint32_t ackTimeoutMs = MYCILA_FRAME_ACK_TIMEOUT,
+                uint8_t maxRetransmit = MYCILA_FRAME_MAX_RETRANSMIT);
+  } // namespace Frame
+} // namespace Mycila
@@ -0,0 +1,349 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include "MycilaMQTT.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+
+#define MQTT_PROTOCOL_LEVEL 4 // 3.1.1
+
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_PUBREC      0x50
+#define MQTT_PUBREL      0x60
+#define MQTT_PUBCOMP     0x70
+#define MQTT_SUBSCRIBE   0x80
+#define MQTT_SUBACK      0x90
+#define MQTT_PINGREQ     0xc0
+#define MQTT_PINGRESP    0xd0
+#define MQTT_DISCONNECT  0xe0
+#define MQTT_TYPE_MASK   0xf0
+#define MQTT_FLAGS_MASK  0x0f
+
+#define MQTT_CONNECT_CLEAN_SESSION 0x02
+#define MQTT_CONNECT_PASSWORD      0x40
+#define MQTT_CONNECT_USERNAME      0x80
+
+#define MQTT_SUBACK_FAILURE 0x80
+
+// time to read the rest of a packet once its first byte is received
+#define MQTT_PACKET_TIMEOUT 5000
+
+namespace {
+  void writeString(std::string& out, const std::string& value) {
+    out += static_cast<char>(value.length() >> 8);
+    out += static_cast<char>(value.length());
+    out += value;
+  }
+
+  void writeId(std::string& out, uint16_t id) {
+    out += static_cast<char>(id >> 8);
+    out += static_cast<char>(id);
+  }
+
+  uint16_t readId(const std::string& in, size_t pos) {
+    return static_cast<uint8_t>(in[pos]) << 8 | static_cast<uint8_t>(in[pos + 1]);
+  }
+
+  uint32_t elapsedSince(const std::chrono::steady_clock::time_point& start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+} // namespace
+
+bool Mycila::MQTT::parseURL(const std::string& url, URL& out) {
+  const size_t sep = url.find("://");
+  if (sep == std::string::npos)
+    return false;
+
+  std::string scheme = url.substr(0, sep);
+  std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+  if (scheme != "mqtt" && scheme != "mqtts")
+    return false;
+  out.secure = scheme == "mqtts";
+
+  size_t start = sep + 3;
+  const size_t slash = std::min(url.find('/', start), url.length());
+
+  // credentials
+  out.username.clear();
+  out.password.clear();
+  const size_t at = url.rfind('@', slash);
+  if (at != std::string::npos && at >= start) {
+    const std::string credentials = url.substr(start, at - start);
+    const size_t colon = credentials.find(':');
+    out.username = credentials.substr(0, colon);
+    if (colon != std::string::npos)
+      out.password = credentials.substr(colon + 1);
+    start = at + 1;
+  }
+
+  const size_t colon = url.find(':', start);
+  out.port = out.secure ? MYCILA_MQTTS_PORT : MYCILA_MQTT_PORT;
+  if (colon != std::string::npos && colon < slash) {
+    const long port = strtol(url.substr(colon + 1, slash - colon - 1).c_str(), nullptr, 10);
+    if (port <= 0 || port > 65535)
+      return false;
+    out.port = port;
+    out.host = url.substr(start, colon - start);
+  } else {
+    out.host = url.substr(start, slash - start);
+  }
+
+  out.topic = slash < url.length() ? url.substr(slash + 1) : "";
+
+  return !out.host.empty() && !out.topic.empty();
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::connect(const std::string& clientId,
+                                                   const std::string& username,
+                                                   const std::string& password,
+                                                   uint16_t keepAliveSec,
+                                                   bool cleanSession,
+                                                   uint32_t timeoutMs) {
+  uint8_t flags = cleanSession ? MQTT_CONNECT_CLEAN_SESSION : 0;
+  if (!username.empty())
+    flags |= MQTT_CONNECT_USERNAME;
+  if (!password.empty())
+    flags |= MQTT_CONNECT_PASSWORD;
+
+  std::string body;
+  writeString(body, "MQTT");
+  body += static_cast<char>(MQTT_PROTOCOL_LEVEL);
+  body += static_cast<char>(flags);
+  writeId(body, keepAliveSec);
+  writeString(body, clientId);
+  if (!username.empty())
+    writeString(body, username);
+  if (!password.empty())
+    writeString(body, password);
+
+  _sessionPresent = false;
+  if (!_send(MQTT_CONNECT, body))
+    return MQTT_IO_ERROR;
+
+  std::string connack;
+  const Result result = _wait(MQTT_CONNACK, 0, connack, timeoutMs);
+  if (result != MQTT_OK)
+    return result;
+  if (connack.length() != 2)
+    return MQTT_PROTOCOL_ERROR;
+  if (connack[1] != 0)
+    return MQTT_REFUSED;
+
+  _sessionPresent = connack[0] & 0x01;
+  return MQTT_OK;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::subscribe(const std::string& topic, uint8_t qos, uint32_t timeoutMs) {
+  const uint16_t id = _nextPacketId();
+  std::string body;
+  writeId(body, id);
+  writeString(body, topic);
+  body += static_cast<char>(qos);
+
+  if (!_send(MQTT_SUBSCRIBE | 0x02, body))
+    return MQTT_IO_ERROR;
+
+  std::string suback;
+  const Result result = _wait(MQTT_SUBACK, id, suback, timeoutMs);
+  if (result != MQTT_OK)
+    return result;
+  if (suback.length() != 3)
+    return MQTT_PROTOCOL_ERROR;
+  return static_cast<uint8_t>(suback[2]) == MQTT_SUBACK_FAILURE ? MQTT_REFUSED : MQTT_OK;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::publish(const std::string& topic, const std::string& payload, uint8_t qos, bool retain, uint32_t timeoutMs) {
+  qos = std::min(qos, static_cast<uint8_t>(1));
+  const uint16_t id = qos ? _nextPacketId() : 0;
+
+  std::string body;
+  body.reserve(topic.length() + payload.length() + 4);
+  writeString(body, topic);
+  if (qos)
+    writeId(body, id);
+  body += payload;
+
+  if (!_send(MQTT_PUBLISH | qos << 1 | (retain ? 0x01 : 0x00), body))
+    return MQTT_IO_ERROR;
+
+  if (!qos)
+    return MQTT_OK;
+
+  std::string puback;
+  return _wait(MQTT_PUBACK, id, puback, timeoutMs);
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::poll(uint32_t timeoutMs) {
+  const auto start = std::chrono::steady_clock::now();
+  uint8_t header;
+  std::string body;
+  for (uint32_t elapsed = 0; elapsed < timeoutMs; elapsed = elapsedSince(start)) {
+    const Result result = _receive(header, body, timeoutMs - elapsed);
+    if (result == MQTT_TIMEOUT)
+      return MQTT_OK;
+    if (result != MQTT_OK)
+      return result;
+    const Result handled = _handle(header, body);
+    if (handled != MQTT_OK)
+      return handled;
+  }
+  return MQTT_OK;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::ping(uint32_t timeoutMs) {
+  if (!_send(MQTT_PINGREQ, ""))
+    return MQTT_IO_ERROR;
+  std::string pingresp;
+  return _wait(MQTT_PINGRESP, 0, pingresp, timeoutMs);
+}
+
+void Mycila::MQTT::Client::disconnect() {
+  _send(MQTT_DISCONNECT, "");
+}
+
+uint16_t Mycila::MQTT::Client::_nextPacketId() {
+  // 0 is not a valid packet id
+  if (++_packetId == 0)
+    _packetId = 1;
+  return _packetId;
+}
+
+bool Mycila::MQTT::Client::_send(uint8_t header, const std::string& body) {
+  std::string packet;
+  packet.reserve(body.length() + 5);
+  packet += static_cast<char>(header);
+  // remaining length: 7 bits per byte, least significant first
+  size_t length = body.length();
+  do {
+    uint8_t b = length & 0x7f;
+    length >>= 7;
+    if (length)
+      b |= 0x80;
+    packet += static_cast<char>(b);
+  } while (length);
+  packet += body;
+  return _write(reinterpret_cast<const uint8_t*>(packet.data()), packet.length());
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::_receive(uint8_t& header, std::string& body, uint32_t timeoutMs) {
+  if (_read(&header, 1, timeoutMs) != 1)
+    return MQTT_TIMEOUT;
+
+  size_t length = 0;
+  uint8_t b;
+  for (uint8_t shift = 0;; shift += 7) {
+    if (shift > 21 || _read(&b, 1, MQTT_PACKET_TIMEOUT) != 1)
+      return MQTT_PROTOCOL_ERROR;
+    length |= static_cast<size_t>(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      break;
+  }
+  // the session is persistent: a message too big would be redelivered at each connection if it was not acknowledged
+  if (length > MYCILA_MQTT_MAX_PACKET_SIZE)
+    return _discard(header, body, length);
+
+  body.resize(length);
+  for (size_t pos = 0; pos < length;) {
+    const size_t n = _read(reinterpret_cast<uint8_t*>(&body[pos]), length - pos, MQTT_PACKET_TIMEOUT);
+    if (!n)
+      return MQTT_PROTOCOL_ERROR;
+    pos += n;
+  }
+
+  return MQTT_OK;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::_discard(uint8_t& header, std::string& body, size_t length) {
+  // only the beginning (topic and packet id) is kept
+  body.resize(MYCILA_MQTT_MAX_PACKET_SIZE);
+  uint8_t skipped[64];
+  for (size_t pos = 0; pos < length;) {
+    uint8_t* buffer = pos < body.length() ? reinterpret_cast<uint8_t*>(&body[pos]) : skipped;
+    const size_t size = pos < body.length() ? body.length() - pos : std::min(length - pos, sizeof(skipped));
+    const size_t n = _read(buffer, size, MQTT_PACKET_TIMEOUT);
+    if (!n)
+      return MQTT_PROTOCOL_ERROR;
+    pos += n;
+  }
+
+  std::string topic;
+  if ((header & MQTT_TYPE_MASK) == MQTT_PUBLISH) {
+    const uint8_t qos = (header & MQTT_FLAGS_MASK) >> 1 & 0x03;
+    const size_t topicLength = readId(body, 0);
+    if (2 + topicLength + 2 > MYCILA_MQTT_MAX_PACKET_SIZE)
+      return MQTT_PROTOCOL_ERROR;
+    topic = body.substr(2, topicLength);
+    if (qos) {
+      std::string ack;
+      writeId(ack, readId(body, 2 + topicLength));
+      if (!_send(qos == 1 ? MQTT_PUBACK : MQTT_PUBREC, ack))
+        return MQTT_IO_ERROR;
+    }
+  }
+
+  if (_onDrop)
+    _onDrop(header, topic, length);
+
+  header = 0;
+  body.clear();
+  return MQTT_OK;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::_wait(uint8_t type, uint16_t packetId, std::string& body, uint32_t timeoutMs) {
+  const auto start = std::chrono::steady_clock::now();
+  uint8_t header;
+  for (uint32_t elapsed = 0; elapsed < timeoutMs; elapsed = elapsedSince(start)) {
+    const Result result = _receive(header, body, timeoutMs - elapsed);
+    if (result != MQTT_OK)
+      return result;
+    if ((header & MQTT_TYPE_MASK) == type && (!packetId || (body.length() >= 2 && readId(body, 0) == packetId)))
+      return MQTT_OK;
+    const Result handled = _handle(header, body);
+    if (handled != MQTT_OK)
+      return handled;
+  }
+  return MQTT_TIMEOUT;
+}
+
+Mycila::MQTT::Result Mycila::MQTT::Client::_handle(uint8_t header, const std::string& body) {
+  switch (header & MQTT_TYPE_MASK) {
+    case MQTT_PUBLISH: {
+      const uint8_t qos = (header & MQTT_FLAGS_MASK) >> 1 & 0x03;
+      if (body.length() < 2)
+        return MQTT_PROTOCOL_ERROR;
+      const size_t topicLength = readId(body, 0);
+      const size_t payloadStart = 2 + topicLength + (qos ? 2 : 0);
+      if (payloadStart > body.length())
+        return MQTT_PROTOCOL_ERROR;
+
+      // acknowledged before the callback: a QoS 1 message can be redelivered anyway
+      if (qos) {
+        std::string ack;
+        writeId(ack, readId(body, 2 + topicLength));
+        if (!_send(qos == 1 ? MQTT_PUBACK : MQTT_PUBREC, ack))
+          return MQTT_IO_ERROR;
+      }
+
+      if (_onMessage)
+        _onMessage(body.substr(2, topicLength), body.substr(payloadStart));
+      return MQTT_OK;
+    }
+
+    case MQTT_PUBREL:
+      // QoS 2 message already delivered at PUBLISH
+      if (body.length() != 2)
+        return MQTT_PROTOCOL_ERROR;
+      return _send(MQTT_PUBCOMP, body) ? MQTT_OK : MQTT_IO_ERROR;
+
+    default:
+      // PINGRESP, late acknowledgements...
+      return MQTT_OK;
+  }
+}
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#ifndef MYCILA_MQTT_PORT
+#define MYCILA_MQTT_PORT 1883
+#endif
+
+#ifndef MYCILA_MQTTS_PORT
+#define MYCILA_MQTTS_PORT 8883
+#endif
+
+// largest packet accepted from the broker
+#ifndef MYCILA_MQTT_MAX_PACKET_SIZE
+#define MYCILA_MQTT_MAX_PACKET_SIZE 2048
+#endif
+
+// Minimal MQTT 3.1.1 client: connect (with or without clean session), subscribe, publish at QoS 0 or 1,
+// and delivery of the received messages (QoS 0 or 1) to a callback.
+// Portable (no Arduino dependency): the bytes are written and read through callbacks,
+// so that it runs over a modem TCP client as well as over a Linux socket against a local broker.
+// Not thread-safe.
+namespace Mycila {
+  namespace MQTT {
+    typedef enum {
+      MQTT_OK = 0,
+      MQTT_TIMEOUT,        // no answer from the broker
+      MQTT_REFUSED,        // connection or subscription refused
+      MQTT_PROTOCOL_ERROR, // malformed or unexpected packet
+      MQTT_IO_ERROR,       // the bytes could not be written
+    } Result;
+
+    typedef struct {
+        bool secure = false; // mqtts://
+        std::string host;
+        uint16_t port = 0;
+        std::string username;
+        std::string password;
+        std::string topic; // without leading /
+    } URL;
+
+    // mqtt://[username[:password]@]host[:port]/topic, also mqtts://
+    bool parseURL(const std::string& url, URL& out);
+
+    // writes all the bytes
+    typedef std::function<bool(const uint8_t* data, size_t size)> WriteCallback;
+    // reads at most size bytes, waiting at most timeoutMs for them, and returns the number of bytes read
+    typedef std::function<size_t(uint8_t* data, size_t size, uint32_t timeoutMs)> ReadCallback;
+    typedef std::function<void(const std::string& topic, const std::string& payload)> MessageCallback;
+    // a packet bigger than MYCILA_MQTT_MAX_PACKET_SIZE was discarded (and acknowledged if it was a QoS 1 message)
+    typedef std::function<void(uint8_t header, const std::string& topic, size_t size)> DropCallback;
+
+    class Client {
+      public:
+        Client(WriteCallback write, ReadCallback read) : _write(write), _read(read) {}
+
+        void onMessage(MessageCallback callback) { _onMessage = callback; }
+        void onDrop(DropCallback callback) { _onDrop = callback; }
+
+        Result connect(const std::string& clientId,
+                       const std::string& username,
+                       const std::string& password,
+                       uint16_t keepAliveSec,
+                       bool cleanSession,
+                       uint32_t timeoutMs);
+        // whether the broker kept the session (subscriptions and pending messages) of a previous connection
+        bool isSessionPresent() const { return _sessionPresent; }
+
+        Result subscribe(const std::string& topic, uint8_t qos, uint32_t timeoutMs);
+        // waits for the PUBACK at QoS 1
+        Result publish(const std::string& topic, const std::string& payload, uint8_t qos, bool retain, uint32_t timeoutMs);
+        // handles the incoming packets during timeoutMs
+        Result poll(uint32_t timeoutMs);
+        Result ping(uint32_t timeoutMs);
+        void disconnect();
+
+      private:
+        WriteCallback _write;
+        ReadCallback _read;
+        MessageCallback _onMessage = nullptr;
+        DropCallback _onDrop = nullptr;
+        uint16_t _packetId = 0;
+        bool _sessionPresent = false;
+
+      private:
+        uint16_t _nextPacketId();
+        bool _send(uint8_t header, const std::string& body);
+        // a packet too big is discarded and returned as a packet of type 0, which is ignored
+        Result _receive(uint8_t& header, std::string& body, uint32_t timeoutMs);
+        Result _discard(uint8_t& header, std::string& body, size_t length);
+        // waits for a packet type (and packet id if not 0), handling the messages received meanwhile
+        Result _wait(uint8_t type, uint16_t packetId, std::string& body, uint32_t timeoutMs);
+        Result _handle(uint8_t header, const std::string& body);
+    };
+  } // namespace MQTT
+} // namespace Mycila
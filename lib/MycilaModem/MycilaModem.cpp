@@ -5,9 +5,18 @@
 #include <MycilaModem.h>
 
 #include <ArduinoHttpClient.h>
+#include <MycilaCoAP.h>
 #include <MycilaLogger.h>
 #include <MycilaString.h>
+#include <MycilaTLS.h>
 #include <MycilaTime.h>
+#include <Preferences.h>
+#include <esp_attr.h>
+#include <esp_rom_crc.h>
+
+#include <limits.h>
+#include <stddef.h>
+#include <string.h>
 
 #include <algorithm>
 #include <string>
@@ -20,9 +29,91 @@ TinyGPSPlus tinyGPS;
 
 #define TAG "MODEM"
 
+#define MYCILA_MODEM_NVS_NAMESPACE "modem"
+#define MYCILA_MODEM_GPS_FIX_KEY   "gps_fix"
+#define MYCILA_MODEM_XTRA_KEY      "xtra"
+#define MYCILA_MODEM_XTRA_FILE     "/customer/Xtra3.bin"
+
+#define MYCILA_MODEM_MQTT_SUBSCRIPTION_MAGIC 0x4d515453 // MQTS
+#define MYCILA_MODEM_MQTT_TOPIC_SIZE         128
+
 extern Mycila::Logger logger;
 
-Mycila::ModemClass::ModemClass() : _spy(MYCILA_MODEM_SERIAL), _modem(_spy) {}
+typedef struct {
+    uint32_t magic;
+    char topic[MYCILA_MODEM_MQTT_TOPIC_SIZE]; // downlink topic subscribed in the broker session
+    uint32_t crc;                             // CRC32 of the fields above
+} MQTTSubscription;
+
+// survives deep sleep, not power loss: the broker session (client id) outlives the connection
+RTC_NOINIT_ATTR static MQTTSubscription mqttSubscription;
+
+static uint32_t mqttSubscriptionCRC() {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&mqttSubscription), offsetof(MQTTSubscription, crc));
+}
+
+static bool isMQTTSubscribed(const std::string& topic) {
+  return mqttSubscription.magic == MYCILA_MODEM_MQTT_SUBSCRIPTION_MAGIC && mqttSubscription.crc == mqttSubscriptionCRC() && topic == mqttSubscription.topic;
+}
+
+static void setMQTTSubscribed(const std::string& topic) {
+  mqttSubscription.magic = MYCILA_MODEM_MQTT_SUBSCRIPTION_MAGIC;
+  memset(mqttSubscription.topic, 0, MYCILA_MODEM_MQTT_TOPIC_SIZE);
+  strncpy(mqttSubscription.topic, topic.c_str(), MYCILA_MODEM_MQTT_TOPIC_SIZE - 1);
+  mqttSubscription.crc = mqttSubscriptionCRC();
+}
+
+namespace {
+  // position kept in NVS
+  typedef struct {
+      double latitude;
+      double longitude;
+      float altitude;
+      float accuracy;
+      uint32_t time; // unix time of the fix
+      uint32_t ttff;    // time to first fix (ms)
+      uint8_t assisted; // fixed with assistance data
+      uint8_t stale;    // a new fix was requested
+  } GPSFix;
+
+  // the request is only delivered once the server answers with a 2xx status
+  int post(HttpClient& http, const std::string& path, const char* contentType, const std::string& payload) {
+    int ret = http.post(path.c_str(), contentType, payload.size(), reinterpret_cast<const byte*>(payload.data()));
+    if (ret == HTTP_SUCCESS) {
+      const int status = http.responseStatusCode();
+      if (status < 0) {
+        ret = status;
+      } else if (status < 200 || status >= 300) {
+        logger.warn(TAG, "HTTP POST rejected: %d", status);
+        ret = HTTP_ERROR_INVALID_RESPONSE;
+      }
+    }
+    http.stop();
+    return ret;
+  }
+
+  // unix time of a UTC time
+  time_t toUnixTime(struct tm t, const std::string& timeZoneInfo) {
+    setenv("TZ", "UTC0", 1);
+    tzset();
+    const time_t unixTime = mktime(&t);
+    setenv("TZ", timeZoneInfo.c_str(), 1);
+    tzset();
+    return unixTime;
+  }
+} // namespace
+
+Mycila::ModemClass::ModemClass() : _spy(MYCILA_MODEM_SERIAL),
+                                   _modem(_spy),
+                                   _at([this](const uint8_t* data, size_t size) { return _spy.write(data, size) == size; },
+                                       [this]() { return _spy.available() ? _spy.read() : -1; }) {
+  _at.onURC("+CREG:", std::bind(&Mycila::ModemClass::_onRegistration, this, 0, std::placeholders::_1));
+  _at.onURC("+CGREG:", std::bind(&Mycila::ModemClass::_onRegistration, this, 1, std::placeholders::_1));
+  _at.onURC("+CEREG:", std::bind(&Mycila::ModemClass::_onRegistration, this, 2, std::placeholders::_1));
+  _at.onURC("+CCLK:", std::bind(&Mycila::ModemClass::_onNetworkTime, this, std::placeholders::_1));
+  _at.onURC("+CNACT:", std::bind(&Mycila::ModemClass::_onPDP, this, std::placeholders::_1));
+  _at.onURC("+APP PDP:", std::bind(&Mycila::ModemClass::_onPDP, this, std::placeholders::_1));
+}
 
 void Mycila::ModemClass::begin() {
   if (_state != MODEM_OFF)
@@ -40,6 +131,8 @@ void Mycila::ModemClass::begin() {
   digitalWrite(MYCILA_MODEM_RST_PIN, LOW);
 #endif
 
+  _operatorCache.begin();
+
   _powerModem();
 
   // Set modem baud
@@ -55,6 +148,13 @@ void Mycila::ModemClass::begin() {
 }
 
 void Mycila::ModemClass::loop() {
+  _at.loop();
+
+  // the serial line belongs to the AT engine until its commands complete: the TinyGSM calls below would consume their responses.
+  // The state machine goes on from the callbacks of the commands and from the URC handlers.
+  if (_at.isBusy())
+    return;
+
   if (_state == MODEM_STARTING) {
     logger.info(TAG, "Init SIM...");
 
@@ -64,34 +164,50 @@ void Mycila::ModemClass::loop() {
 
 #ifdef TINY_GSM_MODEM_SIM7080
       // 2 Automatic
-      _modem.setNetworkMode(2);
+      _at.enqueue("AT+CNMP=2");
 
       // NB-IoT bands
-      std::string nbiotBands = "+CBANDCFG=\"NB-IOT\",";
-      nbiotBands += _bands[MODEM_MODE_NB_IOT];
-      _modem.sendAT(nbiotBands.c_str());
-      _modem.waitResponse();
+      _at.enqueue("AT+CBANDCFG=\"NB-IOT\"," + _bands[MODEM_MODE_NB_IOT]);
 
       // LTE-M bands
-      std::string ltemBands = "+CBANDCFG=\"CAT-M\",";
-      ltemBands += _bands[MODEM_MODE_LTE_M];
-      _modem.sendAT(ltemBands.c_str());
-      _modem.waitResponse();
+      _at.enqueue("AT+CBANDCFG=\"CAT-M\"," + _bands[MODEM_MODE_LTE_M]);
 
       // APN
-      _modem.sendAT("+CNCFG=0,1,\"", _apn.c_str(), "\"");
-      _modem.waitResponse();
+      _at.enqueue("AT+CNCFG=0,1,\"" + _apn + "\"");
 #endif
 
       // APN
-      _modem.sendAT("+CGDCONT=1,\"IP\",\"", _apn.c_str(), "\"");
-      _modem.waitResponse();
+      _at.enqueue("AT+CGDCONT=1,\"IP\",\"" + _apn + "\"");
+
+      // registration changes are reported as URCs
+      _registration = 0;
+      _at.enqueue("AT+CREG=1");
+      _at.enqueue("AT+CGREG=1");
+      _at.enqueue("AT+CEREG=1");
 
       // go to registration
       _setMode(_mode);
       _timeState = ModemTimeState::MODEM_TIME_SYNCING;
+      _registrationStartTime = millis();
+      _associationStartTime = _registrationStartTime;
       _setState(MODEM_WAIT_REGISTRATION);
 
+      // the operators which worked before are tried first: the automatic registration and then the search only come after
+      _operators.clear();
+      _candidateIndex = -1;
+      _candidate = nullptr;
+      for (const OperatorStats& stats : _operatorCache.getCandidates()) {
+        ModemOperatorSearchResult op;
+        op.state = MODEM_OPERATOR_AVAILABLE;
+        op.name = stats.name[0] ? stats.name : stats.code;
+        op.code = stats.code;
+        op.mode = stats.mode;
+        op.cached = true;
+        _operators.push_back(op);
+      }
+      if (!_operators.empty())
+        _associateNext();
+
     } else {
       SimStatus simStatus = _modem.getSimStatus();
       if (simStatus != SIM_READY) {
@@ -115,128 +231,81 @@ void Mycila::ModemClass::loop() {
     }
   }
 
-  if (_state == MODEM_WAIT_REGISTRATION && millis() - _registrationCheckLastTime >= 2000) {
-    logger.info(TAG, "Check registration...");
-    _registrationCheckCount--;
+  if (_state == MODEM_WAIT_REGISTRATION && _registration) {
+    _registrationTime = millis() - _registrationStartTime;
+    logger.info(TAG, "Registered in %u ms!", _registrationTime);
+
+    // operator, mode and band actually serving, for the operator cache
+    _at.enqueue("AT+CPSI?", MYCILA_AT_TIMEOUT, [this](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+      if (result == Mycila::AT::AT_OK)
+        _onServingCell(lines);
+    }, "+CPSI:");
+
+    // a stationary device reuses its last position instead of a new fix, which keeps the GPS off
+    if (_loadGPSFix()) {
+      logger.info(TAG, "Using cached GPS position (%" PRId32 " s old)", getGPSFixAge());
+      _gpsState = MODEM_GPS_CACHED;
+      _setState(MODEM_CONNECTING);
 
-    if (_modem.isNetworkConnected()) {
-      logger.info(TAG, "Registered!");
+    } else if (_lbsMode == MODEM_LBS_FIRST) {
+      logger.info(TAG, "Locating with the cells instead of a GPS fix");
+      _gpsFixRequested = false;
+      _lbsRequested = true;
+      _setState(MODEM_CONNECTING);
 
+    } else {
+      _gpsFixRequested = false;
       activateGPS();
       _gpsSyncStartTime = millis();
       _lastRefreshTime = 0;
       _setState(MODEM_GPS);
+    }
+
+  } else if (_state == MODEM_WAIT_REGISTRATION && millis() - _registrationCheckLastTime >= 2000) {
+    logger.info(TAG, "Check registration...");
+    _registrationCheckCount--;
+    _sync();
 
-    } else if (_registrationCheckCount <= 0) {
+    if (_registrationCheckCount <= 0) {
       if (!_candidate) {
         logger.warn(TAG, "Timeout registering with any operator");
         _setState(MODEM_SEARCHING);
 
       } else {
         logger.warn(TAG, "Timeout registering with %s (%d)", _candidate->name.c_str(), _candidate->mode);
-
-        while (true) {
-          _candidateIndex++;
-          _candidate = _candidateIndex < _operators.size() ? &_operators[_candidateIndex] : nullptr;
-
-          if (!_candidate) {
-            logger.warn(TAG, "No more operator to try");
-            _setState(MODEM_SEARCHING);
-            break;
-          }
-
-          logger.info(TAG, "Try associate with %s (%d)...", _candidate->name.c_str(), _candidate->mode);
-          _setMode(_candidate->mode);
-          _modem.sendAT("+COPS=0,0,\"", _candidate->name.c_str(), "\",", _candidate->mode);
-
-          if (_modem.waitResponse(60000) == 1) {
-            logger.info(TAG, "Associated with %s (%d)", _candidate->name.c_str(), _candidate->mode);
-            _registrationCheckCount = 7;
-            _setState(MODEM_WAIT_REGISTRATION);
-            break;
-
-          } else {
-            logger.warn(TAG, "Failed to associate with %s (%d)", _candidate->name.c_str(), _candidate->mode);
-          }
-        }
+        _operatorCache.failure(_candidate->code, _candidate->mode);
+        _associateNext();
       }
     } else {
       logger.info(TAG, "Not registered yet.");
+      // in case a URC was missed while TinyGSM was reading
+      _at.enqueue("AT+CREG?");
+      _at.enqueue("AT+CGREG?");
+      _at.enqueue("AT+CEREG?");
     }
 
-    _sync();
     _registrationCheckLastTime = millis();
   }
 
   if (_state == MODEM_SEARCHING) {
     logger.info(TAG, "Searching for operators...");
+    _sync();
 
-    // de-register
-    _modem.sendAT("+COPS=2");
-    _modem.waitResponse();
     _operator = std::string();
-
-    // https://help.onomondo.com/en/how-to-clear-the-fplmn-list
-    // Query state: AT+CRSM=176,28539,0,0,12AT+CRSM=176,28539,0,0,12
-    _modem.sendAT("+CRSM=214,28539,0,0,12,\"FFFFFFFFFFFFFFFFFFFFFFFF\"");
-    _modem.waitResponse(2000L, "+CRSM:");
-
-    _setMode(_mode);
-    _modem.sendAT("+COPS=?");
-
     _operators.clear();
     _candidateIndex = -1;
     _candidate = nullptr;
+    _registration = 0;
 
-    _spy.setTimeout(70000);
-    if (_spy.readStringUntil(':').endsWith("+COPS")) {
-      _spy.setTimeout(1000);
-      while (!_spy.readStringUntil('(').isEmpty()) {
-        ModemOperatorSearchResult op;
-        op.state = static_cast<ModemOperatorState>(_spy.parseInt());
-        _spy.readStringUntil('"');
-        op.name = Mycila::string::trim(_spy.readStringUntil('"').c_str());
-        _spy.readStringUntil('"');
-        _spy.readStringUntil('"');
-        _spy.readStringUntil('"');
-        op.code = Mycila::string::trim(_spy.readStringUntil('"').c_str());
-        _spy.readStringUntil(',');
-        op.mode = _spy.parseInt();
-
-        if (!op.name.empty()) {
-          if (op.state == MODEM_OPERATOR_FORBIDDEN) {
-            logger.warn(TAG, "Skipping forbidden operator %s (%d)", op.name.c_str(), op.mode);
-          } else {
-            logger.info(TAG, "Found operator %s (%d) code=%s, state=%d", op.name.c_str(), op.mode, op.code.c_str(), op.state);
-            _operators.push_back(op);
-          }
-        }
-      }
-      _readDrop();
-
-      for (_candidateIndex = 0; _candidateIndex < _operators.size(); _candidateIndex++) {
-        _candidate = &_operators[_candidateIndex];
-
-        logger.info(TAG, "Try associate with %s (%d)...", _candidate->name.c_str(), _candidate->mode);
-
-        _setMode(_candidate->mode);
-        _modem.sendAT("+COPS=0,0,\"", _candidate->name.c_str(), "\",", _candidate->mode);
-
-        if (_modem.waitResponse(60000) == 1) {
-          logger.info(TAG, "Associated with %s (%d)", _candidate->name.c_str(), _candidate->mode);
-          _registrationCheckCount = 7;
-          _setState(MODEM_WAIT_REGISTRATION);
-          break;
+    // de-register
+    _at.enqueue("AT+COPS=2");
 
-        } else {
-          logger.warn(TAG, "Failed to associate with %s (%d)", _candidate->name.c_str(), _candidate->mode);
-        }
-      }
-    } else {
-      // search again
-    }
+    // https://help.onomondo.com/en/how-to-clear-the-fplmn-list
+    // Query state: AT+CRSM=176,28539,0,0,12AT+CRSM=176,28539,0,0,12
+    _at.enqueue("AT+CRSM=214,28539,0,0,12,\"FFFFFFFFFFFFFFFFFFFFFFFF\"", 2000, nullptr, "+CRSM:");
 
-    _sync();
+    _setMode(_mode);
+    _at.enqueue("AT+COPS=?", MYCILA_MODEM_SCAN_TIMEOUT, std::bind(&Mycila::ModemClass::_onOperators, this, std::placeholders::_1, std::placeholders::_2), "+COPS:");
   }
 
   if (_state == MODEM_GPS && millis() - _lastRefreshTime >= 5000) {
@@ -248,6 +317,13 @@ void Mycila::ModemClass::loop() {
     } else if (millis() - _gpsSyncStartTime >= _gpsSyncTimeout * 1000) {
       logger.error(TAG, "GPS Sync timeout!");
       _gpsState = MODEM_GPS_TIMEOUT;
+      // the previous position, even outdated, is better than none: a new fix is tried again at the next start
+      if (_gpsFixTime) {
+        logger.warn(TAG, "Using cached GPS position (%" PRId32 " s old)", getGPSFixAge());
+        _gpsState = MODEM_GPS_CACHED;
+      } else if (_lbsMode != MODEM_LBS_OFF) {
+        _lbsRequested = true;
+      }
       _setState(MODEM_CONNECTING);
 
     } else {
@@ -258,7 +334,10 @@ void Mycila::ModemClass::loop() {
   if (_state == MODEM_CONNECTING) {
     if (activateData()) {
       _sync();
-      activateGPS();
+      if (_lbsRequested)
+        _locateWithCells();
+      else
+        activateGPS();
       _setState(MODEM_READY);
     } else {
       logger.error(TAG, "Failed to activate data!");
@@ -266,8 +345,15 @@ void Mycila::ModemClass::loop() {
     }
   }
 
+  if (_state == MODEM_READY && _gpsFixRequested) {
+    logger.info(TAG, "New GPS fix requested");
+    _gpsFixRequested = false;
+    _gpsState = MODEM_GPS_SYNCING;
+    activateGPS();
+  }
+
   // refresh modem info
-  if (_state > MODEM_OFF && millis() - _lastRefreshTime >= 30000) {
+  if (_state > MODEM_OFF && !_at.isBusy() && millis() - _lastRefreshTime >= 30000) {
     _sync();
     _lastRefreshTime = millis();
   }
@@ -276,6 +362,10 @@ void Mycila::ModemClass::loop() {
 }
 
 void Mycila::ModemClass::powerOff() {
+  _at.clear();
+  mqttDisconnect();
+  closeSocket();
+
   // Turn off modem
   _modem.poweroff();
   // Wait until the modem does not respond to the command, and then proceed to the next step
@@ -311,24 +401,104 @@ void Mycila::ModemClass::setDebug(bool debug) {
   }
 }
 
-int Mycila::ModemClass::sendTCP(const std::string& host, uint16_t port, const std::string& payload, const uint16_t connectTimeoutSec) {
-  TinyGsmClient client(_modem);
-  client.setTimeout(connectTimeoutSec * 1000);
-  int code = ESP_ERR_TIMEOUT;
-  if (client.connect(host.c_str(), port, connectTimeoutSec)) {
-    client.print(payload.c_str());
-    client.flush();
-    client.stop();
-    code = ESP_OK;
+int Mycila::ModemClass::sendFrame(const std::string& url, const std::string& payload, const uint16_t connectTimeoutSec) {
+  _waitForAT();
+
+  Mycila::Frame::URL frameURL;
+  if (payload.empty() || payload.size() > UINT16_MAX || !Mycila::Frame::parseURL(url, frameURL))
+    return ESP_ERR_INVALID_ARG;
+
+#ifndef TINY_GSM_MODEM_SIM7080
+  if (frameURL.udp)
+    return ESP_ERR_NOT_SUPPORTED;
+#else
+  if (frameURL.udp && MYCILA_FRAME_HEADER_SIZE + payload.size() > MYCILA_MODEM_UDP_MAX_SIZE)
+    return ESP_ERR_INVALID_SIZE;
+#endif
+
+  if (!_modem.isNetworkConnected())
+    return ESP_ERR_INVALID_STATE;
+
+  const uint16_t sequence = _frameSequence++;
+
+  while (true) {
+    // a socket kept from the previous frame can be stale: it is retried once with a new socket
+    const bool reused = _socketURL == url && (frameURL.udp || _socket->connected());
+
+    if (!reused) {
+      closeSocket();
+#ifdef TINY_GSM_MODEM_SIM7080
+      if (frameURL.udp) {
+        if (!_udpOpen(frameURL.host, frameURL.port, connectTimeoutSec))
+          return ESP_ERR_INVALID_STATE;
+      } else
+#endif
+      {
+        _socket.reset(new TinyGsmClient(_modem));
+        if (!_socket->connect(frameURL.host.c_str(), frameURL.port, connectTimeoutSec)) {
+          _socket.reset();
+          return ESP_ERR_TIMEOUT;
+        }
+      }
+      _socketURL = url;
+    }
+
+    Mycila::Frame::Result result;
+#ifdef TINY_GSM_MODEM_SIM7080
+    if (frameURL.udp) {
+      result = Mycila::Frame::send(
+        sequence,
+        payload,
+        [this](const std::string& datagram) { return _udpSend(datagram); },
+        [this](std::string& datagram, uint32_t timeoutMs) { return _udpReceive(datagram, timeoutMs); });
+    } else
+#endif
+    {
+      result = Mycila::Frame::send(
+        sequence,
+        payload,
+        [this](const uint8_t* data, size_t size) { return _socket->write(data, size) == size; },
+        [this](uint8_t* data, size_t size, uint32_t timeoutMs) {
+          _socket->setTimeout(timeoutMs);
+          return _socket->readBytes(data, size);
+        },
+        connectTimeoutSec * 1000);
+    }
+
+    if (result == Mycila::Frame::FRAME_OK)
+      return ESP_OK;
+
+    closeSocket();
+
+    // a lost datagram was already retransmitted
+    if (!reused || frameURL.udp)
+      return result == Mycila::Frame::FRAME_TIMEOUT ? ESP_ERR_TIMEOUT : ESP_ERR_INVALID_STATE;
+  }
+}
+
+void Mycila::ModemClass::closeSocket() {
+  if (_socket) {
+    _socket->stop();
+    _socket.reset();
   }
-  return code;
+#ifdef TINY_GSM_MODEM_SIM7080
+  if (!_socketURL.empty() && Mycila::string::startsWith(_socketURL, "udp://"))
+    _udpClose();
+#endif
+  _socketURL.clear();
 }
 
 #ifdef TINY_GSM_MODEM_A7670
-int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payload, const uint16_t connectTimeoutSec) {
+int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec) {
+  _waitForAT();
+
   if (url.empty() || payload.empty())
     return ESP_ERR_INVALID_ARG;
 
+  // TLS computed by the ESP32 instead of the modem: the session is resumed across wakes
+  if (_caBundle.isValid() && Mycila::string::startsWith(url, "https://"))
+    return _httpPOST(url, payload, contentType, connectTimeoutSec);
+
   if (!_modem.https_begin())
     return ESP_ERR_INVALID_STATE;
 
@@ -337,19 +507,33 @@ int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payl
 
   _modem.https_set_timeout(connectTimeoutSec);
   _modem.https_set_user_agent(_model.c_str());
-  _modem.https_set_content_type("application/json");
-  if (_modem.https_post(payload.c_str()) == -1)
+  _modem.https_set_content_type(contentType);
+  // HTTP status, -1 if the request failed
+  const int status = _modem.https_post(reinterpret_cast<uint8_t*>(const_cast<char*>(payload.data())), payload.size());
+  if (status == -1)
     return ESP_ERR_INVALID_STATE;
 
+  if (status < 200 || status >= 300) {
+    logger.warn(TAG, "HTTP POST rejected: %d", status);
+    return ESP_ERR_INVALID_RESPONSE;
+  }
+
   return ESP_OK;
 }
 #endif
 
 #ifdef TINY_GSM_MODEM_SIM7080
-int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payload, const uint16_t connectTimeoutSec) {
+int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec) {
+  _waitForAT();
+
   if (url.empty() || payload.empty())
     return ESP_ERR_INVALID_ARG;
 
+  return _httpPOST(url, payload, contentType, connectTimeoutSec);
+}
+#endif
+
+int Mycila::ModemClass::_httpPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec) {
   if (!_modem.isNetworkConnected())
     return ESP_ERR_INVALID_STATE;
 
@@ -407,18 +591,36 @@ int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payl
 
   int ret = HTTP_SUCCESS;
 
-  if (protocol == "https") {
+  if (protocol == "https" && _caBundle.isValid()) {
+    const uint16_t httpsPort = port.empty() ? 443 : std::stol(port);
+    TinyGsmClient transport(_modem);
+    transport.setTimeout(connectTimeoutSec * 1000);
+    if (transport.connect(host.c_str(), httpsPort, connectTimeoutSec)) {
+      Mycila::TLSClient client(transport, _caBundle);
+      if (client.connect(host.c_str(), httpsPort)) {
+        HttpClient http(client, host.c_str(), httpsPort);
+        http.setTimeout(connectTimeoutSec * 1000);
+        ret = post(http, path, contentType, payload);
+      } else {
+        ret = HTTP_ERROR_CONNECTION_FAILED;
+      }
+    } else {
+      ret = HTTP_ERROR_CONNECTION_FAILED;
+    }
+
+#ifdef TINY_GSM_MODEM_SIM7080
+  } else if (protocol == "https") {
     const uint16_t httpsPort = port.empty() ? 443 : std::stol(port);
     TinyGsmClientSecure client(_modem);
     client.setTimeout(connectTimeoutSec * 1000);
     if (client.connect(host.c_str(), httpsPort, connectTimeoutSec)) {
       HttpClient http(client, host.c_str(), httpsPort);
       http.setTimeout(connectTimeoutSec * 1000);
-      ret = http.post(path.c_str(), "application/json", payload.c_str());
-      http.stop();
+      ret = post(http, path, contentType, payload);
     } else {
       ret = HTTP_ERROR_CONNECTION_FAILED;
     }
+#endif
 
   } else if (protocol == "http") {
     const uint16_t httpPort = port.empty() ? 80 : std::stol(port);
@@ -427,8 +629,7 @@ int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payl
     if (client.connect(host.c_str(), httpPort, connectTimeoutSec)) {
       HttpClient http(client, host.c_str(), httpPort);
       http.setTimeout(connectTimeoutSec * 1000);
-      ret = http.post(path.c_str(), "application/json", payload.c_str());
-      http.stop();
+      ret = post(http, path, contentType, payload);
     } else {
       ret = HTTP_ERROR_CONNECTION_FAILED;
     }
@@ -451,6 +652,227 @@ int Mycila::ModemClass::httpPOST(const std::string& url, const std::string& payl
       return ESP_FAIL;
   }
 }
+
+int Mycila::ModemClass::mqttPublish(const std::string& url, const std::string& payload, const std::string& downlinkTopic, const uint16_t connectTimeoutSec) {
+  _waitForAT();
+
+  Mycila::MQTT::URL mqttURL;
+  if (payload.empty() || !Mycila::MQTT::parseURL(url, mqttURL))
+    return ESP_ERR_INVALID_ARG;
+
+#ifndef TINY_GSM_MODEM_SIM7080
+  if (mqttURL.secure)
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+
+  if (!_modem.isNetworkConnected())
+    return ESP_ERR_INVALID_STATE;
+
+  while (true) {
+    // a connection kept from the previous publish can be stale: it is retried once with a new connection
+    const bool reused = _mqtt && _mqttTransport->connected() && _mqttURL == url;
+
+    if (!reused) {
+      const int err = _mqttConnect(mqttURL, url, connectTimeoutSec);
+      if (err != ESP_OK)
+        return err;
+    }
+
+    // the subscription is kept in the broker session, across deep sleeps: only subscribed when the broker lost it or when the topic changed
+    Mycila::MQTT::Result result = Mycila::MQTT::MQTT_OK;
+    if (!downlinkTopic.empty() && (!_mqtt->isSessionPresent() || !isMQTTSubscribed(downlinkTopic))) {
+      result = _mqtt->subscribe(downlinkTopic, 1, connectTimeoutSec * 1000);
+      if (result == Mycila::MQTT::MQTT_OK)
+        setMQTTSubscribed(downlinkTopic);
+      else if (result == Mycila::MQTT::MQTT_REFUSED)
+        logger.warn(TAG, "MQTT subscription to %s refused", downlinkTopic.c_str());
+    }
+
+    if (result == Mycila::MQTT::MQTT_OK || result == Mycila::MQTT::MQTT_REFUSED)
+      result = _mqtt->publish(mqttURL.topic, payload, 1, false, connectTimeoutSec * 1000);
+
+    if (result == Mycila::MQTT::MQTT_OK) {
+      // downlink messages are delivered after the subscription
+      _mqtt->poll(MYCILA_MODEM_MQTT_DOWNLINK_WAIT);
+      return ESP_OK;
+    }
+
+    mqttDisconnect();
+
+    if (!reused)
+      return result == Mycila::MQTT::MQTT_TIMEOUT ? ESP_ERR_TIMEOUT : ESP_ERR_INVALID_STATE;
+  }
+}
+
+void Mycila::ModemClass::mqttDisconnect() {
+  if (_mqtt && _mqttTransport->connected())
+    _mqtt->disconnect();
+  if (_mqttTransport)
+    _mqttTransport->stop();
+  _mqtt.reset();
+  _mqttTransport.reset();
+  _mqttURL.clear();
+}
+
+int Mycila::ModemClass::_mqttConnect(const Mycila::MQTT::URL& mqttURL, const std::string& url, const uint16_t connectTimeoutSec) {
+  mqttDisconnect();
+
+#ifdef TINY_GSM_MODEM_SIM7080
+  if (mqttURL.secure)
+    _mqttTransport.reset(new TinyGsmClientSecure(_modem));
+  else
+#endif
+    _mqttTransport.reset(new TinyGsmClient(_modem));
+
+  if (!_mqttTransport->connect(mqttURL.host.c_str(), mqttURL.port, connectTimeoutSec)) {
+    _mqttTransport.reset();
+    return ESP_ERR_TIMEOUT;
+  }
+
+  _mqtt.reset(new Mycila::MQTT::Client(
+    [this](const uint8_t* data, size_t size) { return _mqttTransport->write(data, size) == size; },
+    [this](uint8_t* data, size_t size, uint32_t timeoutMs) {
+      _mqttTransport->setTimeout(timeoutMs);
+      return _mqttTransport->readBytes(data, size);
+    }));
+  _mqtt->onMessage([this](const std::string& topic, const std::string& payload) {
+    logger.info(TAG, "MQTT message received on %s (%u bytes)", topic.c_str(), payload.length());
+    if (_mqttCallback)
+      _mqttCallback(topic, payload);
+  });
+  _mqtt->onDrop([](uint8_t header, const std::string& topic, size_t size) {
+    logger.warn(TAG, "MQTT packet 0x%02X on %s discarded: %u bytes > %u", header, topic.c_str(), size, MYCILA_MQTT_MAX_PACKET_SIZE);
+  });
+
+  // no clean session: the broker keeps the subscription and the downlink messages while the device sleeps
+  switch (_mqtt->connect(_mqttClientId, mqttURL.username, mqttURL.password, MYCILA_MODEM_MQTT_KEEPALIVE, false, connectTimeoutSec * 1000)) {
+    case Mycila::MQTT::MQTT_OK:
+      _mqttURL = url;
+      return ESP_OK;
+    case Mycila::MQTT::MQTT_TIMEOUT:
+      mqttDisconnect();
+      return ESP_ERR_TIMEOUT;
+    case Mycila::MQTT::MQTT_REFUSED:
+      logger.error(TAG, "MQTT connection refused by %s", mqttURL.host.c_str());
+      mqttDisconnect();
+      return ESP_ERR_INVALID_RESPONSE;
+    default:
+      mqttDisconnect();
+      return ESP_ERR_INVALID_STATE;
+  }
+}
+
+#ifdef TINY_GSM_MODEM_A7670
+int Mycila::ModemClass::coapPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+#endif
+
+#ifdef TINY_GSM_MODEM_SIM7080
+int Mycila::ModemClass::coapPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec) {
+  _waitForAT();
+
+  Mycila::CoAP::URL coapURL;
+  if (payload.empty() || !Mycila::CoAP::parseURL(url, coapURL))
+    return ESP_ERR_INVALID_ARG;
+
+  // DTLS is not implemented
+  if (coapURL.scheme == "coaps")
+    return ESP_ERR_NOT_SUPPORTED;
+
+  // same size as the request sent below (4-byte token): a bigger datagram would be refused by the modem or truncated
+  Mycila::CoAP::Message request;
+  request.token.assign(sizeof(uint32_t), '\0');
+  request.payload = payload;
+  if (Mycila::CoAP::encode(request, coapURL, Mycila::CoAP::toContentFormat(contentType)).size() > MYCILA_MODEM_UDP_MAX_SIZE)
+    return ESP_ERR_INVALID_SIZE;
+
+  if (!_modem.isNetworkConnected())
+    return ESP_ERR_INVALID_STATE;
+
+  // same UDP socket as the connector
+  closeSocket();
+
+  if (!_udpOpen(coapURL.host, coapURL.port, connectTimeoutSec))
+    return ESP_ERR_INVALID_STATE;
+
+  const uint32_t random = esp_random();
+  const std::string token(reinterpret_cast<const char*>(&random), sizeof(random));
+
+  Mycila::CoAP::Message response;
+  const Mycila::CoAP::Result result = Mycila::CoAP::post(
+    coapURL,
+    payload,
+    Mycila::CoAP::toContentFormat(contentType),
+    _coapMessageId++,
+    token,
+    [this](const std::string& datagram) { return _udpSend(datagram); },
+    [this](std::string& datagram, uint32_t timeoutMs) { return _udpReceive(datagram, timeoutMs); },
+    response);
+
+  _udpClose();
+
+  switch (result) {
+    case Mycila::CoAP::COAP_OK:
+      if (Mycila::CoAP::codeClass(response.code) == 2)
+        return ESP_OK;
+      logger.warn(TAG, "CoAP response: %d.%02d", Mycila::CoAP::codeClass(response.code), response.code & 0x1f);
+      return ESP_ERR_INVALID_RESPONSE;
+    case Mycila::CoAP::COAP_TIMEOUT:
+      return ESP_ERR_TIMEOUT;
+    case Mycila::CoAP::COAP_RESET:
+      return ESP_ERR_INVALID_RESPONSE;
+    default:
+      // COAP_SEND_FAILED
+      return ESP_ERR_INVALID_STATE;
+  }
+}
+
+bool Mycila::ModemClass::_udpOpen(const std::string& host, uint16_t port, const uint16_t connectTimeoutSec) {
+  _modem.sendAT("+CAOPEN=", MYCILA_MODEM_UDP_CID, ",0,\"UDP\",\"", host.c_str(), "\",", port);
+  if (_modem.waitResponse(connectTimeoutSec * 1000, "+CAOPEN:") != 1)
+    return false;
+  _spy.readStringUntil(',');
+  const int result = _spy.parseInt();
+  _modem.waitResponse();
+  return result == 0;
+}
+
+bool Mycila::ModemClass::_udpSend(const std::string& datagram) {
+  _modem.sendAT("+CASEND=", MYCILA_MODEM_UDP_CID, ",", datagram.size());
+  if (_modem.waitResponse(5000, ">") != 1)
+    return false;
+  _spy.write(reinterpret_cast<const uint8_t*>(datagram.data()), datagram.size());
+  _spy.flush();
+  return _modem.waitResponse(5000) == 1;
+}
+
+bool Mycila::ModemClass::_udpReceive(std::string& datagram, uint32_t timeoutMs) {
+  // +CADATAIND is consumed by TinyGSM: poll the socket instead
+  const uint32_t start = millis();
+  do {
+    _modem.sendAT("+CARECV=", MYCILA_MODEM_UDP_CID, ",", MYCILA_MODEM_UDP_MAX_SIZE);
+    if (_modem.waitResponse(2000, "+CARECV:") == 1) {
+      const int length = _spy.parseInt();
+      if (length > 0) {
+        _spy.read(); // ,
+        datagram.resize(length);
+        const size_t read = _spy.readBytes(&datagram[0], length);
+        datagram.resize(read);
+      }
+      _modem.waitResponse();
+      if (length > 0)
+        return true;
+    }
+    delay(200);
+  } while (millis() - start < timeoutMs);
+  return false;
+}
+
+void Mycila::ModemClass::_udpClose() {
+  _modem.sendAT("+CACLOSE=", MYCILA_MODEM_UDP_CID);
+  _modem.waitResponse();
+}
 #endif
 
 void Mycila::ModemClass::_onRead(const uint8_t* buffer, size_t size) {
@@ -477,22 +899,18 @@ void Mycila::ModemClass::_onWrite(const uint8_t* buffer, size_t size) {
   }
 }
 
-void Mycila::ModemClass::_readDrop() {
-  while (_spy.available())
-    _spy.read();
-}
-
 void Mycila::ModemClass::_setMode(uint8_t mode) {
 #ifdef TINY_GSM_MODEM_SIM7080
+  // queued before the commands depending on it, like +COPS=0
   switch (mode) {
     case 7:
-      _modem.setPreferredMode(1);
+      _at.enqueue("AT+CMNB=1");
       break;
     case 9:
-      _modem.setPreferredMode(2);
+      _at.enqueue("AT+CMNB=2");
       break;
     default:
-      _modem.setPreferredMode(3);
+      _at.enqueue("AT+CMNB=3");
       break;
   }
 #endif
@@ -536,7 +954,11 @@ bool Mycila::ModemClass::_syncGPS() {
 
 #ifdef TINY_GSM_MODEM_SIM7080
   uint8_t status = 0;
-  if (_modem.getGPS(&status, &_gpsData.latitude, &_gpsData.longitude, nullptr, &_gpsData.altitude, nullptr, nullptr, &_gpsData.accuracy, &_gpsData.time.tm_year, &_gpsData.time.tm_mon, &_gpsData.time.tm_mday, &_gpsData.time.tm_hour, &_gpsData.time.tm_min, &_gpsData.time.tm_sec) && _gpsData.altitude >= 0) {
+  float latitude = 0;
+  float longitude = 0;
+  if (_modem.getGPS(&status, &latitude, &longitude, nullptr, &_gpsData.altitude, nullptr, nullptr, &_gpsData.accuracy, &_gpsData.time.tm_year, &_gpsData.time.tm_mon, &_gpsData.time.tm_mday, &_gpsData.time.tm_hour, &_gpsData.time.tm_min, &_gpsData.time.tm_sec) && _gpsData.altitude >= 0) {
+    _gpsData.latitude = latitude;
+    _gpsData.longitude = longitude;
     _gpsData.time.tm_year -= 1900;
     _gpsData.time.tm_mon -= 1;
     logger.info(TAG, "GPS Synced!");
@@ -571,29 +993,8 @@ bool Mycila::ModemClass::_syncTime() {
     }
   }
 
-  // otherwise try time from cell network, which is sadly unreliable
-  struct tm t = {0, 0, 0, 0, 0, 0, 0, 0, 0};
-  float timezone = 0;
-  if (!_modem.getGSMDateTime(TinyGSMDateTimeFormat::DATE_FULL).startsWith("80/01/06") && _modem.getNetworkTime(&t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &timezone)) {
-    // +CCLK: "24/04/02,13:39:57+08 (dst, gmt+1, so 11:39 gmt)
-    t.tm_year -= 1900;
-    t.tm_mon -= 1;
-
-    setenv("TZ", "UTC0", 1);
-    tzset();
-
-    struct timeval now = {mktime(&t) - static_cast<int32_t>(timezone * 3600.0), 0};
-    settimeofday(&now, nullptr);
-
-    setenv("TZ", _timeZoneInfo.c_str(), 1);
-    tzset();
-
-    std::string time = Mycila::Time::getLocalStr();
-    if (!time.empty()) {
-      logger.info(TAG, "Time synced from cellular network: %s", time.c_str());
-      return true;
-    }
-  }
+  // otherwise try time from cell network, which is sadly unreliable: see _onNetworkTime()
+  _at.enqueue("AT+CCLK?");
 
   return false;
 }
@@ -618,7 +1019,17 @@ void Mycila::ModemClass::_sync() {
 
   _syncInfo();
 
-  if (_syncGPS()) {
+  // GPS is off with a cached position or a position from the cells
+  if (_gpsState != MODEM_GPS_CACHED && _gpsState != MODEM_GPS_LBS && _syncGPS()) {
+    _gpsData.uncertainty = 0;
+    _gpsData.source = MODEM_LOCATION_GNSS;
+    _gpsFixTime = toUnixTime(_gpsData.time, _timeZoneInfo);
+    // first fix of this start
+    if (_gpsState != MODEM_GPS_SYNCED) {
+      _gpsTTFF = millis() - _gpsStartTime;
+      logger.info(TAG, "GPS fixed in %" PRIu32 " ms%s", _gpsTTFF, _gpsAssisted ? " with assistance data" : "");
+      _saveGPSFix(false);
+    }
     _gpsState = MODEM_GPS_SYNCED;
   }
 
@@ -628,24 +1039,235 @@ void Mycila::ModemClass::_sync() {
 }
 
 void Mycila::ModemClass::_dequeueATCommands() {
-  if (_commands.size()) {
-    for (size_t i = 0; i < _commands.size(); i++) {
-      logger.info(TAG, "Execute command: %s", _commands[i].c_str());
-      if (Mycila::string::startsWith(_commands[i], "AT+"))
-        _modem.sendAT(_commands[i].substr(2).c_str());
-      else
-        _modem.sendAT(_commands[i].c_str());
-      delay(5000);
-      while (!_spy.available()) {
-        delay(5000);
+  for (const std::string& cmd : _commands) {
+    std::string command = Mycila::string::trim(cmd);
+    if (!Mycila::string::startsWith(command, "AT"))
+      command = "AT" + command;
+    logger.info(TAG, "Execute command: %s", command.c_str());
+    _at.enqueue(command, MYCILA_MODEM_SCAN_TIMEOUT, [command](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+      for (const std::string& line : lines)
+        logger.info(TAG, "%s: %s", command.c_str(), line.c_str());
+      logger.info(TAG, "%s: %s", command.c_str(), result == Mycila::AT::AT_OK ? "OK" : (result == Mycila::AT::AT_TIMEOUT ? "TIMEOUT" : "ERROR"));
+    });
+  }
+  _commands.clear();
+}
+
+void Mycila::ModemClass::_waitForAT() {
+  // the queued commands time out by themselves
+  while (_at.isBusy()) {
+    _at.loop();
+    delay(10);
+  }
+}
+
+void Mycila::ModemClass::_associateNext() {
+  _candidateIndex++;
+  _candidate = _candidateIndex < _operators.size() ? &_operators[_candidateIndex] : nullptr;
+
+  if (!_candidate && !_operators.empty() && _operators.back().cached) {
+    logger.warn(TAG, "No cached operator to try, back to automatic registration");
+    _operators.clear();
+    _candidateIndex = -1;
+    _setMode(_mode);
+    _at.enqueue("AT+COPS=0", MYCILA_MODEM_ASSOCIATE_TIMEOUT);
+    _associationStartTime = millis();
+    _registrationCheckCount = 7;
+    _setState(MODEM_WAIT_REGISTRATION);
+    return;
+  }
+
+  if (!_candidate) {
+    logger.warn(TAG, "No more operator to try");
+    _setState(MODEM_SEARCHING);
+    return;
+  }
+
+  logger.info(TAG, "Try associate with %s (%d)...", _candidate->name.c_str(), _candidate->mode);
+  _setMode(_candidate->mode);
+  _associationStartTime = millis();
+
+  // a cached operator is selected by its code, with a fallback to the automatic selection (4) if it is not there anymore
+  std::string cmd = _candidate->cached ? "AT+COPS=4,2,\"" + _candidate->code : "AT+COPS=0,0,\"" + _candidate->name;
+  cmd += "\"," + std::to_string(_candidate->mode);
+
+  _at.enqueue(cmd, MYCILA_MODEM_ASSOCIATE_TIMEOUT, [this](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+    if (result == Mycila::AT::AT_OK) {
+      logger.info(TAG, "Associated with %s (%d)", _candidate->name.c_str(), _candidate->mode);
+      _registrationCheckCount = 7;
+      _setState(MODEM_WAIT_REGISTRATION);
+    } else {
+      logger.warn(TAG, "Failed to associate with %s (%d)", _candidate->name.c_str(), _candidate->mode);
+      _operatorCache.failure(_candidate->code, _candidate->mode);
+      _associateNext();
+    }
+  });
+}
+
+void Mycila::ModemClass::_onOperators(Mycila::AT::Result result, const std::vector<std::string>& lines) {
+  if (result != Mycila::AT::AT_OK) {
+    // search again
+    logger.warn(TAG, "Operator search failed");
+    return;
+  }
+
+  // +COPS: (2,"Orange F","Orange F","20801",7),(1,"SFR","SFR","20810",9),,(0,1,2,3,4),(0,1,2)
+  for (const std::string& line : lines) {
+    for (size_t start = line.find('('); start != std::string::npos; start = line.find('(', start + 1)) {
+      const size_t end = line.find(')', start);
+      if (end == std::string::npos)
+        break;
+
+      // the supported modes and formats at the end have no name
+      const size_t quote = line.find('"', start);
+      if (quote == std::string::npos || quote > end)
+        continue;
+
+      const std::vector<std::string> values = Mycila::AT::split(line.substr(start + 1, end - start - 1));
+      if (values.size() < 5)
+        continue;
+
+      ModemOperatorSearchResult op;
+      op.state = static_cast<ModemOperatorState>(atoi(values[0].c_str()));
+      op.name = Mycila::string::trim(values[1]);
+      op.code = Mycila::string::trim(values[3]);
+      op.mode = atoi(values[4].c_str());
+
+      if (!op.name.empty()) {
+        if (op.state == MODEM_OPERATOR_FORBIDDEN) {
+          logger.warn(TAG, "Skipping forbidden operator %s (%d)", op.name.c_str(), op.mode);
+        } else {
+          logger.info(TAG, "Found operator %s (%d) code=%s, state=%d", op.name.c_str(), op.mode, op.code.c_str(), op.state);
+          _operators.push_back(op);
+        }
       }
-      _readDrop();
     }
-    _commands.clear();
+  }
+
+  // the operators which worked before first, best first, then the others in the order of the search
+  const auto rank = [this](const ModemOperatorSearchResult& op) {
+    const int r = _operatorCache.rank(op.code, op.mode);
+    return r < 0 ? INT_MAX : r;
+  };
+  std::stable_sort(_operators.begin(), _operators.end(), [&rank](const ModemOperatorSearchResult& a, const ModemOperatorSearchResult& b) {
+    return rank(a) < rank(b);
+  });
+
+  _associateNext();
+}
+
+void Mycila::ModemClass::_onServingCell(const std::vector<std::string>& lines) {
+  // +CPSI: LTE CAT-M1,Online,208-01,0x1A2B,12345678,123,EUTRAN-BAND20,6300,3,3,-10,-95,-65,15
+  // +CPSI: LTE NB-IOT,Online,208-01,... (SIM7080) or +CPSI: LTE,Online,208-01,... (A7670)
+  for (const std::string& line : lines) {
+    const std::vector<std::string> values = Mycila::AT::parameters(line);
+    if (values.size() < 7 || values[1] != "Online")
+      continue;
+
+    std::string code = values[2];
+    code.erase(std::remove(code.begin(), code.end(), '-'), code.end());
+    const uint8_t mode = values[0].find("NB") == std::string::npos ? MODEM_MODE_LTE_M : MODEM_MODE_NB_IOT;
+
+    _band = 0;
+    const size_t band = values[6].find("BAND");
+    if (band != std::string::npos)
+      _band = atoi(values[6].c_str() + band + 4);
+
+    // registration time of this operator, not the time spent with the previous candidates
+    const uint32_t latency = millis() - _associationStartTime;
+    const std::string name = _candidate && _candidate->code == code ? _candidate->name : _operator;
+
+    logger.info(TAG, "Serving operator %s (%d) code=%s, band=%d, registered in %u ms", name.c_str(), mode, code.c_str(), _band, latency);
+    _operatorCache.success(code, name, mode, _band, latency);
+    return;
+  }
+}
+
+void Mycila::ModemClass::_onRegistration(uint8_t domain, const std::string& line) {
+  // +CEREG: <stat>[,"<tac>",...] when reported, +CEREG: <n>,<stat>[,...] in the response of AT+CEREG?
+  const std::vector<std::string> values = Mycila::AT::parameters(line);
+  if (values.empty())
+    return;
+  const size_t comma = line.find(',');
+  const bool query = comma != std::string::npos && comma + 1 < line.length() && line[comma + 1] != '"';
+  const int stat = atoi(values[query ? 1 : 0].c_str());
+
+  // 1: home network, 5: roaming
+  const uint8_t previous = _registration;
+  if (stat == 1 || stat == 5)
+    _registration |= 1 << domain;
+  else
+    _registration &= ~(1 << domain);
+
+  if (previous && !_registration)
+    logger.warn(TAG, "Network registration lost");
+}
+
+void Mycila::ModemClass::_onNetworkTime(const std::string& line) {
+  if (_timeState == MODEM_TIME_SYNCED)
+    return;
+
+  // +CCLK: "24/04/02,13:39:57+08" (dst, gmt+1, so 11:39 gmt): the time zone is in quarters of an hour
+  const size_t quote = line.find('"');
+  if (quote == std::string::npos)
+    return;
+
+  struct tm t = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  char sign = '+';
+  int quarters = 0;
+  if (sscanf(line.c_str() + quote + 1, "%d/%d/%d,%d:%d:%d%c%d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec, &sign, &quarters) < 6)
+    return;
+
+  // 80/01/06: not received from the network yet
+  if (t.tm_year == 80)
+    return;
+
+  t.tm_year += 100;
+  t.tm_mon -= 1;
+
+  setenv("TZ", "UTC0", 1);
+  tzset();
+
+  struct timeval now = {mktime(&t) - (sign == '-' ? -quarters : quarters) * 900, 0};
+  settimeofday(&now, nullptr);
+
+  setenv("TZ", _timeZoneInfo.c_str(), 1);
+  tzset();
+
+  std::string time = Mycila::Time::getLocalStr();
+  if (!time.empty()) {
+    logger.info(TAG, "Time synced from cellular network: %s", time.c_str());
+    _timeState = MODEM_TIME_SYNCED;
+  }
+}
+
+void Mycila::ModemClass::_onPDP(const std::string& line) {
+  // +CNACT: 0,1,"10.1.2.3" in the response of AT+CNACT?, +APP PDP: 0,ACTIVE or 0,DEACTIVE when reported (SIM7080)
+  const std::vector<std::string> values = Mycila::AT::parameters(line);
+  if (values.size() < 2 || values[0] != "0")
+    return;
+
+  if (Mycila::string::startsWith(line, "+CNACT:")) {
+    if (values[1] == "1" && values.size() >= 3)
+      _localIP = values[2];
+    else if (values[1] == "0")
+      _localIP = std::string();
+
+  } else if (values[1] == "ACTIVE") {
+    logger.info(TAG, "Data activated");
+    _at.enqueue("AT+CNACT?");
+
+  } else if (values[1] == "DEACTIVE") {
+    logger.warn(TAG, "Data deactivated by the network");
+    _localIP = std::string();
+    if (_state == MODEM_READY)
+      _setState(MODEM_CONNECTING);
   }
 }
 
 bool Mycila::ModemClass::activateData() {
+  _waitForAT();
+
 #ifdef TINY_GSM_MODEM_A7670
   logger.info(TAG, "Activate Data...");
   _modem.gprsConnect(_apn.c_str());
@@ -660,12 +1282,237 @@ bool Mycila::ModemClass::activateData() {
 }
 
 void Mycila::ModemClass::activateGPS() {
+  // a cached position or a position from the cells is used until a new fix is requested
+  if (_gpsState == MODEM_GPS_CACHED || _gpsState == MODEM_GPS_LBS)
+    return;
+
+  _waitForAT();
+
+  if (_gpsState != MODEM_GPS_SYNCED) {
+    _gpsStartTime = millis();
+    _gpsAssisted = false;
+  }
+
+#ifdef TINY_GSM_MODEM_SIM7080
+  // the assistance data is copied from the file system to the GPS while it is off
+  const time_t assistanceTime = _gpsState != MODEM_GPS_SYNCED ? _loadGPSAssistanceTime() : 0;
+  const time_t now = time(nullptr);
+  if (assistanceTime && now >= assistanceTime && now - assistanceTime < MYCILA_MODEM_XTRA_VALIDITY) {
+    logger.info(TAG, "Inject GPS assistance data...");
+    _modem.sendAT("+CGNSCPY");
+    if (_modem.waitResponse() == 1) {
+      _modem.sendAT("+CGNSXTRA=1");
+      _gpsAssisted = _modem.waitResponse() == 1;
+    }
+    if (!_gpsAssisted)
+      logger.warn(TAG, "Failed to inject GPS assistance data");
+  }
+#endif
+
   logger.info(TAG, "Enable GPS...");
 #ifdef TINY_GSM_MODEM_SIM7080
   _modem.enableGPS(); // GPS is incompatible with networking for SIM7080
+  // the receiver only uses the assistance data on a cold start
+  if (_gpsAssisted) {
+    _modem.sendAT("+CGNSCOLD");
+    _modem.waitResponse();
+  }
 #endif
 }
 
+void Mycila::ModemClass::updateGPSAssistance() {
+#ifdef TINY_GSM_MODEM_SIM7080
+  if (_state != MODEM_READY || _gpsAssistanceChecked)
+    return;
+  _gpsAssistanceChecked = true;
+
+  // the validity window cannot be checked without the time
+  if (!isTimeSynced())
+    return;
+
+  // the next fix happens at the next start, or when the cached position expires
+  const time_t now = time(nullptr);
+  const time_t nextFix = _gpsState == MODEM_GPS_CACHED && _gpsFixTime && _gpsRefreshInterval ? _gpsFixTime + _gpsRefreshInterval : now;
+  if (nextFix >= now + MYCILA_MODEM_XTRA_VALIDITY)
+    return;
+
+  const time_t assistanceTime = _loadGPSAssistanceTime();
+  if (assistanceTime && assistanceTime <= now && nextFix < assistanceTime + MYCILA_MODEM_XTRA_VALIDITY)
+    return;
+
+  _waitForAT();
+
+  logger.info(TAG, "Download GPS assistance data...");
+  _at.enqueue("AT+HTTPTOFS=\"" MYCILA_MODEM_XTRA_URL "\",\"" MYCILA_MODEM_XTRA_FILE "\"", MYCILA_AT_TIMEOUT, [this, now](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+    if (result != Mycila::AT::AT_OK) {
+      logger.error(TAG, "Failed to download GPS assistance data");
+      return;
+    }
+    // the download runs in the background until +HTTPTOFS: <status>,<length>
+    _at.enqueueWait("+HTTPTOFS:", MYCILA_MODEM_XTRA_TIMEOUT, [now](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+      const std::vector<std::string> values = result == Mycila::AT::AT_OK ? Mycila::AT::parameters(lines[0]) : std::vector<std::string>();
+      if (values.size() < 2 || atoi(values[0].c_str()) != 200 || atoi(values[1].c_str()) <= 0) {
+        logger.error(TAG, "Failed to download GPS assistance data: %s", values.empty() ? "timeout" : lines[0].c_str());
+        return;
+      }
+      logger.info(TAG, "GPS assistance data downloaded: %s bytes", values[1].c_str());
+      Preferences preferences;
+      if (preferences.begin(MYCILA_MODEM_NVS_NAMESPACE, false)) {
+        preferences.putULong(MYCILA_MODEM_XTRA_KEY, now);
+        preferences.end();
+      }
+    });
+  });
+
+  // before the device sleeps
+  _waitForAT();
+#endif
+}
+
+void Mycila::ModemClass::clearCaches() {
+  _operatorCache.clear();
+  Preferences preferences;
+  if (preferences.begin(MYCILA_MODEM_NVS_NAMESPACE, false)) {
+    preferences.remove(MYCILA_MODEM_GPS_FIX_KEY);
+    preferences.remove(MYCILA_MODEM_XTRA_KEY);
+    preferences.end();
+  }
+}
+
+void Mycila::ModemClass::requestGPSFix() {
+  _gpsFixRequested = true;
+  // in case the device sleeps before the fix
+  if (hasGPSPosition() && _gpsData.source == MODEM_LOCATION_GNSS)
+    _saveGPSFix(true);
+}
+
+int32_t Mycila::ModemClass::getGPSFixAge() const {
+  if (!hasGPSPosition() || !_gpsFixTime)
+    return -1;
+  const time_t now = time(nullptr);
+  return now >= _gpsFixTime ? now - _gpsFixTime : -1;
+}
+
+bool Mycila::ModemClass::_loadGPSFix() {
+  GPSFix fix;
+  Preferences preferences;
+  if (!preferences.begin(MYCILA_MODEM_NVS_NAMESPACE, true))
+    return false;
+  const bool found = preferences.getBytesLength(MYCILA_MODEM_GPS_FIX_KEY) == sizeof(fix) && preferences.getBytes(MYCILA_MODEM_GPS_FIX_KEY, &fix, sizeof(fix)) == sizeof(fix);
+  preferences.end();
+
+  if (!found)
+    return false;
+
+  // kept as a fallback if the new fix times out
+  _gpsData.latitude = fix.latitude;
+  _gpsData.longitude = fix.longitude;
+  _gpsData.altitude = fix.altitude;
+  _gpsData.accuracy = fix.accuracy;
+  _gpsData.uncertainty = 0;
+  _gpsData.source = MODEM_LOCATION_GNSS;
+  const time_t fixTime = fix.time;
+  gmtime_r(&fixTime, &_gpsData.time);
+  _gpsFixTime = fix.time;
+  _gpsTTFF = fix.ttff;
+  _gpsAssisted = fix.assisted;
+
+  if (!_gpsRefreshInterval)
+    return false;
+
+  if (fix.stale || _gpsFixRequested) {
+    logger.info(TAG, "New GPS fix requested");
+    return false;
+  }
+
+  // the clock is lost with the power: the device might have been moved
+  const time_t now = time(nullptr);
+  if (now < fixTime) {
+    logger.info(TAG, "Cached GPS position of unknown age");
+    return false;
+  }
+
+  if (now - fixTime >= _gpsRefreshInterval) {
+    logger.info(TAG, "Cached GPS position expired");
+    return false;
+  }
+
+  return true;
+}
+
+void Mycila::ModemClass::_saveGPSFix(bool stale) {
+  GPSFix fix;
+  fix.latitude = _gpsData.latitude;
+  fix.longitude = _gpsData.longitude;
+  fix.altitude = _gpsData.altitude;
+  fix.accuracy = _gpsData.accuracy;
+  fix.time = _gpsFixTime;
+  fix.ttff = _gpsTTFF;
+  fix.assisted = _gpsAssisted;
+  fix.stale = stale;
+
+  Preferences preferences;
+  if (preferences.begin(MYCILA_MODEM_NVS_NAMESPACE, false)) {
+    preferences.putBytes(MYCILA_MODEM_GPS_FIX_KEY, &fix, sizeof(fix));
+    preferences.end();
+  }
+}
+
+void Mycila::ModemClass::_locateWithCells() {
+  _lbsRequested = false;
+  logger.info(TAG, "Locate with the cells...");
+#ifdef TINY_GSM_MODEM_SIM7080
+  const char* command = "AT+CLBS=1,0";
+#else
+  const char* command = "AT+CLBS=1";
+#endif
+  _at.enqueue(command, MYCILA_MODEM_LBS_TIMEOUT, [this](Mycila::AT::Result result, const std::vector<std::string>& lines) {
+    // the A76XX answers OK first and reports the position afterwards
+    if (result == Mycila::AT::AT_OK && lines.empty())
+      _at.enqueueWait("+CLBS:", MYCILA_MODEM_LBS_TIMEOUT, std::bind(&Mycila::ModemClass::_onCellLocation, this, std::placeholders::_1, std::placeholders::_2));
+    else
+      _onCellLocation(result, lines);
+  }, "+CLBS:");
+}
+
+void Mycila::ModemClass::_onCellLocation(Mycila::AT::Result result, const std::vector<std::string>& lines) {
+  const std::vector<std::string> values = result == Mycila::AT::AT_OK && !lines.empty() ? Mycila::AT::parameters(lines[0]) : std::vector<std::string>();
+  if (values.size() < 4 || values[0] != "0") {
+    logger.warn(TAG, "Failed to locate with the cells: %s", lines.empty() ? "timeout" : lines[0].c_str());
+    // GPS fix, like when there is no LBS
+    _gpsFixRequested = true;
+    return;
+  }
+
+#ifdef TINY_GSM_MODEM_SIM7080
+  // +CLBS: 0,<longitude>,<latitude>,<uncertainty>
+  _gpsData.longitude = atof(values[1].c_str());
+  _gpsData.latitude = atof(values[2].c_str());
+#else
+  // +CLBS: 0,<latitude>,<longitude>,<uncertainty>
+  _gpsData.latitude = atof(values[1].c_str());
+  _gpsData.longitude = atof(values[2].c_str());
+#endif
+  _gpsData.altitude = 0;
+  _gpsData.accuracy = 0;
+  _gpsData.uncertainty = atof(values[3].c_str());
+  _gpsData.source = MODEM_LOCATION_LBS;
+  const time_t now = time(nullptr);
+  gmtime_r(&now, &_gpsData.time);
+  _gpsFixTime = isTimeSynced() ? now : 0;
+  _gpsState = MODEM_GPS_LBS;
+  logger.info(TAG, "Located with the cells: %f, %f (%.0f m)", _gpsData.latitude, _gpsData.longitude, _gpsData.uncertainty);
+}
+
+time_t Mycila::ModemClass::_loadGPSAssistanceTime() {
+  Preferences preferences;
+  if (!preferences.begin(MYCILA_MODEM_NVS_NAMESPACE, true))
+    return 0;
+  const time_t downloadTime = preferences.getULong(MYCILA_MODEM_XTRA_KEY, 0);
+  preferences.end();
+  return downloadTime;
+}
+
 void Mycila::ModemClass::_powerModem() {
   // Turn on modem
   pinMode(MYCILA_MODEM_PWR_PIN, OUTPUT);
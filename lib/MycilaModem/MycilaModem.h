@@ -4,10 +4,16 @@
  */
 #pragma once
 
+#include <MycilaAT.h>
+#include <MycilaFrame.h>
+#include <MycilaMQTT.h>
+#include <MycilaOperatorCache.h>
+#include <MycilaTLS.h>
 #include <StreamDebugger.h>
 #include <TinyGsmClient.h>
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -27,10 +33,59 @@
 #define MYCILA_MODEM_GPS_SYNC_TIMEOUT 90
 #endif
 
+// a cached GPS position is used instead of a new fix until it is older (seconds, 0: new fix at each start)
+#ifndef MYCILA_MODEM_GPS_REFRESH_INTERVAL
+#define MYCILA_MODEM_GPS_REFRESH_INTERVAL 604800
+#endif
+
+// GPS assistance data (XTRA) downloaded by the SIM7080 to cut the time to first fix, and its validity (seconds)
+#ifndef MYCILA_MODEM_XTRA_URL
+#define MYCILA_MODEM_XTRA_URL "http://iot1.xtracloud.net/xtra3gr_72h.bin"
+#endif
+#ifndef MYCILA_MODEM_XTRA_VALIDITY
+#define MYCILA_MODEM_XTRA_VALIDITY 259200
+#endif
+#ifndef MYCILA_MODEM_XTRA_TIMEOUT
+#define MYCILA_MODEM_XTRA_TIMEOUT 60000
+#endif
+
+// AT+CLBS: the position is computed by a server from the serving and neighbour cells (ms)
+#ifndef MYCILA_MODEM_LBS_TIMEOUT
+#define MYCILA_MODEM_LBS_TIMEOUT 30000
+#endif
+
 #ifndef MYCILA_MODEM_CONNECT_TIMEOUT
 #define MYCILA_MODEM_CONNECT_TIMEOUT 20
 #endif
 
+// AT+COPS=? (and the commands entered in the console) can take minutes (ms)
+#ifndef MYCILA_MODEM_SCAN_TIMEOUT
+#define MYCILA_MODEM_SCAN_TIMEOUT 180000
+#endif
+
+#ifndef MYCILA_MODEM_ASSOCIATE_TIMEOUT
+#define MYCILA_MODEM_ASSOCIATE_TIMEOUT 60000
+#endif
+
+// UDP socket (CoAP and udp:// connector): the last one, TinyGSM allocates its clients from the first ones
+#ifndef MYCILA_MODEM_UDP_CID
+#define MYCILA_MODEM_UDP_CID 11
+#endif
+
+#ifndef MYCILA_MODEM_UDP_MAX_SIZE
+#define MYCILA_MODEM_UDP_MAX_SIZE 1024
+#endif
+
+// long keep alive: in prevent sleep mode the connection is kept open between the sends
+#ifndef MYCILA_MODEM_MQTT_KEEPALIVE
+#define MYCILA_MODEM_MQTT_KEEPALIVE 3600
+#endif
+
+// time to wait for the downlink messages after a publish (ms)
+#ifndef MYCILA_MODEM_MQTT_DOWNLINK_WAIT
+#define MYCILA_MODEM_MQTT_DOWNLINK_WAIT 1000
+#endif
+
 #ifndef MYCILA_MODEM_PWR_PIN
 #error "MYCILA_MODEM_PWR_PIN not defined"
 #endif
@@ -72,24 +127,42 @@ namespace Mycila {
     MODEM_GPS_SYNCING = 1,
     MODEM_GPS_SYNCED = 2,
     MODEM_GPS_TIMEOUT = 3,
+    MODEM_GPS_CACHED = 4, // position of a previous fix, GPS off
+    MODEM_GPS_LBS = 5,    // coarse position from the cells (LBS), GPS off
   } ModemGPSState;
 
+  typedef enum {
+    MODEM_LOCATION_GNSS = 0,
+    MODEM_LOCATION_LBS = 1,
+  } ModemLocationSource;
+
+  // cell-based location (LBS), which needs the data session
+  typedef enum {
+    MODEM_LBS_OFF = 0,
+    MODEM_LBS_FALLBACK = 1, // when the GPS fix times out without a cached position
+    MODEM_LBS_FIRST = 2,    // instead of a GPS fix, GPS fix if it fails
+  } ModemLBSMode;
+
   typedef struct {
       ModemOperatorState state;
       std::string name;  // operator name
       std::string code;  // operator code
       uint8_t mode; // technology access mode
+      bool cached = false; // from the operator cache instead of a search
   } ModemOperatorSearchResult;
 
   typedef struct {
-      float latitude = 0;
-      float longitude = 0;
+      double latitude = 0;
+      double longitude = 0;
       float altitude = 0;
       struct tm time = {0, 0, 0, 0, 0, 0, 0, 0, 0};
-      float accuracy = 0;
+      float accuracy = 0;    // HDOP of a GPS fix
+      float uncertainty = 0; // meters, 0 if unknown
+      ModemLocationSource source = MODEM_LOCATION_GNSS;
   } ModemGPSData;
 
   typedef std::function<void(ModemState state)> ModemStateChangeCallback;
+  typedef std::function<void(const std::string& topic, const std::string& payload)> ModemMQTTMessageCallback;
 
   class ModemClass {
     public:
@@ -100,9 +173,17 @@ namespace Mycila {
 
       bool isReady() const { return _state == MODEM_READY; }
       bool isGPSSynced() const { return _gpsState == ModemGPSState::MODEM_GPS_SYNCED; }
+      // position from a fix of this start, from the cache or from the cells
+      bool hasGPSPosition() const { return _gpsState == ModemGPSState::MODEM_GPS_SYNCED || _gpsState == ModemGPSState::MODEM_GPS_CACHED || _gpsState == ModemGPSState::MODEM_GPS_LBS; }
       bool isTimeSynced() const { return _timeState == ModemTimeState::MODEM_TIME_SYNCED; }
 
       const ModemGPSData& getGPSData() const { return _gpsData; }
+      // seconds since the fix of the position, -1 if there is no position or the time is not known
+      int32_t getGPSFixAge() const;
+      // time to first fix of the position (ms), from the moment the GPS was enabled, 0 if unknown
+      uint32_t getGPSTimeToFirstFix() const { return _gpsTTFF; }
+      // the position was fixed with assistance data
+      bool isGPSAssisted() const { return _gpsAssisted; }
       const ModemOperatorSearchResult* getCandidate() const { return _candidate; }
       TinyGsm* getModem() { return &_modem; }
       ModemMode getMode() const { return _mode; }
@@ -110,6 +191,7 @@ namespace Mycila {
       ModemTimeState getTimeState() const { return _timeState; }
       ModemGPSState getGPSState() const { return _gpsState; }
       std::vector<ModemOperatorSearchResult> getDiscoveredOperators() const { return _operators; }
+      const OperatorCache& getOperatorCache() const { return _operatorCache; }
 
       const std::string& getAPN() const { return _apn; }
       const std::string& getTimeZoneInfo() const { return _timeZoneInfo; }
@@ -124,6 +206,10 @@ namespace Mycila {
       const std::string& getPIN() const { return _pin; }
       // 0-100%
       uint8_t getSignalQuality() const { return _signal; }
+      // serving band, 0 if unknown
+      uint16_t getBand() const { return _band; }
+      // time spent in the last registration (ms), operator search included
+      uint32_t getRegistrationTime() const { return _registrationTime; }
 
       void setAPN(const std::string& apn) { _apn = apn; }
       void setTimeZoneInfo(const std::string& timeZoneInfo) { _timeZoneInfo = timeZoneInfo; }
@@ -132,24 +218,62 @@ namespace Mycila {
       void setPIN(const std::string& pin) { _pin = pin; }
       void setPreferredMode(ModemMode mode) { _mode = mode; }
       void setGpsSyncTimeout(uint32_t timeoutSec) { _gpsSyncTimeout = timeoutSec; }
+      void setGpsRefreshInterval(uint32_t intervalSec) { _gpsRefreshInterval = intervalSec; }
+      void setLBSMode(ModemLBSMode mode) { _lbsMode = mode; }
       void setCallback(ModemStateChangeCallback callback) { _callback = callback; }
+      // root certificates (tools/cacerts.py) to verify the servers when TLS is computed by the ESP32 instead of the modem (https://)
+      bool setCABundle(const uint8_t* bundle, size_t size) { return _caBundle.begin(bundle, size); }
+      // must be stable: the broker keeps the MQTT session of a client id
+      void setMQTTClientId(const std::string& clientId) { _mqttClientId = clientId; }
+      // called for each message received on the downlink topic
+      void setMQTTCallback(ModemMQTTMessageCallback callback) { _mqttCallback = callback; }
 
       void enqueueAT(const char* cmd) { _commands.push_back(cmd); }
-      void scanForOperators() { _state = MODEM_SEARCHING; }
+      void scanForOperators() {
+        _registrationStartTime = millis();
+        _state = MODEM_SEARCHING;
+      }
+      // forgets the cached operators, GPS position and GPS assistance data
+      void clearCaches();
       void powerOff();
       bool activateData();
+      // injects the GPS assistance data (if valid) before enabling the GPS
       void activateGPS();
-
-      // Returns ESP_OK or ESP_ERR_TIMEOUT if connection times out
-      int sendTCP(const std::string& host, uint16_t port, const std::string& payload, const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
-
-      // Returns ESP_OK or ESP_ERR_TIMEOUT if connection times out
-      int httpPOST(const std::string& url, const std::string& payload, const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
+      // Downloads new GPS assistance data over the active data session when the current one will have expired at the next fix (SIM7080 only).
+      // At most once per start, waits for the download.
+      void updateGPSAssistance();
+      // new GPS fix now if the modem is ready, otherwise at the next start, even with a recent cached position
+      void requestGPSFix();
+
+      // Sends a length-prefixed frame to a tcp://host:port or udp://host:port connector (udp:// on SIM7080 only) and waits for its ACK (see MycilaFrame.h).
+      // The socket is kept open for the next frames and closed by closeSocket() or powerOff().
+      // Returns ESP_OK once acknowledged, ESP_ERR_TIMEOUT if connection or ACK times out, ESP_ERR_INVALID_SIZE if too big for a datagram
+      int sendFrame(const std::string& url, const std::string& payload, const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
+      void closeSocket();
+
+      // Returns ESP_OK on a 2xx response, ESP_ERR_TIMEOUT if connection times out, ESP_ERR_INVALID_RESPONSE on another status. The payload can be binary.
+      // With a CA bundle, https:// goes through TLS on the ESP32 (see MycilaTLS.h) with a session resumed across wakes
+      int httpPOST(const std::string& url, const std::string& payload, const char* contentType = "application/json", const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
+
+      // Confirmable CoAP POST over UDP to a coap:// URL (SIM7080 only).
+      // Returns ESP_OK on a 2.xx response, ESP_ERR_TIMEOUT if not acknowledged after the retransmissions,
+      // ESP_ERR_INVALID_RESPONSE on an error response or a reset, ESP_ERR_NOT_SUPPORTED for coaps:// (no DTLS),
+      // ESP_ERR_INVALID_SIZE if the message does not fit in a datagram (MYCILA_MODEM_UDP_MAX_SIZE)
+      int coapPOST(const std::string& url, const std::string& payload, const char* contentType = "application/json", const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
+
+      // Publishes at QoS 1 to the topic of a mqtt:// or mqtts:// URL (mqtts:// on SIM7080 only), without clean session,
+      // and receives the messages of the downlink topic (if any) waiting in the broker session.
+      // The connection is kept open for the next publish and closed by mqttDisconnect() or powerOff().
+      // Returns ESP_OK once acknowledged, ESP_ERR_TIMEOUT if connection times out, ESP_ERR_INVALID_RESPONSE if refused by the broker
+      int mqttPublish(const std::string& url, const std::string& payload, const std::string& downlinkTopic = "", const uint16_t connectTimeoutSec = MYCILA_MODEM_CONNECT_TIMEOUT);
+      void mqttDisconnect();
 
     private:
       // model and streams
       StreamDebugger _spy;
       TinyGsm _modem;
+      // non-blocking commands: while busy, the serial line is not read by TinyGSM
+      AT::Engine _at;
 
     private:
       // debug
@@ -162,6 +286,13 @@ namespace Mycila {
       ModemGPSState _gpsState = MODEM_GPS_OFF;
       uint32_t _gpsSyncStartTime = 0;
       ModemGPSData _gpsData;
+      time_t _gpsFixTime = 0; // unix time of the fix of _gpsData
+      bool _gpsFixRequested = false;
+      uint32_t _gpsStartTime = 0; // GPS enabled
+      uint32_t _gpsTTFF = 0;
+      bool _gpsAssisted = false;
+      bool _gpsAssistanceChecked = false;
+      bool _lbsRequested = false; // once data is active
       std::string _timeZoneInfo = "UTC0";
 
     private:
@@ -173,6 +304,7 @@ namespace Mycila {
       std::string _model;
       std::string _operator;
       uint8_t _signal;
+      uint16_t _band = 0;
 
     private:
       // Modem settings
@@ -180,6 +312,8 @@ namespace Mycila {
       std::string _apn;
       std::string _pin;
       uint32_t _gpsSyncTimeout = MYCILA_MODEM_GPS_SYNC_TIMEOUT;
+      uint32_t _gpsRefreshInterval = MYCILA_MODEM_GPS_REFRESH_INTERVAL;
+      ModemLBSMode _lbsMode = MODEM_LBS_FALLBACK;
       std::map<ModemMode, std::string> _bands = {
         {MODEM_MODE_LTE_M, "1,2,3,4,5,8,12,13,14,18,19,20,25,26,2 7,28,66,85"},
         {MODEM_MODE_NB_IOT, "1,2,3,4,5,8,12,13,18,19,20,25,26,28,6 6,71,85"},
@@ -190,6 +324,11 @@ namespace Mycila {
       int _candidateIndex = -1;
       int _registrationCheckCount = 7;
       uint32_t _registrationCheckLastTime = 0;
+      uint8_t _registration = 0; // one bit per domain (+CREG, +CGREG, +CEREG) reporting a registration
+      uint32_t _registrationStartTime = 0;
+      uint32_t _associationStartTime = 0; // of the current candidate
+      uint32_t _registrationTime = 0;
+      OperatorCache _operatorCache;
       ModemOperatorSearchResult* _candidate = nullptr;
       std::vector<ModemOperatorSearchResult> _operators;
 
@@ -200,20 +339,56 @@ namespace Mycila {
       std::string _error;
       uint32_t _lastRefreshTime = 0;
       std::vector<std::string> _commands;
+      CABundle _caBundle;
+      uint16_t _coapMessageId = esp_random();
+
+    private:
+      // MQTT
+      std::string _mqttClientId;
+      ModemMQTTMessageCallback _mqttCallback = nullptr;
+      std::unique_ptr<TinyGsmClient> _mqttTransport;
+      std::unique_ptr<MQTT::Client> _mqtt;
+      std::string _mqttURL;        // broker URL of the open connection
+
+    private:
+      // connector socket
+      std::unique_ptr<TinyGsmClient> _socket; // TCP
+      std::string _socketURL;                 // connector URL of the open socket
+      uint16_t _frameSequence = esp_random();
 
     private:
       // utilities
       void _onRead(const uint8_t* buffer, size_t size);
       void _onWrite(const uint8_t* buffer, size_t size);
-      void _readDrop();
       void _setMode(uint8_t mode);
       void _setState(ModemState state);
       bool _syncGPS();
+      bool _loadGPSFix();
+      void _saveGPSFix(bool stale);
+      time_t _loadGPSAssistanceTime();
       bool _syncTime();
       void _syncInfo();
       void _sync();
       void _dequeueATCommands();
+      void _waitForAT();
+      void _associateNext();
+      void _onOperators(AT::Result result, const std::vector<std::string>& lines);
+      void _onRegistration(uint8_t domain, const std::string& line);
+      void _onNetworkTime(const std::string& line);
+      void _onPDP(const std::string& line);
+      void _onServingCell(const std::vector<std::string>& lines);
+      void _locateWithCells();
+      void _onCellLocation(AT::Result result, const std::vector<std::string>& lines);
       void _powerModem();
+      // HTTP(S) over a TinyGsmClient
+      int _httpPOST(const std::string& url, const std::string& payload, const char* contentType, const uint16_t connectTimeoutSec);
+      int _mqttConnect(const MQTT::URL& mqttURL, const std::string& url, const uint16_t connectTimeoutSec);
+#ifdef TINY_GSM_MODEM_SIM7080
+      bool _udpOpen(const std::string& host, uint16_t port, const uint16_t connectTimeoutSec);
+      bool _udpSend(const std::string& datagram);
+      bool _udpReceive(std::string& datagram, uint32_t timeoutMs);
+      void _udpClose();
+#endif
   };
 
   extern ModemClass Modem;
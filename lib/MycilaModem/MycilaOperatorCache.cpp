@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <MycilaOperatorCache.h>
+
+#include <MycilaLogger.h>
+#include <Preferences.h>
+
+#include <algorithm>
+#include <string.h>
+
+#define TAG "MODEM"
+
+#define MYCILA_OPERATOR_CACHE_NAMESPACE "modem"
+#define MYCILA_OPERATOR_CACHE_KEY       "operators"
+
+extern Mycila::Logger logger;
+
+namespace {
+  // fewest consecutive failures, then best success ratio, then fastest registration
+  bool isBetter(const Mycila::OperatorStats& a, const Mycila::OperatorStats& b) {
+    if (a.misses != b.misses)
+      return a.misses < b.misses;
+    const uint32_t ratioA = a.successes * 100 / (a.successes + a.failures);
+    const uint32_t ratioB = b.successes * 100 / (b.successes + b.failures);
+    if (ratioA != ratioB)
+      return ratioA > ratioB;
+    return a.latency < b.latency;
+  }
+} // namespace
+
+void Mycila::OperatorCache::begin() {
+  _stats.clear();
+
+  Preferences preferences;
+  if (!preferences.begin(MYCILA_OPERATOR_CACHE_NAMESPACE, true))
+    return;
+
+  // the size changes with the structure: the statistics of a previous firmware are dropped
+  const size_t size = preferences.getBytesLength(MYCILA_OPERATOR_CACHE_KEY);
+  if (size && size % sizeof(OperatorStats) == 0 && size / sizeof(OperatorStats) <= MYCILA_OPERATOR_CACHE_SIZE) {
+    _stats.resize(size / sizeof(OperatorStats));
+    preferences.getBytes(MYCILA_OPERATOR_CACHE_KEY, _stats.data(), size);
+  }
+
+  preferences.end();
+
+  for (const OperatorStats& stats : _stats)
+    logger.debug(TAG, "Cached operator %s (%d) code=%s, band=%d, successes=%d, failures=%d, misses=%d, latency=%u ms", stats.name, stats.mode, stats.code, stats.band, stats.successes, stats.failures, stats.misses, stats.latency);
+}
+
+void Mycila::OperatorCache::clear() {
+  _stats.clear();
+  Preferences preferences;
+  if (preferences.begin(MYCILA_OPERATOR_CACHE_NAMESPACE, false)) {
+    preferences.remove(MYCILA_OPERATOR_CACHE_KEY);
+    preferences.end();
+  }
+}
+
+std::vector<Mycila::OperatorStats> Mycila::OperatorCache::getCandidates() const {
+  std::vector<OperatorStats> candidates;
+  for (const OperatorStats& stats : _stats)
+    if (stats.misses < MYCILA_OPERATOR_CACHE_MAX_MISSES)
+      candidates.push_back(stats);
+  std::stable_sort(candidates.begin(), candidates.end(), isBetter);
+  return candidates;
+}
+
+int Mycila::OperatorCache::rank(const std::string& code, uint8_t mode) const {
+  const std::vector<OperatorStats> candidates = getCandidates();
+  for (size_t i = 0; i < candidates.size(); i++)
+    if (code == candidates[i].code && mode == candidates[i].mode)
+      return i;
+  return -1;
+}
+
+void Mycila::OperatorCache::success(const std::string& code, const std::string& name, uint8_t mode, uint16_t band, uint32_t latency) {
+  if (code.empty())
+    return;
+
+  OperatorStats* stats = _find(code, mode);
+
+  if (!stats) {
+    // replaces the worst one
+    if (_stats.size() >= MYCILA_OPERATOR_CACHE_SIZE) {
+      std::stable_sort(_stats.begin(), _stats.end(), isBetter);
+      _stats.pop_back();
+    }
+    _stats.push_back(OperatorStats());
+    stats = &_stats.back();
+    memset(stats, 0, sizeof(OperatorStats));
+    strncpy(stats->code, code.c_str(), sizeof(stats->code) - 1);
+    stats->mode = mode;
+    stats->latency = latency;
+  }
+
+  if (!name.empty())
+    strncpy(stats->name, name.c_str(), sizeof(stats->name) - 1);
+  if (band)
+    stats->band = band;
+  if (stats->successes < UINT16_MAX)
+    stats->successes++;
+  stats->misses = 0;
+  // moving average
+  stats->latency = (stats->latency * 3 + latency) / 4;
+
+  _save();
+}
+
+void Mycila::OperatorCache::failure(const std::string& code, uint8_t mode) {
+  OperatorStats* stats = _find(code, mode);
+  if (!stats)
+    return;
+
+  if (stats->failures < UINT16_MAX)
+    stats->failures++;
+  if (stats->misses < UINT8_MAX)
+    stats->misses++;
+
+  _save();
+}
+
+Mycila::OperatorStats* Mycila::OperatorCache::_find(const std::string& code, uint8_t mode) {
+  for (OperatorStats& stats : _stats)
+    if (code == stats.code && mode == stats.mode)
+      return &stats;
+  return nullptr;
+}
+
+void Mycila::OperatorCache::_save() {
+  Preferences preferences;
+  if (preferences.begin(MYCILA_OPERATOR_CACHE_NAMESPACE, false)) {
+    preferences.putBytes(MYCILA_OPERATOR_CACHE_KEY, _stats.data(), _stats.size() * sizeof(OperatorStats));
+    preferences.end();
+  }
+}
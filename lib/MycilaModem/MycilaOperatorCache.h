@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#ifndef MYCILA_OPERATOR_CACHE_SIZE
+#define MYCILA_OPERATOR_CACHE_SIZE 8
+#endif
+
+// consecutive failures after which an operator is not tried first anymore
+#ifndef MYCILA_OPERATOR_CACHE_MAX_MISSES
+#define MYCILA_OPERATOR_CACHE_MAX_MISSES 3
+#endif
+
+namespace Mycila {
+  typedef struct {
+      char code[8];       // MCC and MNC, like 20801
+      char name[24];      // operator name, for the logs
+      uint8_t mode;       // 7: LTE-M, 9: NB-IoT
+      uint8_t misses;     // consecutive failures
+      uint16_t band;      // serving band of the last registration, 0 if unknown
+      uint16_t successes; // registrations
+      uint16_t failures;  // association failures and registration timeouts
+      uint32_t latency;   // average registration time (ms)
+  } OperatorStats;
+
+  // Operators the modem registered with, kept in NVS across deep sleeps and power cycles,
+  // with their success and registration time statistics to try the best ones first instead of scanning (AT+COPS=?).
+  class OperatorCache {
+    public:
+      // loads the statistics from NVS
+      void begin();
+      void clear();
+
+      // operators with less than MYCILA_OPERATOR_CACHE_MAX_MISSES consecutive failures, best first
+      std::vector<OperatorStats> getCandidates() const;
+      // position of an operator in the candidates, -1 if it is not one of them
+      int rank(const std::string& code, uint8_t mode) const;
+      const std::vector<OperatorStats>& getStats() const { return _stats; }
+
+      void success(const std::string& code, const std::string& name, uint8_t mode, uint16_t band, uint32_t latency);
+      void failure(const std::string& code, uint8_t mode);
+
+    private:
+      std::vector<OperatorStats> _stats;
+
+    private:
+      OperatorStats* _find(const std::string& code, uint8_t mode);
+      void _save();
+  };
+} // namespace Mycila
@@ -0,0 +1,383 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <MycilaTLS.h>
+
+#include <Arduino.h>
+#include <MycilaLogger.h>
+#include <esp_attr.h>
+#include <esp_random.h>
+#include <esp_rom_crc.h>
+#include <mbedtls/md.h>
+#include <mbedtls/pk.h>
+
+#ifdef MBEDTLS_PSA_CRYPTO_C
+  #include <psa/crypto.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
+#include <algorithm>
+
+#ifndef MBEDTLS_PRIVATE
+  #define MBEDTLS_PRIVATE(member) member
+#endif
+
+#define TAG "TLS"
+
+#define MYCILA_TLS_SESSION_MAGIC 0x544c5353 // TLSS
+#define MYCILA_TLS_HOST_SIZE     64
+
+extern Mycila::Logger logger;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t port;
+    uint16_t length;
+    char host[MYCILA_TLS_HOST_SIZE];
+    uint8_t session[MYCILA_TLS_SESSION_CACHE_SIZE]; // mbedtls_ssl_session_save()
+    uint32_t crc;                                   // CRC32 of the fields above
+} TLSSessionCache;
+
+// survives deep sleep, not power loss
+RTC_NOINIT_ATTR static TLSSessionCache sessionCache;
+
+static uint32_t sessionCacheCRC() {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&sessionCache), offsetof(TLSSessionCache, crc));
+}
+
+static uint16_t readU16(const uint8_t* p) { return p[0] << 8 | p[1]; }
+
+////////////////////////////////////////////////////////////////////////////////
+// CABundle
+////////////////////////////////////////////////////////////////////////////////
+
+bool Mycila::CABundle::begin(const uint8_t* data, size_t size) {
+  _data = nullptr;
+  _index.clear();
+
+  if (!data || size < 2)
+    return false;
+
+  const uint16_t count = readU16(data);
+  _index.reserve(count);
+
+  size_t offset = 2;
+  for (uint16_t i = 0; i < count; i++) {
+    if (offset + 4 > size)
+      break;
+    const size_t length = 4 + readU16(data + offset) + readU16(data + offset + 2);
+    if (offset + length > size)
+      break;
+    _index.push_back(offset);
+    offset += length;
+  }
+
+  if (_index.size() != count) {
+    logger.error(TAG, "Invalid CA bundle: %u/%u certificates", _index.size(), count);
+    _index.clear();
+    return false;
+  }
+
+  _data = data;
+  logger.info(TAG, "CA bundle: %u certificates", count);
+  return true;
+}
+
+const uint8_t* Mycila::CABundle::findPublicKey(const uint8_t* name, size_t nameLength, size_t& keyLength) const {
+  // same order as tools/cacerts.py: bytewise comparison, then the shortest first
+  size_t low = 0;
+  size_t high = _index.size();
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    const uint8_t* crt = _data + _index[middle];
+    const size_t crtNameLength = readU16(crt);
+    int cmp = memcmp(crt + 4, name, std::min(crtNameLength, nameLength));
+    if (cmp == 0)
+      cmp = crtNameLength < nameLength ? -1 : crtNameLength > nameLength ? 1 : 0;
+    if (cmp == 0) {
+      keyLength = readU16(crt + 2);
+      return crt + 4 + crtNameLength;
+    }
+    if (cmp < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TLSClient
+////////////////////////////////////////////////////////////////////////////////
+
+Mycila::TLSClient::TLSClient(Client& transport, const CABundle& bundle) : _transport(transport), _bundle(bundle) {
+  mbedtls_ssl_init(&_ssl);
+  mbedtls_ssl_config_init(&_conf);
+  mbedtls_x509_crt_init(&_emptyChain);
+
+#ifdef MBEDTLS_PSA_CRYPTO_C
+  psa_crypto_init();
+#endif
+
+  if (mbedtls_ssl_config_defaults(&_conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    return;
+
+  // TLS 1.3 sends the session tickets after the handshake: TLS 1.2 resumes in the handshake
+  mbedtls_ssl_conf_max_tls_version(&_conf, MBEDTLS_SSL_VERSION_TLS1_2);
+  mbedtls_ssl_conf_authmode(&_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  mbedtls_ssl_conf_ca_chain(&_conf, &_emptyChain, nullptr);
+  mbedtls_ssl_conf_verify(&_conf, _verify, this);
+  mbedtls_ssl_conf_rng(&_conf, _random, nullptr);
+  mbedtls_ssl_conf_session_tickets(&_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+  if (mbedtls_ssl_setup(&_ssl, &_conf) != 0)
+    return;
+
+  mbedtls_ssl_set_bio(&_ssl, this, _send, _recv, nullptr);
+  _ready = true;
+}
+
+Mycila::TLSClient::~TLSClient() {
+  stop();
+  mbedtls_ssl_free(&_ssl);
+  mbedtls_ssl_config_free(&_conf);
+  mbedtls_x509_crt_free(&_emptyChain);
+}
+
+int Mycila::TLSClient::connect(const char* host, uint16_t port) {
+  if (!_ready || !_bundle.isValid() || !host)
+    return 0;
+
+  if (connected() && _port == port && _host == host)
+    return 1;
+
+  if (_connected)
+    stop();
+
+  if (!_transport.connected() && !_transport.connect(host, port))
+    return 0;
+
+  if (!_handshake(host, port)) {
+    stop();
+    return 0;
+  }
+
+  _connected = true;
+  _host = host;
+  _port = port;
+  return 1;
+}
+
+size_t Mycila::TLSClient::write(const uint8_t* buf, size_t size) {
+  if (!_connected)
+    return 0;
+
+  const uint32_t start = millis();
+  size_t written = 0;
+  while (written < size) {
+    const int ret = mbedtls_ssl_write(&_ssl, buf + written, size - written);
+    if (ret > 0) {
+      written += ret;
+    } else if ((ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ) && millis() - start < MYCILA_TLS_HANDSHAKE_TIMEOUT) {
+      delay(10);
+    } else {
+      logger.error(TAG, "Write error: -0x%04x", -ret);
+      stop();
+      break;
+    }
+  }
+  return written;
+}
+
+int Mycila::TLSClient::available() {
+  if (!_connected)
+    return 0;
+
+  // processes the records received by the transport
+  const int ret = mbedtls_ssl_read(&_ssl, nullptr, 0);
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+    if (ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+      logger.error(TAG, "Read error: -0x%04x", -ret);
+    _connected = false;
+  }
+
+  return mbedtls_ssl_get_bytes_avail(&_ssl) + (_peeked >= 0 ? 1 : 0);
+}
+
+int Mycila::TLSClient::read() {
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int Mycila::TLSClient::read(uint8_t* buf, size_t size) {
+  if (!size || !available())
+    return -1;
+
+  size_t n = 0;
+  if (_peeked >= 0) {
+    buf[n++] = _peeked;
+    _peeked = -1;
+  }
+
+  if (n < size && mbedtls_ssl_get_bytes_avail(&_ssl)) {
+    const int ret = mbedtls_ssl_read(&_ssl, buf + n, size - n);
+    if (ret > 0)
+      n += ret;
+  }
+
+  return n ? n : -1;
+}
+
+int Mycila::TLSClient::peek() {
+  if (_peeked < 0)
+    _peeked = read();
+  return _peeked;
+}
+
+void Mycila::TLSClient::stop() {
+  if (_connected)
+    mbedtls_ssl_close_notify(&_ssl);
+  _connected = false;
+  _peeked = -1;
+  _transport.stop();
+  mbedtls_ssl_session_reset(&_ssl);
+}
+
+uint8_t Mycila::TLSClient::connected() {
+  return _connected && (mbedtls_ssl_get_bytes_avail(&_ssl) || _peeked >= 0 || _transport.connected());
+}
+
+void Mycila::TLSClient::clearSessionCache() {
+  sessionCache.magic = 0;
+}
+
+bool Mycila::TLSClient::_handshake(const char* host, uint16_t port) {
+  if (mbedtls_ssl_set_hostname(&_ssl, host) != 0)
+    return false;
+
+  _loadSession(host, port);
+  _verified = false;
+
+  const uint32_t start = millis();
+  int ret;
+  while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+    if ((ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) || millis() - start >= MYCILA_TLS_HANDSHAKE_TIMEOUT) {
+      const uint32_t flags = mbedtls_ssl_get_verify_result(&_ssl);
+      if (flags && flags != static_cast<uint32_t>(-1))
+        logger.error(TAG, "Handshake with %s failed: certificate not trusted (0x%08x)", host, flags);
+      else
+        logger.error(TAG, "Handshake with %s failed: -0x%04x", host, -ret);
+      // do not retry with a session which might be the cause
+      clearSessionCache();
+      return false;
+    }
+    delay(10);
+  }
+
+  // the certificates are only verified in a full handshake
+  _resumed = !_verified;
+  logger.info(TAG, "%s handshake with %s in %u ms (%s)", _resumed ? "Abbreviated" : "Full", host, millis() - start, mbedtls_ssl_get_ciphersuite(&_ssl));
+
+  _saveSession(host, port);
+  return true;
+}
+
+void Mycila::TLSClient::_loadSession(const char* host, uint16_t port) {
+  if (sessionCache.magic != MYCILA_TLS_SESSION_MAGIC || sessionCache.crc != sessionCacheCRC())
+    return;
+  if (sessionCache.port != port || strncmp(sessionCache.host, host, MYCILA_TLS_HOST_SIZE) != 0)
+    return;
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  // the server can still refuse it and do a full handshake
+  if (mbedtls_ssl_session_load(&session, sessionCache.session, sessionCache.length) != 0 || mbedtls_ssl_set_session(&_ssl, &session) != 0)
+    clearSessionCache();
+  mbedtls_ssl_session_free(&session);
+}
+
+void Mycila::TLSClient::_saveSession(const char* host, uint16_t port) {
+  if (strlen(host) >= MYCILA_TLS_HOST_SIZE)
+    return;
+
+  mbedtls_ssl_session session;
+  mbedtls_ssl_session_init(&session);
+  size_t length = 0;
+  if (mbedtls_ssl_get_session(&_ssl, &session) == 0 && mbedtls_ssl_session_save(&session, sessionCache.session, MYCILA_TLS_SESSION_CACHE_SIZE, &length) == 0) {
+    sessionCache.magic = MYCILA_TLS_SESSION_MAGIC;
+    sessionCache.port = port;
+    sessionCache.length = length;
+    memset(sessionCache.host, 0, MYCILA_TLS_HOST_SIZE);
+    strncpy(sessionCache.host, host, MYCILA_TLS_HOST_SIZE - 1);
+    sessionCache.crc = sessionCacheCRC();
+  } else {
+    logger.warn(TAG, "Unable to keep the session (%u bytes max)", MYCILA_TLS_SESSION_CACHE_SIZE);
+    clearSessionCache();
+  }
+  mbedtls_ssl_session_free(&session);
+}
+
+int Mycila::TLSClient::_send(void* ctx, const unsigned char* buf, size_t len) {
+  Client& transport = static_cast<TLSClient*>(ctx)->_transport;
+  if (!transport.connected())
+    return MBEDTLS_ERR_SSL_CONN_EOF;
+  const size_t n = transport.write(buf, len);
+  return n ? n : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int Mycila::TLSClient::_recv(void* ctx, unsigned char* buf, size_t len) {
+  Client& transport = static_cast<TLSClient*>(ctx)->_transport;
+  const int available = transport.available();
+  if (available <= 0)
+    return transport.connected() ? MBEDTLS_ERR_SSL_WANT_READ : 0; // 0: EOF
+  const int n = transport.read(buf, std::min(len, static_cast<size_t>(available)));
+  return n > 0 ? n : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+int Mycila::TLSClient::_random(void* ctx, unsigned char* output, size_t len) {
+  // hardware RNG: true random numbers while the radio is on
+  esp_fill_random(output, len);
+  return 0;
+}
+
+int Mycila::TLSClient::_verify(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags) {
+  static_cast<TLSClient*>(ctx)->_verified = true;
+
+  // only the top of the chain is not trusted: it must be signed by a root certificate of the bundle
+  if (!(*flags & MBEDTLS_X509_BADCERT_NOT_TRUSTED))
+    return 0;
+
+  const CABundle& bundle = static_cast<TLSClient*>(ctx)->_bundle;
+  size_t keyLength;
+  const uint8_t* key = bundle.findPublicKey(crt->issuer_raw.p, crt->issuer_raw.len, keyLength);
+  if (!key)
+    return 0;
+
+  const mbedtls_md_info_t* md = mbedtls_md_info_from_type(crt->MBEDTLS_PRIVATE(sig_md));
+  if (!md)
+    return 0;
+
+  unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+  if (mbedtls_md(md, crt->tbs.p, crt->tbs.len, hash) != 0)
+    return 0;
+
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  if (mbedtls_pk_parse_public_key(&pk, key, keyLength) == 0 &&
+      mbedtls_pk_verify_ext(crt->MBEDTLS_PRIVATE(sig_pk),
+                            crt->MBEDTLS_PRIVATE(sig_opts),
+                            &pk,
+                            crt->MBEDTLS_PRIVATE(sig_md),
+                            hash,
+                            mbedtls_md_get_size(md),
+                            crt->MBEDTLS_PRIVATE(sig).p,
+                            crt->MBEDTLS_PRIVATE(sig).len) == 0) {
+    *flags &= ~MBEDTLS_X509_BADCERT_NOT_TRUSTED;
+  }
+  mbedtls_pk_free(&pk);
+
+  return 0;
+}
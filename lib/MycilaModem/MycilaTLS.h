@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: MIT
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#pragma once
+
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#include <string>
+#include <vector>
+
+// RTC memory kept for the TLS session of the last server: it includes the peer certificate if mbedTLS keeps it
+#ifndef MYCILA_TLS_SESSION_CACHE_SIZE
+#define MYCILA_TLS_SESSION_CACHE_SIZE 2048
+#endif
+
+#ifndef MYCILA_TLS_HANDSHAKE_TIMEOUT
+#define MYCILA_TLS_HANDSHAKE_TIMEOUT 30000
+#endif
+
+namespace Mycila {
+  // Root certificates bundle built by tools/cacerts.py (ESP-IDF format), sorted by subject name:
+  //
+  //   [count (u16)][certificate][certificate]...    certificate: [name length (u16)][key length (u16)][subject name (DER)][public key (DER)]
+  //
+  // The bundle stays in flash: only the offset of each certificate is indexed in memory, for a binary search by subject name.
+  class CABundle {
+    public:
+      // validates and indexes the bundle, which must outlive this object
+      bool begin(const uint8_t* data, size_t size);
+      bool isValid() const { return !_index.empty(); }
+      size_t getCount() const { return _index.size(); }
+      // public key (DER) of the root certificate with this subject name (DER), nullptr if none
+      const uint8_t* findPublicKey(const uint8_t* name, size_t nameLength, size_t& keyLength) const;
+
+    private:
+      const uint8_t* _data = nullptr;
+      std::vector<uint32_t> _index; // offset of each certificate
+  };
+
+  // TLS 1.2 computed by the ESP32 (mbedTLS) over a plain client, typically a TinyGsmClient,
+  // instead of the TLS stack of the modem.
+  // The server certificate chain is verified against the CA bundle and the hostname.
+  // The session of the last server is kept in RTC memory and resumed at the next connection to this server, even after a deep sleep:
+  // an abbreviated handshake saves a round trip, the certificate chain download and its verification.
+  class TLSClient : public Client {
+    public:
+      // the transport can be already connected
+      TLSClient(Client& transport, const CABundle& bundle);
+      ~TLSClient();
+
+      // connects the transport if needed and does the handshake,
+      // nothing if already connected to this server (HttpClient connects again before each request)
+      int connect(const char* host, uint16_t port) override;
+      // not supported: the hostname is required to verify the certificate
+      int connect(IPAddress ip, uint16_t port) override { return 0; }
+      size_t write(uint8_t b) override { return write(&b, 1); }
+      size_t write(const uint8_t* buf, size_t size) override;
+      int available() override;
+      int read() override;
+      int read(uint8_t* buf, size_t size) override;
+      int peek() override;
+      void flush() override {}
+      void stop() override;
+      uint8_t connected() override;
+      operator bool() override { return connected(); }
+
+      // whether the last handshake resumed the cached session
+      bool isResumed() const { return _resumed; }
+      // the next connection does a full handshake
+      static void clearSessionCache();
+
+    private:
+      Client& _transport;
+      const CABundle& _bundle;
+      mbedtls_ssl_context _ssl;
+      mbedtls_ssl_config _conf;
+      // empty CA chain: the certificates are verified against the bundle
+      mbedtls_x509_crt _emptyChain;
+      bool _ready = false;
+      bool _connected = false;
+      bool _resumed = false;
+      bool _verified = false; // certificates received in the handshake
+      int _peeked = -1;
+      std::string _host; // of the open connection
+      uint16_t _port = 0;
+
+    private:
+      bool _handshake(const char* host, uint16_t port);
+      void _loadSession(const char* host, uint16_t port);
+      void _saveSession(const char* host, uint16_t port);
+      static int _send(void* ctx, const unsigned char* buf, size_t len);
+      static int _recv(void* ctx, unsigned char* buf, size_t len);
+      static int _random(void* ctx, unsigned char* output, size_t len);
+      static int _verify(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags);
+  };
+} // namespace Mycila
@@ -6,16 +6,70 @@
 
 #include <BeelanceWebsite.h>
 #include <LittleFS.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
 
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <map>
 #include <string>
 
 #define TAG "BEELANCE"
 
-Beelance::BeelanceClass::BeelanceClass() {
-  latestHistory.reserve(BEELANCE_MAX_HISTORY_SIZE);
-  hourlyHistory.reserve(BEELANCE_MAX_HISTORY_SIZE);
-  dailyHistory.reserve(BEELANCE_MAX_HISTORY_SIZE);
+#define BEELANCE_UPLINK_MAGIC 0x42555053 // BUPS
+#define BEELANCE_WEIGHT_MAGIC 0x42575354 // BWST
+
+// settings which can be changed from the MQTT downlink: the others (passwords, network, URL, modem, pins) would allow to take over the device
+static const char* REMOTE_CONFIG_KEYS[] = {
+  KEY_HISTORY_DAILY_SIZE,
+  KEY_HISTORY_FLUSH_CYCLES,
+  KEY_HISTORY_HOURLY_SIZE,
+  KEY_HISTORY_LATEST_SIZE,
+  KEY_HX711_FILTER,
+  KEY_HX711_SAMPLES,
+  KEY_HX711_SETTLE_THRESHOLD,
+  KEY_MODEM_GPS_LBS,
+  KEY_MODEM_GPS_REFRESH,
+  KEY_MODEM_GPS_SYNC_TIMEOUT,
+  KEY_MODEM_GPS_WEIGHT_DELTA,
+  KEY_NIGHT_START_TIME,
+  KEY_NIGHT_STOP_TIME,
+  KEY_SEND_BATCH_SIZE,
+  KEY_SEND_INTERVAL,
+  KEY_SEND_METADATA_INTERVAL,
+};
+
+// fields which rarely change, only sent when they change or at each metadata interval
+static const char* METADATA_KEYS[] = {"bh", "sim", "op", "dev", "ver", "lat", "long", "alt", "fix_age", "fix_src", "fix_acc"};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t hash;   // hash of the metadata last sent
+    uint32_t sentAt; // unix time of the last metadata send
+    uint32_t crc;
+} UplinkState;
+
+typedef struct {
+    uint32_t magic;
+    int32_t weight; // weight of the previous measurement
+    uint32_t crc;
+} WeightState;
+
+// survive deep sleep
+RTC_NOINIT_ATTR static Beelance::HistoryStaging historyStaging;
+RTC_NOINIT_ATTR static UplinkState uplinkState;
+RTC_NOINIT_ATTR static WeightState weightState;
+
+static uint32_t uplinkStateCRC() {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&uplinkState), offsetof(UplinkState, crc));
+}
+
+static uint32_t weightStateCRC() {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&weightState), offsetof(WeightState, crc));
 }
 
 void Beelance::BeelanceClass::_initWebsite() {
@@ -90,7 +144,8 @@ void Beelance::BeelanceClass::sleep(uint32_t seconds) {
   digitalWrite(temperatureSensor.getPin(), LOW);
   temperatureSensor.end();
 
-  digitalWrite(hx711.getDataPin(), LOW);
+  for (size_t i = 0; i < hx711.getChannelCount(); i++)
+    digitalWrite(hx711.getDataPin(i), LOW);
   digitalWrite(hx711.getClockPin(), LOW);
   hx711.end();
 
@@ -103,74 +158,237 @@ void Beelance::BeelanceClass::sleep(uint32_t seconds) {
   Mycila::System::deepSleep(seconds * static_cast<uint64_t>(1000000));
 }
 
-bool Beelance::BeelanceClass::sendMeasurements() {
-  if (!Mycila::Modem.isReady()) {
-    logger.error(TAG, "Unable to send measurements: modem not ready");
-    return false;
+bool Beelance::BeelanceClass::sendMeasurements(bool connected) {
+  // the weight of this cycle: in eco mode, the load cells are then powered down until the deep sleep
+  if (hx711.isEnabled() && !hx711.isValid()) {
+    hx711.requestAcquisition();
+    const uint32_t start = millis();
+    while (!hx711.isValid() && millis() - start < BEELANCE_WEIGHT_TIMEOUT)
+      delay(10);
+    if (!hx711.isValid())
+      logger.warn(TAG, "Weight not acquired after %u ms", BEELANCE_WEIGHT_TIMEOUT);
   }
 
+  JsonDocument doc;
+  toJson(doc.to<JsonObject>());
+
+  _recordMeasurement(doc["ts"].as<time_t>(), doc["temp"].as<float>(), doc["wt"].as<int32_t>());
+  if (hx711.isValid())
+    _checkWeightChange(doc["wt"].as<int32_t>());
+
+  // routine uplinks only carry the measurements and the device key
+  const uint32_t metadataHash = _metadataHash(doc.as<JsonObjectConst>());
+  const bool metadata = _mustSendMetadata(metadataHash, doc["ts"].as<uint32_t>());
+  if (!metadata)
+    for (const char* key : METADATA_KEYS)
+      doc.remove(key);
+
   if (config.isEmpty(KEY_SEND_URL)) {
     logger.error(TAG, "Unable to send measurements: no URL defined");
     return false;
   }
 
-  JsonDocument doc;
+  if (!connected || !Mycila::Modem.isReady()) {
+    logger.error(TAG, "Unable to send measurements: %s", connected ? "modem not ready" : "no data connection");
+    if (!_uploadQueue.push(doc))
+      logger.error(TAG, "Unable to queue measurements");
+    logger.warn(TAG, "%u measurements waiting to be sent", _uploadQueue.getCount());
+    return false;
+  }
+
+  // nothing waiting: send the measurements alone
+  if (!_uploadQueue.getCount()) {
+    if (_post(doc) == ESP_OK) {
+      if (metadata)
+        _metadataSent(metadataHash, doc["ts"].as<uint32_t>());
+      return true;
+    }
+    if (!_uploadQueue.push(doc))
+      logger.error(TAG, "Unable to queue measurements");
+    return false;
+  }
+
+  // send after the previous ones
+  if (!_uploadQueue.push(doc))
+    logger.error(TAG, "Unable to queue measurements");
+  if (!_sendQueue())
+    return false;
+  if (metadata)
+    _metadataSent(metadataHash, doc["ts"].as<uint32_t>());
+  return true;
+}
+
+uint32_t Beelance::BeelanceClass::getDeviceKey() const {
+  const std::string id = Mycila::System::getChipIDStr();
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(id.c_str()), id.length());
+}
+
+uint32_t Beelance::BeelanceClass::_metadataHash(const JsonObjectConst& root) {
+  uint32_t hash = 0;
+  for (const char* key : METADATA_KEYS) {
+    // GPS noise: the altitude is ignored, and only a move of about 100m is a change
+    if (strcmp(key, "alt") == 0 || strcmp(key, "fix_age") == 0 || strcmp(key, "fix_acc") == 0)
+      continue;
+    std::string value;
+    if (strcmp(key, "lat") == 0 || strcmp(key, "long") == 0)
+      value = std::to_string(lround(root[key].as<double>() * 1000));
+    else
+      serializeJson(root[key], value);
+    hash = esp_rom_crc32_le(hash, reinterpret_cast<const uint8_t*>(value.c_str()), value.length() + 1);
+  }
+  return hash;
+}
+
+bool Beelance::BeelanceClass::_mustSendMetadata(uint32_t hash, uint32_t now) const {
+  if (uplinkState.magic != BEELANCE_UPLINK_MAGIC || uplinkState.crc != uplinkStateCRC()) {
+    logger.debug(TAG, "Sending metadata: first send");
+    return true;
+  }
+  if (uplinkState.hash != hash) {
+    logger.debug(TAG, "Sending metadata: changed");
+    return true;
+  }
+  const uint32_t interval = config.getLong(KEY_SEND_METADATA_INTERVAL);
+  if (!interval || !now || now < uplinkState.sentAt || now - uplinkState.sentAt >= interval) {
+    logger.debug(TAG, "Sending metadata: heartbeat");
+    return true;
+  }
+  return false;
+}
+
+void Beelance::BeelanceClass::_metadataSent(uint32_t hash, uint32_t now) {
+  uplinkState.magic = BEELANCE_UPLINK_MAGIC;
+  uplinkState.hash = hash;
+  uplinkState.sentAt = now;
+  uplinkState.crc = uplinkStateCRC();
+}
+
+void Beelance::BeelanceClass::_checkWeightChange(int32_t weight) {
+  const int32_t threshold = config.getLong(KEY_MODEM_GPS_WEIGHT_DELTA);
+  if (threshold > 0 && weightState.magic == BEELANCE_WEIGHT_MAGIC && weightState.crc == weightStateCRC() && abs(weight - weightState.weight) >= threshold) {
+    logger.warn(TAG, "Weight changed by %" PRId32 " g: new GPS fix requested", weight - weightState.weight);
+    Mycila::Modem.requestGPSFix();
+  }
+  weightState.magic = BEELANCE_WEIGHT_MAGIC;
+  weightState.weight = weight;
+  weightState.crc = weightStateCRC();
+}
+
+bool Beelance::BeelanceClass::_sendQueue() {
+  size_t batch = std::max(1L, static_cast<long>(config.getLong(KEY_SEND_BATCH_SIZE)));
+
+  while (_uploadQueue.getCount()) {
+    JsonDocument payload;
+    const size_t count = _uploadQueue.peek(batch, payload.to<JsonArray>());
+    if (!count) {
+      logger.error(TAG, "Unable to read queued measurements");
+      return false;
+    }
+    logger.info(TAG, "Sending %u queued measurements...", count);
+    const int result = _post(payload);
+    // udp:// and coap:// are limited to a datagram: smaller batches until a single measurement
+    if (result == ESP_ERR_INVALID_SIZE && count > 1) {
+      batch = count / 2;
+      logger.warn(TAG, "Retrying with batches of %u measurements", batch);
+      continue;
+    }
+    if (result != ESP_OK) {
+      logger.warn(TAG, "%u measurements waiting to be sent", _uploadQueue.getCount());
+      return false;
+    }
+    if (!_uploadQueue.pop(count)) {
+      logger.error(TAG, "Unable to remove sent measurements from queue");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int Beelance::BeelanceClass::_post(JsonVariantConst measurements) {
+  const PayloadCodec codec = toPayloadCodec(config.getString(KEY_SEND_CODEC));
   std::string payload;
   payload.reserve(512);
-  toJson(doc.to<JsonObject>());
-  serializeJson(doc, payload);
+  if (!encodePayload(codec, measurements, payload)) {
+    logger.error(TAG, "Unable to encode measurements");
+    return ESP_FAIL;
+  }
 
-  _recordMeasurement(doc["ts"].as<time_t>(), doc["temp"].as<float>(), doc["wt"].as<int32_t>());
-  _saveHistory();
-
-  if (!config.isEmpty(KEY_SEND_URL)) {
-    std::string url = config.getString(KEY_SEND_URL);
-    logger.info(TAG, "Sending measurements to %s...", url.c_str());
-    switch (Mycila::Modem.httpPOST(url, payload)) {
-      case ESP_OK:
-        logger.info(TAG, "Measurements sent successfully");
-        return true;
-      case ESP_ERR_INVALID_ARG:
-        logger.error(TAG, "Unable to send measurements: invalid URL %s", url.c_str());
-        return false;
-      case ESP_ERR_TIMEOUT:
-        logger.error(TAG, "Unable to send measurements: timeout connecting to %s", url.c_str());
-        return false;
-      case ESP_ERR_INVALID_STATE:
-        logger.error(TAG, "Unable to send measurements: unable to connect");
-        return false;
-      case ESP_ERR_INVALID_RESPONSE:
-        logger.error(TAG, "Unable to send measurements: invalid response from server");
-        return false;
-      default:
-        logger.error(TAG, "Unable to send measurements: unknown error");
-        return false;
+  std::string url = config.getString(KEY_SEND_URL);
+  logger.info(TAG, "Sending measurements to %s (%s, %u bytes)...", url.c_str(), toContentType(codec), payload.length());
+  // coap:// and coaps:// are sent over UDP, mqtt:// and mqtts:// published to a broker,
+  // tcp:// and udp:// sent in frames to a connector, the other URLs over HTTP
+  int result;
+  if (Mycila::string::startsWith(url, "coap://") || Mycila::string::startsWith(url, "coaps://")) {
+    result = Mycila::Modem.coapPOST(url, payload, toContentType(codec));
+  } else if (Mycila::string::startsWith(url, "mqtt://") || Mycila::string::startsWith(url, "mqtts://")) {
+    Mycila::MQTT::URL mqttURL;
+    const std::string downlinkTopic = Mycila::MQTT::parseURL(url, mqttURL) ? mqttURL.topic + BEELANCE_MQTT_DOWNLINK_SUFFIX : "";
+    result = Mycila::Modem.mqttPublish(url, payload, downlinkTopic);
+  } else if (Mycila::string::startsWith(url, "tcp://") || Mycila::string::startsWith(url, "udp://")) {
+    result = Mycila::Modem.sendFrame(url, payload);
+  } else {
+    result = Mycila::Modem.httpPOST(url, payload, toContentType(codec));
+  }
+
+  switch (result) {
+    case ESP_OK:
+      logger.info(TAG, "Measurements sent successfully");
+      break;
+    case ESP_ERR_INVALID_ARG:
+      logger.error(TAG, "Unable to send measurements: invalid URL %s", url.c_str());
+      break;
+    case ESP_ERR_TIMEOUT:
+      logger.error(TAG, "Unable to send measurements: timeout connecting to %s", url.c_str());
+      break;
+    case ESP_ERR_INVALID_STATE:
+      logger.error(TAG, "Unable to send measurements: unable to connect");
+      break;
+    case ESP_ERR_INVALID_RESPONSE:
+      logger.error(TAG, "Unable to send measurements: invalid response from server");
+      break;
+    case ESP_ERR_INVALID_SIZE:
+      logger.error(TAG, "Unable to send measurements: payload too big for a datagram (%u bytes)", payload.length());
+      break;
+    case ESP_ERR_NOT_SUPPORTED:
+      logger.error(TAG, "Unable to send measurements: %s not supported by this modem", url.c_str());
+      break;
+    default:
+      logger.error(TAG, "Unable to send measurements: unknown error");
+      break;
+  }
+  return result;
+}
+
+void Beelance::BeelanceClass::_applyRemoteConfig(const std::string& payload) {
+  JsonDocument doc;
+  if (deserializeJson(doc, payload) || !doc.is<JsonObject>()) {
+    logger.error(TAG, "Invalid remote configuration: %s", payload.c_str());
+    return;
+  }
+
+  std::map<const char*, std::string> settings;
+  for (JsonPairConst kv : doc.as<JsonObjectConst>()) {
+    const char* keyRef = config.keyRef(kv.key().c_str());
+    if (!keyRef) {
+      logger.warn(TAG, "Unknown remote configuration key: %s", kv.key().c_str());
+      continue;
     }
+    if (std::none_of(std::begin(REMOTE_CONFIG_KEYS), std::end(REMOTE_CONFIG_KEYS), [keyRef](const char* key) { return strcmp(key, keyRef) == 0; })) {
+      logger.warn(TAG, "Remote configuration not allowed: %s", keyRef);
+      continue;
+    }
+    std::string value;
+    if (kv.value().is<const char*>())
+      value = kv.value().as<const char*>();
+    else
+      serializeJson(kv.value(), value);
+    logger.info(TAG, "Remote configuration: %s", keyRef);
+    settings[keyRef] = std::move(value);
   }
 
-  // if (Mycila::Modem.getAPN() == "onomondo") {
-  //   logger.info(TAG, "Sending measurements using Onomondo Connector...");
-  //   switch (Mycila::Modem.sendTCP("1.2.3.4", 1234, payload)) {
-  //     case ESP_OK:
-  //       logger.info(TAG, "Measurements sent successfully using Onomondo Connector");
-  //       return true;
-  //     case ESP_ERR_TIMEOUT:
-  //       logger.error(TAG, "Unable to send measurements: timeout connecting to Onomondo Platform");
-  //       return false;
-  //     case ESP_ERR_INVALID_STATE:
-  //       logger.error(TAG, "Unable to send measurements: unable to connect");
-  //       return false;
-  //     case ESP_ERR_INVALID_RESPONSE:
-  //       logger.error(TAG, "Unable to send measurements: invalid response from server");
-  //       return false;
-  //     default:
-  //       logger.error(TAG, "Unable to send measurements: unknown error");
-  //       return false;
-  //   }
-  // }
-
-  assert(false); // Should never happen
-  return false;
+  if (!settings.empty())
+    config.set(settings);
 }
 
 void Beelance::BeelanceClass::toJson(const JsonObject& root) const {
@@ -185,11 +403,21 @@ void Beelance::BeelanceClass::toJson(const JsonObject& root) const {
   root["lat"] = Mycila::Modem.getGPSData().latitude;
   root["long"] = Mycila::Modem.getGPSData().longitude;
   root["alt"] = _round2(Mycila::Modem.getGPSData().altitude);
+  // seconds since the fix: the position can be a cached one
+  if (Mycila::Modem.getGPSFixAge() >= 0)
+    root["fix_age"] = static_cast<uint32_t>(Mycila::Modem.getGPSFixAge());
+  // GPS fix or coarse position from the cells
+  if (Mycila::Modem.hasGPSPosition()) {
+    root["fix_src"] = Mycila::Modem.getGPSData().source == Mycila::ModemLocationSource::MODEM_LOCATION_LBS ? "lbs" : "gps";
+    if (Mycila::Modem.getGPSData().uncertainty > 0)
+      root["fix_acc"] = static_cast<uint32_t>(lroundf(Mycila::Modem.getGPSData().uncertainty));
+  }
   // sim
   root["sim"] = Mycila::Modem.getICCID();
   root["op"] = Mycila::Modem.getOperator();
   // device
   root["dev"] = Mycila::System::getChipIDStr();
+  root["k"] = getDeviceKey();
   root["boot"] = Mycila::System::getBootCount();
   root["ver"] = Mycila::AppInfo.version;
   root["up"] = Mycila::System::getUptime();
@@ -200,39 +428,26 @@ void Beelance::BeelanceClass::toJson(const JsonObject& root) const {
   root["eco"] = !config.getBool(KEY_PREVENT_SLEEP_ENABLE);
 }
 
-void Beelance::BeelanceClass::historyToJson(const JsonObject& root) const {
-  // latest
-  JsonArray latest = root["latest"].to<JsonArray>();
-  for (const auto& entry : latestHistory) {
-    JsonObject o = latest.add<JsonObject>();
-    o["time"] = entry.time;
-    o["temp"] = entry.temperature;
-    o["wt"] = entry.weight;
-  }
-  // hourly
-  JsonArray hourly = root["hourly"].to<JsonArray>();
-  for (const auto& entry : hourlyHistory) {
-    JsonObject o = hourly.add<JsonObject>();
-    o["time"] = entry.time;
-    o["temp"] = entry.temperature;
-    o["wt"] = entry.weight;
-  }
-  // daily
-  JsonArray daily = root["daily"].to<JsonArray>();
-  for (const auto& entry : dailyHistory) {
-    JsonObject o = daily.add<JsonObject>();
-    o["time"] = entry.time;
-    o["temp"] = entry.temperature;
-    o["wt"] = entry.weight;
-  }
+std::vector<Beelance::HistoryBucket> Beelance::BeelanceClass::getHistory(HistoryResolution resolution, size_t maxBuckets) {
+  loadHistory();
+  std::lock_guard<std::mutex> lck(_mutex);
+  const HistorySeries& series = resolution == HistoryResolution::MINUTE ? latestHistory : (resolution == HistoryResolution::HOUR ? hourlyHistory : dailyHistory);
+  std::vector<HistoryBucket> buckets;
+  buckets.reserve(std::min(series.size(), maxBuckets));
+  for (size_t n = series.size(), i = n > maxBuckets ? n - maxBuckets : 0; i < n; i++)
+    buckets.push_back(series[i]);
+  return buckets;
 }
 
 void Beelance::BeelanceClass::clearHistory() {
-  latestHistory.clear();
-  hourlyHistory.clear();
-  dailyHistory.clear();
-  if (LittleFS.exists(FILE_HISTORY))
-    LittleFS.remove(FILE_HISTORY);
+  {
+    std::lock_guard<std::mutex> lck(_mutex);
+    latestHistory.clear();
+    hourlyHistory.clear();
+    dailyHistory.clear();
+  }
+  if (!_historyStore.clear())
+    logger.error(TAG, "Unable to clear file: " FILE_HISTORY);
   Beelance::Website.requestChartUpdate();
 }
 
@@ -244,124 +459,99 @@ bool Beelance::BeelanceClass::mustSleep() const {
 void Beelance::BeelanceClass::_recordMeasurement(const time_t timestamp, const float temperature, const int32_t weight) {
   logger.info(TAG, "Record measurement: temperature = %.2f C, weight = %d g", temperature, weight);
 
-  const std::string dt = Mycila::Time::toLocalStr(timestamp); // 2024-04-12 15:02:17
-  const std::string hhmm = dt.substr(11, 16);              // 15:02
-  const std::string hour = dt.substr(11, 13) + ":00";      // 15:00
-  const std::string day = dt.substr(5, 10);                // 2024-04-12
-
-  bool found = false;
-  for (auto& entry : latestHistory) {
-    if (entry.time == hhmm) {
-      found = true;
-      if (temperature > entry.temperature)
-        entry.temperature = temperature;
-      if (weight > entry.weight)
-        entry.weight = weight;
-      break;
-    }
-  }
-  if (!found) {
-    while (latestHistory.size() >= BEELANCE_MAX_HISTORY_SIZE)
-      latestHistory.erase(latestHistory.begin());
-    latestHistory.push_back({hhmm, temperature, weight});
-  }
-
-  found = false;
-  for (auto& entry : hourlyHistory) {
-    if (entry.time == hour) {
-      found = true;
-      if (temperature > entry.temperature)
-        entry.temperature = temperature;
-      if (weight > entry.weight)
-        entry.weight = weight;
-      break;
-    }
-  }
-  if (!found) {
-    while (hourlyHistory.size() >= BEELANCE_MAX_HISTORY_SIZE)
-      hourlyHistory.erase(hourlyHistory.begin());
-    hourlyHistory.push_back({hour, temperature, weight});
+  // otherwise, the measurement will be aggregated with the others when the history is loaded
+  if (_historyLoaded) {
+    std::lock_guard<std::mutex> lck(_mutex);
+    _aggregateMeasurement(timestamp, temperature, weight);
   }
 
-  found = false;
-  for (auto& entry : dailyHistory) {
-    if (entry.time == day) {
-      found = true;
-      if (temperature > entry.temperature)
-        entry.temperature = temperature;
-      if (weight > entry.weight)
-        entry.weight = weight;
-      break;
-    }
-  }
-  if (!found) {
-    while (dailyHistory.size() >= BEELANCE_MAX_HISTORY_SIZE)
-      dailyHistory.erase(dailyHistory.begin());
-    dailyHistory.push_back({day, temperature, weight});
-  }
+  const HistoryRecord record = {static_cast<uint32_t>(timestamp), static_cast<int16_t>(lroundf(temperature * 100.0f)), weight};
+  if (!_historyStore.append(record))
+    logger.error(TAG, "Unable to save measurement to: " FILE_HISTORY);
+  // staging only saves flash writes across deep sleeps
+  else if (!mustSleep() && !_historyStore.flush())
+    logger.error(TAG, "Unable to save measurement to: " FILE_HISTORY);
+  else if (_historyStore.getStagedCount())
+    logger.debug(TAG, "Measurement staged in RTC memory: %" PRIu32 " staged", _historyStore.getStagedCount());
 
   Beelance::Website.requestChartUpdate();
 }
 
-void Beelance::BeelanceClass::_loadHistory() {
-  std::lock_guard<std::mutex> lck(_mutex);
+void Beelance::BeelanceClass::_aggregateMeasurement(const time_t timestamp, const float temperature, const int32_t weight) {
+  latestHistory.add(toBucketStart(HistoryResolution::MINUTE, timestamp), temperature, weight);
+  hourlyHistory.add(toBucketStart(HistoryResolution::HOUR, timestamp), temperature, weight);
+  dailyHistory.add(toBucketStart(HistoryResolution::DAY, timestamp), temperature, weight);
+}
 
-  logger.info(TAG, "Load history...");
+void Beelance::BeelanceClass::_allocateHistory() {
+  size_t latest = std::clamp(static_cast<long>(config.getLong(KEY_HISTORY_LATEST_SIZE)), 1L, static_cast<long>(BEELANCE_HISTORY_MAX_SIZE));
+  size_t hourly = std::clamp(static_cast<long>(config.getLong(KEY_HISTORY_HOURLY_SIZE)), 1L, static_cast<long>(BEELANCE_HISTORY_MAX_SIZE));
+  size_t daily = std::clamp(static_cast<long>(config.getLong(KEY_HISTORY_DAILY_SIZE)), 1L, static_cast<long>(BEELANCE_HISTORY_MAX_SIZE));
+
+  // memory budget: the internal RAM is kept for the TLS and web stacks
+  const size_t required = (latest + hourly + daily) * sizeof(HistoryBucket);
+  const bool psram = psramFound();
+  const size_t budget = psram ? heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM) / 2 : std::min(static_cast<size_t>(BEELANCE_HISTORY_DRAM_BUDGET), heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT) / 4);
+
+  if (required > budget) {
+    const float ratio = static_cast<float>(budget) / required;
+    latest = std::max(static_cast<size_t>(latest * ratio), static_cast<size_t>(1));
+    hourly = std::max(static_cast<size_t>(hourly * ratio), static_cast<size_t>(1));
+    daily = std::max(static_cast<size_t>(daily * ratio), static_cast<size_t>(1));
+    logger.warn(TAG, "History needs %u bytes but only %u bytes are available in %s: reduced to %u latest, %u hourly, %u daily buckets", required, budget, psram ? "PSRAM" : "DRAM", latest, hourly, daily);
+  }
 
-  JsonDocument doc;
+  if (!latestHistory.begin(latest) || !hourlyHistory.begin(hourly) || !dailyHistory.begin(daily))
+    logger.error(TAG, "Unable to allocate history buckets");
 
-  if (LittleFS.exists(FILE_HISTORY)) {
-    File file = LittleFS.open(FILE_HISTORY, "r");
-
-    if (file) {
-      deserializeJson(doc, file);
-      file.close();
-      JsonObject root = doc.as<JsonObject>();
-
-      // latestHistory
-      latestHistory.clear();
-      JsonArray latest = root["latest"].as<JsonArray>();
-      for (int len = latest.size(), i = std::max(0, len - BEELANCE_MAX_HISTORY_SIZE); i < len; i++)
-        latestHistory.push_back({latest[i]["time"].as<std::string>(), latest[i]["temp"].as<float>(), latest[i]["wt"].as<int32_t>()});
-
-      // hourlyHistory
-      hourlyHistory.clear();
-      JsonArray hourly = root["hourly"].as<JsonArray>();
-      for (int len = hourly.size(), i = std::max(0, len - BEELANCE_MAX_HISTORY_SIZE); i < len; i++)
-        hourlyHistory.push_back({hourly[i]["time"].as<std::string>(), hourly[i]["temp"].as<float>(), hourly[i]["wt"].as<int32_t>()});
-
-      // dailyHistory
-      dailyHistory.clear();
-      JsonArray daily = root["daily"].as<JsonArray>();
-      for (int len = daily.size(), i = std::max(0, len - BEELANCE_MAX_HISTORY_SIZE); i < len; i++)
-        dailyHistory.push_back({daily[i]["time"].as<std::string>(), daily[i]["temp"].as<float>(), daily[i]["wt"].as<int32_t>()});
-
-    } else {
-      logger.error(TAG, "Unable to open file: " FILE_HISTORY);
-    }
+  logger.info(TAG, "History: %u latest, %u hourly, %u daily buckets in %s", latestHistory.capacity(), hourlyHistory.capacity(), dailyHistory.capacity(), dailyHistory.isPSRAM() ? "PSRAM" : "DRAM");
+}
 
-  } else {
-    logger.warn(TAG, "File not found: " FILE_HISTORY);
+void Beelance::BeelanceClass::_initHistory() {
+  // devices updated over the air keep the partition table they were flashed with, and its smaller fs partition.
+  // Read from the partition table: LittleFS.totalBytes() would scan the filesystem
+  const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, nullptr);
+  const uint32_t fsSize = partition ? partition->size : 0;
+  if (fsSize < BEELANCE_FS_RESERVED_SIZE + BEELANCE_ARCHIVE_MAX_SIZE) {
+    const uint32_t archiveSize = fsSize > BEELANCE_FS_RESERVED_SIZE + BEELANCE_ARCHIVE_SEGMENT_SIZE ? fsSize - BEELANCE_FS_RESERVED_SIZE : BEELANCE_ARCHIVE_SEGMENT_SIZE;
+    logger.warn(TAG, "History archive reduced to %" PRIu32 " bytes: the fs partition only has %" PRIu32 " bytes", archiveSize, fsSize);
+    _historyArchive.setMaxSize(archiveSize);
   }
 
-  Beelance::Website.requestChartUpdate();
+  // no filesystem access here: measurements are staged in RTC memory across deep sleeps
+  _historyStore.begin(LittleFS, BEELANCE_HISTORY_CAPACITY, BEELANCE_HISTORY_JOURNAL_SIZE, &historyStaging, config.getLong(KEY_HISTORY_FLUSH_CYCLES), &_historyArchive);
+  logger.info(TAG, "History: %" PRIu32 " measurements staged in RTC memory", _historyStore.getStagedCount());
 }
 
-void Beelance::BeelanceClass::_saveHistory() {
-  std::lock_guard<std::mutex> lck(_mutex);
+void Beelance::BeelanceClass::_initQueue() {
+  // no filesystem access here: the queue is only read when there is something to send
+  _uploadQueue.begin(LittleFS);
+}
 
-  logger.info(TAG, "Save history...");
+void Beelance::BeelanceClass::_loadHistory() {
+  logger.info(TAG, "Load history...");
 
-  JsonDocument doc;
-  historyToJson(doc.to<JsonObject>());
+  if (LittleFS.exists(FILE_HISTORY_LEGACY)) {
+    // chart buckets labelled without a date: they cannot be imported as measurements
+    logger.warn(TAG, "Removing legacy file: " FILE_HISTORY_LEGACY);
+    LittleFS.remove(FILE_HISTORY_LEGACY);
+  }
 
-  File file = LittleFS.open(FILE_HISTORY, "w");
-  if (file) {
-    serializeJson(doc.as<JsonObject>(), file);
-    file.close();
-  } else {
-    logger.error(TAG, "Unable to save file: " FILE_HISTORY);
+  {
+    std::lock_guard<std::mutex> lck(_mutex);
+    _allocateHistory();
+    _historyStore.forEach([this](const HistoryRecord& record) {
+      _aggregateMeasurement(record.timestamp, record.temperature / 100.0f, record.weight);
+    });
+    _historyLoaded = true;
   }
+
+  if (!_historyStore.isLoaded())
+    logger.error(TAG, "Unable to open file: " FILE_HISTORY);
+
+  logger.info(TAG, "Loaded %" PRIu32 " measurements (%" PRIu32 " archived in %" PRIu32 " bytes, %" PRIu32 " in journal, %" PRIu32 " staged)", _historyStore.getCount(), _historyArchive.getCount(), _historyArchive.getSize(), _historyStore.getJournalCount(), _historyStore.getStagedCount());
+
+  Beelance::Website.requestChartUpdate();
 }
 
 float Beelance::BeelanceClass::_round2(float value) {
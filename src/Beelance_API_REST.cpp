@@ -5,11 +5,13 @@
 #include <Beelance.h>
 
 #include <AsyncJson.h>
-#include <LittleFS.h>
 #include <StreamString.h>
 
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #define TAG "BEELANCE"
 
@@ -96,6 +98,24 @@ void Beelance::BeelanceClass::_initREST() {
       request->send(response);
     });
 
+  // hx711
+
+  webServer
+    .on("/api/hx711/calibration/point", HTTP_POST, [](AsyncWebServerRequest* request) {
+      if (!request->hasParam("weight", true)) {
+        return request->send(400, "text/plain", "Missing weight");
+      }
+      compensationWeight = request->getParam("weight", true)->value().toFloat();
+      hx711CompensationTask.resume();
+      request->send(200);
+    });
+
+  webServer
+    .on("/api/hx711/calibration/reset", HTTP_GET | HTTP_POST, [](AsyncWebServerRequest* request) {
+      config.setString(KEY_HX711_CALIBRATION_PTS, "");
+      request->send(200);
+    });
+
   // system
 
   webServer
@@ -126,14 +146,26 @@ void Beelance::BeelanceClass::_initREST() {
 
   // beelance
 
+  webServer
+    .on("/api/beelance/history.bin", HTTP_GET, [this](AsyncWebServerRequest* request) {
+      // all the records (archive included), read by chunks under the history lock
+      std::shared_ptr<uint32_t> position = std::make_shared<uint32_t>(0);
+      request->send(request->beginChunkedResponse("application/octet-stream", [position](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+        if (maxLen < sizeof(Beelance::HistoryRecord))
+          return RESPONSE_TRY_AGAIN;
+        const size_t n = Beelance::Beelance.readHistory(*position, reinterpret_cast<Beelance::HistoryRecord*>(buffer), maxLen / sizeof(Beelance::HistoryRecord));
+        *position += n;
+        return n * sizeof(Beelance::HistoryRecord);
+      }));
+    });
+
+  // the history used to be a JSON file served at this path: kept for the existing clients, same content as /api/beelance/history
   webServer
     .on("/api/beelance/history.json", HTTP_GET, [this](AsyncWebServerRequest* request) {
-      if (LittleFS.exists(FILE_HISTORY)) {
-        AsyncWebServerResponse* response = request->beginResponse(LittleFS, FILE_HISTORY, "application/json");
-        request->send(response);
-      } else {
-        request->send(404);
-      }
+      std::shared_ptr<Beelance::HistoryJsonStream> stream = Beelance::Beelance.historyJsonStream();
+      request->send(request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) {
+        return stream->read(buffer, maxLen);
+      }));
     });
 
   webServer
@@ -143,34 +175,82 @@ void Beelance::BeelanceClass::_initREST() {
     });
 
   webServer
-    .on("/api/beelance/history", HTTP_GET, [this](AsyncWebServerRequest* request) {
-      AsyncJsonResponse* response = new AsyncJsonResponse();
-      Beelance::Beelance.historyToJson(response->getRoot());
-      response->setLength();
+    .on("/api/beelance/history/query", HTTP_GET, [this](AsyncWebServerRequest* request) {
+      const uint32_t from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), nullptr, 10) : 0;
+      const uint32_t to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), nullptr, 10) : UINT32_MAX;
+      const size_t maxPoints = std::min(request->hasParam("points") ? strtoul(request->getParam("points")->value().c_str(), nullptr, 10) : BEELANCE_HISTORY_QUERY_POINTS, static_cast<unsigned long>(BEELANCE_HISTORY_QUERY_MAX_POINTS));
+      const std::string agg = request->hasParam("agg") ? request->getParam("agg")->value().c_str() : "lttb";
+
+      Beelance::HistoryAggregation aggregation;
+      if (agg == "lttb") {
+        aggregation = Beelance::HistoryAggregation::LTTB;
+      } else if (agg == "bucket") {
+        aggregation = Beelance::HistoryAggregation::BUCKET;
+      } else {
+        request->send(400, "text/plain", "Invalid agg: lttb or bucket");
+        return;
+      }
+
+      size_t selected;
+      const std::vector<Beelance::HistoryPoint> points = Beelance::Beelance.queryHistory(from, to, maxPoints, aggregation, selected);
+
+      // columnar: one array per field
+      AsyncResponseStream* response = request->beginResponseStream("application/json");
+      response->printf("{\"agg\":\"%s\",\"selected\":%u,\"points\":%u", agg.c_str(), selected, points.size());
+      const auto column = [&](const char* name, std::function<void(const Beelance::HistoryPoint&)> value) {
+        response->printf(",\"%s\":[", name);
+        for (size_t i = 0; i < points.size(); i++) {
+          if (i)
+            response->print(',');
+          value(points[i]);
+        }
+        response->print(']');
+      };
+      column("ts", [&](const Beelance::HistoryPoint& p) { response->printf("%" PRIu32, p.timestamp); });
+      column("temp", [&](const Beelance::HistoryPoint& p) { response->printf("%.2f", p.temperature); });
+      column("wt", [&](const Beelance::HistoryPoint& p) { response->printf("%" PRId32, p.weight); });
+      if (aggregation == Beelance::HistoryAggregation::BUCKET) {
+        column("temp_min", [&](const Beelance::HistoryPoint& p) { response->printf("%.2f", p.temperatureMin); });
+        column("temp_max", [&](const Beelance::HistoryPoint& p) { response->printf("%.2f", p.temperatureMax); });
+        column("wt_min", [&](const Beelance::HistoryPoint& p) { response->printf("%" PRId32, p.weightMin); });
+        column("wt_max", [&](const Beelance::HistoryPoint& p) { response->printf("%" PRId32, p.weightMax); });
+      }
+      response->print('}');
       request->send(response);
     });
 
+  webServer
+    .on("/api/beelance/history", HTTP_GET, [this](AsyncWebServerRequest* request) {
+      std::shared_ptr<Beelance::HistoryJsonStream> stream = Beelance::Beelance.historyJsonStream();
+      request->send(request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) {
+        return stream->read(buffer, maxLen);
+      }));
+    });
+
   webServer
     .on("/api/beelance", HTTP_GET, [this](AsyncWebServerRequest* request) {
-      AsyncJsonResponse* response = new AsyncJsonResponse();
-      JsonObject root = response->getRoot();
-      Beelance::Beelance.toJson(root);
-      Beelance::Beelance.historyToJson(root["history"].to<JsonObject>());
-      response->setLength();
-      request->send(response);
+      // measurements are small: serialized upfront, then the history is streamed after them
+      JsonDocument doc;
+      Beelance::Beelance.toJson(doc.to<JsonObject>());
+      std::string prefix;
+      serializeJson(doc, prefix);
+      prefix.pop_back(); // }
+      prefix += ",\"history\":";
+      std::shared_ptr<Beelance::HistoryJsonStream> stream = Beelance::Beelance.historyJsonStream(std::move(prefix), "}");
+      request->send(request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) {
+        return stream->read(buffer, maxLen);
+      }));
     });
 
   // root
 
   webServer
     .on("/api/", HTTP_GET, [this](AsyncWebServerRequest* request) {
-      AsyncJsonResponse* response = new AsyncJsonResponse();
-      JsonObject root = response->getRoot();
+      // everything but the history is serialized upfront, then the history is streamed at the end of the beelance object
+      JsonDocument doc;
+      JsonObject root = doc.to<JsonObject>();
       // app
       Mycila::AppInfo.toJson(root["app"].to<JsonObject>());
-      // beelance
-      Beelance::Beelance.toJson(root["beelance"].to<JsonObject>());
-      Beelance::Beelance.historyToJson(root["beelance"]["history"].to<JsonObject>());
       // config
       config.toJson(root["config"].to<JsonObject>());
       // network
@@ -182,7 +262,19 @@ void Beelance::BeelanceClass::_initREST() {
       Mycila::TaskMonitor.toJson(root["system"]["stack"].to<JsonObject>());
       loopTaskManager.toJson(root["system"]["task_managers"][0].to<JsonObject>());
       temperatureSensor.toJson(root["system"]["temp_sensor"].to<JsonObject>());
-      response->setLength();
-      request->send(response);
+      std::string prefix;
+      serializeJson(doc, prefix);
+      prefix.pop_back(); // }
+      // beelance
+      doc.clear();
+      Beelance::Beelance.toJson(doc.to<JsonObject>());
+      prefix += ",\"beelance\":";
+      serializeJson(doc, prefix);
+      prefix.pop_back(); // }
+      prefix += ",\"history\":";
+      std::shared_ptr<Beelance::HistoryJsonStream> stream = Beelance::Beelance.historyJsonStream(std::move(prefix), "}}");
+      request->send(request->beginChunkedResponse("application/json", [stream](uint8_t* buffer, size_t maxLen, size_t index) {
+        return stream->read(buffer, maxLen);
+      }));
     });
 }
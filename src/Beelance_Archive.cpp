@@ -0,0 +1,506 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <BeelanceArchive.h>
+
+#include <esp_rom_crc.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+// blocks of an older format are dropped by the scan
+#define BEELANCE_ARCHIVE_MAGIC 0x4242 // BB
+
+// upper bound of an encoded block: 36 bits per timestamp and per temperature, 5 bytes per weight
+#define BEELANCE_ARCHIVE_MAX_PAYLOAD (4 + BEELANCE_ARCHIVE_BLOCK_SIZE * 16)
+
+namespace {
+  // bits are written MSB first
+  class BitWriter {
+    public:
+      explicit BitWriter(std::vector<uint8_t>& out) : _out(out) {}
+
+      void write(uint32_t value, uint8_t bits) {
+        while (bits) {
+          if (!_free) {
+            _out.push_back(0);
+            _free = 8;
+          }
+          const uint8_t n = std::min(bits, _free);
+          const uint8_t chunk = (value >> (bits - n)) & ((1u << n) - 1);
+          _out.back() |= chunk << (_free - n);
+          _free -= n;
+          bits -= n;
+        }
+      }
+
+    private:
+      std::vector<uint8_t>& _out;
+      uint8_t _free = 0;
+  };
+
+  class BitReader {
+    public:
+      BitReader(const uint8_t* data, size_t length) : _data(data), _length(length) {}
+
+      bool read(uint8_t bits, uint32_t& value) {
+        if (_position + bits > _length * 8)
+          return false;
+        value = 0;
+        while (bits) {
+          const uint8_t available = 8 - _position % 8;
+          const uint8_t n = std::min(bits, available);
+          const uint8_t chunk = (_data[_position / 8] >> (available - n)) & ((1u << n) - 1);
+          value = (value << n) | chunk;
+          _position += n;
+          bits -= n;
+        }
+        return true;
+      }
+
+    private:
+      const uint8_t* _data;
+      size_t _length;
+      size_t _position = 0;
+  };
+
+  uint32_t zigzag(int32_t v) { return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31); }
+  int32_t unzigzag(uint32_t v) { return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1); }
+
+  void writeVarint(std::vector<uint8_t>& out, uint32_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<uint8_t>(v) | 0x80);
+      v >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(v));
+  }
+
+  bool readVarint(const uint8_t*& data, const uint8_t* end, uint32_t& v) {
+    v = 0;
+    for (uint8_t shift = 0; shift < 35 && data < end; shift += 7) {
+      const uint8_t b = *data++;
+      v |= static_cast<uint32_t>(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  // sizes of the buckets 10, 110 and 1110 of a zig-zag value, 0 being encoded as 0 and larger values as 1111 + 32 bits
+  constexpr uint8_t TIMESTAMP_BUCKETS[3] = {3, 6, 12};
+  constexpr uint8_t TEMPERATURE_BUCKETS[3] = {6, 7, 11};
+
+  // the prefix gives the bucket, followed by the offset of the value in its bucket
+  void writeBuckets(BitWriter& writer, uint32_t value, const uint8_t (&buckets)[3]) {
+    if (!value) {
+      writer.write(0b0, 1);
+      return;
+    }
+    uint32_t start = 1;
+    for (uint8_t i = 0; i < 3; i++) {
+      if (value - start < (1u << buckets[i])) {
+        writer.write(((1u << (i + 1)) - 1) << 1, i + 2);
+        writer.write(value - start, buckets[i]);
+        return;
+      }
+      start += 1u << buckets[i];
+    }
+    writer.write(0b1111, 4);
+    writer.write(value, 32);
+  }
+
+  bool readBuckets(BitReader& reader, const uint8_t (&buckets)[3], uint32_t& value) {
+    uint8_t prefix = 0;
+    while (prefix < 4) {
+      if (!reader.read(1, value))
+        return false;
+      if (!value)
+        break;
+      prefix++;
+    }
+    if (!prefix)
+      return true;
+    if (prefix == 4)
+      return reader.read(32, value);
+    uint32_t start = 1;
+    for (uint8_t i = 0; i < prefix - 1; i++)
+      start += 1u << buckets[i];
+    if (!reader.read(buckets[prefix - 1], value))
+      return false;
+    value += start;
+    return true;
+  }
+} // namespace
+
+void Beelance::HistoryBlockCodec::encode(const HistoryRecord* records, size_t count, std::vector<uint8_t>& payload) {
+  std::vector<uint8_t> timestamps;
+  std::vector<uint8_t> weights;
+  std::vector<uint8_t> temperatures;
+  BitWriter timestampBits(timestamps);
+  BitWriter temperatureBits(temperatures);
+
+  uint32_t delta = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const HistoryRecord& record = records[i];
+
+    if (!i) {
+      timestampBits.write(record.timestamp, 32);
+      writeVarint(weights, zigzag(record.weight));
+      temperatureBits.write(static_cast<uint16_t>(record.temperature), 16);
+      continue;
+    }
+
+    const HistoryRecord& previous = records[i - 1];
+
+    // timestamps: delta-of-delta (modulo 2^32 so that clock jumps are still encoded)
+    const uint32_t d = record.timestamp - previous.timestamp;
+    writeBuckets(timestampBits, zigzag(static_cast<int32_t>(d - delta)), TIMESTAMP_BUCKETS);
+    delta = d;
+
+    // weights: zig-zag varint delta
+    writeVarint(weights, zigzag(static_cast<int32_t>(static_cast<uint32_t>(record.weight) - static_cast<uint32_t>(previous.weight))));
+
+    // temperatures: zig-zag delta of the centi-degrees
+    writeBuckets(temperatureBits, zigzag(record.temperature - previous.temperature), TEMPERATURE_BUCKETS);
+  }
+
+  payload.clear();
+  payload.reserve(4 + timestamps.size() + weights.size() + temperatures.size());
+  payload.push_back(timestamps.size() & 0xff);
+  payload.push_back(timestamps.size() >> 8);
+  payload.push_back(weights.size() & 0xff);
+  payload.push_back(weights.size() >> 8);
+  payload.insert(payload.end(), timestamps.begin(), timestamps.end());
+  payload.insert(payload.end(), weights.begin(), weights.end());
+  payload.insert(payload.end(), temperatures.begin(), temperatures.end());
+}
+
+bool Beelance::HistoryBlockCodec::decode(const uint8_t* payload, size_t length, size_t count, HistoryRecord* records) {
+  if (length < 4)
+    return false;
+
+  const size_t timestampsLength = payload[0] | (payload[1] << 8);
+  const size_t weightsLength = payload[2] | (payload[3] << 8);
+  if (4 + timestampsLength + weightsLength > length)
+    return false;
+
+  BitReader timestampBits(payload + 4, timestampsLength);
+  const uint8_t* weights = payload + 4 + timestampsLength;
+  const uint8_t* weightsEnd = weights + weightsLength;
+  BitReader temperatureBits(weightsEnd, length - 4 - timestampsLength - weightsLength);
+
+  uint32_t delta = 0;
+  uint32_t v;
+
+  for (size_t i = 0; i < count; i++) {
+    HistoryRecord& record = records[i];
+
+    if (!i) {
+      if (!timestampBits.read(32, v))
+        return false;
+      record.timestamp = v;
+      if (!readVarint(weights, weightsEnd, v))
+        return false;
+      record.weight = unzigzag(v);
+      if (!temperatureBits.read(16, v))
+        return false;
+      record.temperature = static_cast<int16_t>(v);
+      continue;
+    }
+
+    const HistoryRecord& previous = records[i - 1];
+
+    // timestamps
+    if (!readBuckets(timestampBits, TIMESTAMP_BUCKETS, v))
+      return false;
+    delta += static_cast<uint32_t>(unzigzag(v));
+    record.timestamp = previous.timestamp + delta;
+
+    // weights
+    if (!readVarint(weights, weightsEnd, v))
+      return false;
+    record.weight = static_cast<int32_t>(static_cast<uint32_t>(previous.weight) + static_cast<uint32_t>(unzigzag(v)));
+
+    // temperatures
+    if (!readBuckets(temperatureBits, TEMPERATURE_BUCKETS, v))
+      return false;
+    record.temperature = static_cast<int16_t>(previous.temperature + unzigzag(v));
+  }
+
+  return true;
+}
+
+bool Beelance::HistoryArchive::begin(fs::FS& fs) {
+  _fs = &fs;
+  _segments.clear();
+  _count = 0;
+
+  if (!_fs->exists(_directory) && !_fs->mkdir(_directory))
+    return false;
+
+  File dir = _fs->open(_directory, "r");
+  if (!dir || !dir.isDirectory())
+    return false;
+
+  // segment files are named after the sequence number of their first record
+  for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+    const char* name = strrchr(file.name(), '/');
+    name = name ? name + 1 : file.name();
+    char* end = nullptr;
+    const uint32_t sequence = strtoul(name, &end, 16);
+    if (!file.isDirectory() && strlen(name) == 8 && end && !*end)
+      _segments.push_back({sequence, 0, 0, false, {}});
+    file.close();
+  }
+  dir.close();
+
+  std::sort(_segments.begin(), _segments.end(), [](const Segment& a, const Segment& b) { return a.sequence < b.sequence; });
+
+  for (auto it = _segments.begin(); it != _segments.end();) {
+    _scan(*it);
+    if (it->count) {
+      _count += it->count;
+      ++it;
+    } else {
+      // created but nothing valid written in it
+      _fs->remove(_path(it->sequence).c_str());
+      it = _segments.erase(it);
+    }
+  }
+
+  return true;
+}
+
+bool Beelance::HistoryArchive::append(const HistoryRecord* records, size_t count, uint32_t sequence) {
+  if (!_fs)
+    return false;
+
+  // interrupted compaction: these records were archived before the history file was replaced
+  if (!_segments.empty() && sequence < _nextSequence) {
+    const uint32_t archived = std::min(static_cast<uint32_t>(count), _nextSequence - sequence);
+    records += archived;
+    count -= archived;
+    sequence += archived;
+  }
+
+  while (count) {
+    const size_t n = std::min(count, static_cast<size_t>(BEELANCE_ARCHIVE_BLOCK_SIZE));
+    if (!_appendBlock(records, n, sequence))
+      return false;
+    records += n;
+    count -= n;
+    sequence += n;
+  }
+
+  // drop the oldest segments, keeping at least the one being written
+  while (_segments.size() > 1 && getSize() > _maxSize) {
+    _fs->remove(_path(_segments.front().sequence).c_str());
+    _count -= _segments.front().count;
+    _segments.erase(_segments.begin());
+  }
+
+  return true;
+}
+
+void Beelance::HistoryArchive::forEach(HistoryRecordCallback callback, uint32_t from, uint32_t to) {
+  if (!_fs)
+    return;
+
+  std::vector<uint8_t> payload;
+  std::vector<HistoryRecord> records(BEELANCE_ARCHIVE_BLOCK_SIZE);
+
+  for (const Segment& segment : _segments) {
+    if (std::none_of(segment.ranges.begin(), segment.ranges.end(), [from, to](const BlockRange& range) { return range.to >= from && range.from <= to; }))
+      continue;
+
+    File file = _fs->open(_path(segment.sequence).c_str(), "r");
+    if (!file)
+      continue;
+
+    BlockHeader header;
+    uint32_t position = 0;
+    for (const BlockRange& range : segment.ranges) {
+      if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(BlockHeader)) != sizeof(BlockHeader))
+        break;
+      position += sizeof(BlockHeader) + header.length;
+      if (range.to < from || range.from > to) {
+        if (!file.seek(position))
+          break;
+        continue;
+      }
+      payload.resize(header.length);
+      if (file.read(payload.data(), header.length) != header.length)
+        break;
+      // blocks were validated by the scan
+      if (!HistoryBlockCodec::decode(payload.data(), header.length, header.count, records.data()))
+        break;
+      for (uint16_t i = 0; i < header.count; i++)
+        callback(records[i]);
+    }
+
+    file.close();
+  }
+}
+
+size_t Beelance::HistoryArchive::read(uint32_t position, HistoryRecord* records, size_t count) {
+  if (!_fs)
+    return 0;
+
+  std::vector<uint8_t> payload;
+  std::vector<HistoryRecord> block(BEELANCE_ARCHIVE_BLOCK_SIZE);
+  size_t n = 0;
+
+  for (const Segment& segment : _segments) {
+    if (n == count)
+      break;
+    if (position >= segment.count) {
+      position -= segment.count;
+      continue;
+    }
+
+    File file = _fs->open(_path(segment.sequence).c_str(), "r");
+    if (!file)
+      break;
+
+    BlockHeader header;
+    for (uint32_t offset = 0; offset < segment.size && n < count; offset += sizeof(BlockHeader) + header.length) {
+      if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(BlockHeader)) != sizeof(BlockHeader))
+        break;
+      if (position >= header.count) {
+        position -= header.count;
+        if (!file.seek(offset + sizeof(BlockHeader) + header.length))
+          break;
+        continue;
+      }
+      payload.resize(header.length);
+      if (file.read(payload.data(), header.length) != header.length)
+        break;
+      if (!HistoryBlockCodec::decode(payload.data(), header.length, header.count, block.data()))
+        break;
+      for (uint16_t i = position; i < header.count && n < count; i++)
+        records[n++] = block[i];
+      position = 0;
+    }
+
+    file.close();
+  }
+
+  return n;
+}
+
+bool Beelance::HistoryArchive::clear() {
+  if (!_fs)
+    return false;
+
+  bool success = true;
+  for (const Segment& segment : _segments)
+    success &= _fs->remove(_path(segment.sequence).c_str());
+
+  // the next sequence is kept: records are never archived twice
+  _segments.clear();
+  _count = 0;
+  return success;
+}
+
+uint32_t Beelance::HistoryArchive::getSize() const {
+  uint32_t size = 0;
+  for (const Segment& segment : _segments)
+    size += segment.size;
+  return size;
+}
+
+std::string Beelance::HistoryArchive::_path(uint32_t sequence) const {
+  char name[10];
+  snprintf(name, sizeof(name), "/%08" PRIx32, sequence);
+  return std::string(_directory) + name;
+}
+
+void Beelance::HistoryArchive::_scan(Segment& segment) {
+  File file = _fs->open(_path(segment.sequence).c_str(), "r");
+  if (!file)
+    return;
+
+  const uint32_t size = file.size();
+  std::vector<uint8_t> payload;
+  std::vector<HistoryRecord> records(BEELANCE_ARCHIVE_BLOCK_SIZE);
+  BlockHeader header;
+
+  while (segment.size + sizeof(BlockHeader) <= size) {
+    if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(BlockHeader)) != sizeof(BlockHeader) ||
+        header.magic != BEELANCE_ARCHIVE_MAGIC ||
+        !header.count || header.count > BEELANCE_ARCHIVE_BLOCK_SIZE ||
+        header.length > BEELANCE_ARCHIVE_MAX_PAYLOAD ||
+        segment.size + sizeof(BlockHeader) + header.length > size)
+      break;
+    payload.resize(header.length);
+    if (file.read(payload.data(), header.length) != header.length || esp_rom_crc16_le(0, payload.data(), header.length) != header.crc)
+      break;
+    // the time range of the block is kept so that queries can skip it
+    if (!HistoryBlockCodec::decode(payload.data(), header.length, header.count, records.data()))
+      break;
+    segment.ranges.push_back(_range(records.data(), header.count));
+    segment.size += sizeof(BlockHeader) + header.length;
+    segment.count += header.count;
+    _nextSequence = header.sequence + header.count;
+  }
+
+  // torn block at the end: no more blocks can be appended after it
+  segment.torn = segment.size != size;
+  file.close();
+}
+
+bool Beelance::HistoryArchive::_appendBlock(const HistoryRecord* records, size_t count, uint32_t sequence) {
+  std::vector<uint8_t> payload;
+  HistoryBlockCodec::encode(records, count, payload);
+
+  BlockHeader header;
+  header.magic = BEELANCE_ARCHIVE_MAGIC;
+  header.count = count;
+  header.length = payload.size();
+  header.crc = esp_rom_crc16_le(0, payload.data(), payload.size());
+  header.sequence = sequence;
+
+  const uint32_t length = sizeof(BlockHeader) + payload.size();
+  if (_segments.empty() || _segments.back().torn || _segments.back().size + length > BEELANCE_ARCHIVE_SEGMENT_SIZE)
+    _segments.push_back({sequence, 0, 0, false, {}});
+
+  Segment& segment = _segments.back();
+  File file = _fs->open(_path(segment.sequence).c_str(), "a");
+  const bool success = file &&
+                       file.write(reinterpret_cast<const uint8_t*>(&header), sizeof(BlockHeader)) == sizeof(BlockHeader) &&
+                       file.write(payload.data(), payload.size()) == payload.size();
+  if (file)
+    file.close();
+
+  if (!success) {
+    if (segment.size) {
+      segment.torn = true;
+    } else {
+      _fs->remove(_path(segment.sequence).c_str());
+      _segments.pop_back();
+    }
+    return false;
+  }
+
+  segment.size += length;
+  segment.count += count;
+  segment.ranges.push_back(_range(records, count));
+  _count += count;
+  _nextSequence = sequence + count;
+  return true;
+}
+
+Beelance::HistoryArchive::BlockRange Beelance::HistoryArchive::_range(const HistoryRecord* records, size_t count) {
+  // timestamps are not always increasing (clock set after a reset)
+  BlockRange range = {UINT32_MAX, 0};
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t timestamp = records[i].timestamp;
+    range.from = std::min(range.from, timestamp);
+    range.to = std::max(range.to, timestamp);
+  }
+  return range;
+}
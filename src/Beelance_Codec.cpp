@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <BeelanceCodec.h>
+
+#include <cmath>
+#include <cstring>
+
+namespace {
+  void cborHead(std::string& out, uint8_t major, uint64_t value) {
+    major <<= 5;
+    if (value < 24) {
+      out += static_cast<char>(major | value);
+    } else if (value <= UINT8_MAX) {
+      out += static_cast<char>(major | 24);
+      out += static_cast<char>(value);
+    } else if (value <= UINT16_MAX) {
+      out += static_cast<char>(major | 25);
+      for (int shift = 8; shift >= 0; shift -= 8)
+        out += static_cast<char>(value >> shift);
+    } else if (value <= UINT32_MAX) {
+      out += static_cast<char>(major | 26);
+      for (int shift = 24; shift >= 0; shift -= 8)
+        out += static_cast<char>(value >> shift);
+    } else {
+      out += static_cast<char>(major | 27);
+      for (int shift = 56; shift >= 0; shift -= 8)
+        out += static_cast<char>(value >> shift);
+    }
+  }
+
+  void cborEncode(std::string& out, JsonVariantConst v) {
+    if (v.is<JsonObjectConst>()) {
+      JsonObjectConst object = v.as<JsonObjectConst>();
+      cborHead(out, 5, object.size());
+      for (JsonPairConst pair : object) {
+        const char* key = pair.key().c_str();
+        cborHead(out, 3, strlen(key));
+        out += key;
+        cborEncode(out, pair.value());
+      }
+    } else if (v.is<JsonArrayConst>()) {
+      JsonArrayConst array = v.as<JsonArrayConst>();
+      cborHead(out, 4, array.size());
+      for (JsonVariantConst item : array)
+        cborEncode(out, item);
+    } else if (v.is<bool>()) {
+      out += static_cast<char>(v.as<bool>() ? 0xf5 : 0xf4);
+    } else if (v.is<uint32_t>()) {
+      cborHead(out, 0, v.as<uint32_t>());
+    } else if (v.is<int32_t>()) {
+      // negative integer: -1 - n
+      cborHead(out, 1, static_cast<uint64_t>(-1 - static_cast<int64_t>(v.as<int32_t>())));
+    } else if (v.is<double>()) {
+      const double d = v.as<double>();
+      const float f = static_cast<float>(d);
+      if (static_cast<double>(f) == d || d != d) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        out += static_cast<char>(0xfa);
+        for (int shift = 24; shift >= 0; shift -= 8)
+          out += static_cast<char>(bits >> shift);
+      } else {
+        // float32 would truncate it (GPS coordinates): float64
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        out += static_cast<char>(0xfb);
+        for (int shift = 56; shift >= 0; shift -= 8)
+          out += static_cast<char>(bits >> shift);
+      }
+    } else if (v.is<const char*>()) {
+      const char* s = v.as<const char*>();
+      cborHead(out, 3, strlen(s));
+      out += s;
+    } else {
+      out += static_cast<char>(0xf6); // null
+    }
+  }
+
+  template <typename T>
+  void frameWrite(std::string& out, T value) {
+    for (size_t i = 0; i < sizeof(T); i++)
+      out += static_cast<char>(static_cast<uint64_t>(value) >> (8 * i));
+  }
+
+  void frameEncode(std::string& out, JsonObjectConst o) {
+    uint8_t flags = 0;
+    if (strcmp(o["pow"] | "", "ext") == 0)
+      flags |= 0x01;
+    if (o["eco"].as<bool>())
+      flags |= 0x02;
+    // lat, long and alt are always there (0 without a fix): only a fix gives a source
+    if (o["fix_src"].is<const char*>())
+      flags |= 0x04;
+    if (strcmp(o["fix_src"] | "", "lbs") == 0)
+      flags |= 0x08;
+
+    out += static_cast<char>(BEELANCE_FRAME_VERSION);
+    out += static_cast<char>(flags);
+    frameWrite<uint32_t>(out, o["ts"].as<uint32_t>());
+    frameWrite<int16_t>(out, static_cast<int16_t>(lroundf(o["temp"].as<float>() * 100)));
+    frameWrite<int32_t>(out, o["wt"].as<int32_t>());
+    frameWrite<int32_t>(out, static_cast<int32_t>(lround(o["lat"].as<double>() * 1e6)));
+    frameWrite<int32_t>(out, static_cast<int32_t>(lround(o["long"].as<double>() * 1e6)));
+    frameWrite<int16_t>(out, static_cast<int16_t>(lroundf(o["alt"].as<float>())));
+    frameWrite<uint32_t>(out, o["boot"].as<uint32_t>());
+    frameWrite<uint32_t>(out, o["up"].as<uint32_t>());
+    frameWrite<uint8_t>(out, static_cast<uint8_t>(lroundf(o["bat"].as<float>())));
+    frameWrite<uint16_t>(out, static_cast<uint16_t>(lroundf(o["volt"].as<float>() * 1000)));
+    frameWrite<uint32_t>(out, o["k"].as<uint32_t>());
+    frameWrite<uint32_t>(out, o["fix_age"].is<uint32_t>() ? o["fix_age"].as<uint32_t>() : UINT32_MAX);
+  }
+} // namespace
+
+Beelance::PayloadCodec Beelance::toPayloadCodec(const std::string& name) {
+  if (name == "cbor")
+    return PayloadCodec::CBOR;
+  if (name == "msgpack")
+    return PayloadCodec::MSGPACK;
+  if (name == "binary")
+    return PayloadCodec::BINARY;
+  return PayloadCodec::JSON;
+}
+
+const char* Beelance::toContentType(PayloadCodec codec) {
+  switch (codec) {
+    case PayloadCodec::CBOR:
+      return "application/cbor";
+    case PayloadCodec::MSGPACK:
+      return "application/msgpack";
+    case PayloadCodec::BINARY:
+      return "application/octet-stream";
+    default:
+      return "application/json";
+  }
+}
+
+bool Beelance::encodePayload(PayloadCodec codec, JsonVariantConst payload, std::string& out) {
+  out.clear();
+
+  switch (codec) {
+    case PayloadCodec::CBOR:
+      cborEncode(out, payload);
+      break;
+
+    case PayloadCodec::MSGPACK:
+      serializeMsgPack(payload, out);
+      break;
+
+    case PayloadCodec::BINARY:
+      if (payload.is<JsonArrayConst>()) {
+        out.reserve(payload.size() * BEELANCE_FRAME_SIZE);
+        for (JsonVariantConst item : payload.as<JsonArrayConst>())
+          if (item.is<JsonObjectConst>())
+            frameEncode(out, item.as<JsonObjectConst>());
+      } else if (payload.is<JsonObjectConst>()) {
+        frameEncode(out, payload.as<JsonObjectConst>());
+      }
+      break;
+
+    default:
+      serializeJson(payload, out);
+      break;
+  }
+
+  return !out.empty();
+}
@@ -17,21 +17,36 @@ void Beelance::BeelanceClass::_initConfig() {
   config.configure(KEY_AP_MODE_ENABLE, "true");
   config.configure(KEY_BEEHIVE_NAME, Mycila::AppInfo.defaultHostname);
   config.configure(KEY_DEBUG_ENABLE, "false");
+  config.configure(KEY_HISTORY_DAILY_SIZE, std::to_string(BEELANCE_HISTORY_DAILY_SIZE));
+  config.configure(KEY_HISTORY_FLUSH_CYCLES, std::to_string(BEELANCE_HISTORY_FLUSH_CYCLES));
+  config.configure(KEY_HISTORY_HOURLY_SIZE, std::to_string(BEELANCE_HISTORY_HOURLY_SIZE));
+  config.configure(KEY_HISTORY_LATEST_SIZE, std::to_string(BEELANCE_HISTORY_LATEST_SIZE));
+  config.configure(KEY_HX711_CALIBRATION_PTS);
   config.configure(KEY_HX711_CLOCK_PIN, std::to_string(BEELANCE_HX711_CLOCK_PIN));
   config.configure(KEY_HX711_DATA_PIN, std::to_string(BEELANCE_HX711_DATA_PIN));
+  config.configure(KEY_HX711_DATA_PINS_EXTRA);
+  config.configure(KEY_HX711_FILTER, "median");
   config.configure(KEY_HX711_OFFSET, "0");
+  config.configure(KEY_HX711_SAMPLES, std::to_string(MYCILA_HX711_SAMPLES));
   config.configure(KEY_HX711_SCALE, "1");
+  config.configure(KEY_HX711_SETTLE_THRESHOLD, "20");
   config.configure(KEY_MODEM_APN);
   config.configure(KEY_MODEM_BANDS_LTE_M, "1,3,8,20,28");
   config.configure(KEY_MODEM_BANDS_NB_IOT, "3,8,20");
+  config.configure(KEY_MODEM_GPS_LBS, "fallback");
+  config.configure(KEY_MODEM_GPS_REFRESH, std::to_string(MYCILA_MODEM_GPS_REFRESH_INTERVAL / 86400));
   config.configure(KEY_MODEM_GPS_SYNC_TIMEOUT, std::to_string(MYCILA_MODEM_GPS_SYNC_TIMEOUT));
+  config.configure(KEY_MODEM_GPS_WEIGHT_DELTA, "10000");
   config.configure(KEY_MODEM_MODE, "AUTO");
   config.configure(KEY_MODEM_PIN);
   config.configure(KEY_NIGHT_START_TIME, "23:00");
   config.configure(KEY_NIGHT_STOP_TIME, "05:00");
   config.configure(KEY_PREVENT_SLEEP_ENABLE, "true");
   config.configure(KEY_PMU_CHARGING_CURRENT, "500");
+  config.configure(KEY_SEND_BATCH_SIZE, std::to_string(BEELANCE_SEND_BATCH_SIZE));
+  config.configure(KEY_SEND_CODEC, "json");
   config.configure(KEY_SEND_INTERVAL, "3600");
+  config.configure(KEY_SEND_METADATA_INTERVAL, "86400");
   config.configure(KEY_SEND_URL);
   config.configure(KEY_TEMPERATURE_PIN, std::to_string(BEELANCE_TEMPERATURE_PIN));
   config.configure(KEY_TIMEZONE_INFO, "CET-1CEST,M3.5.0,M10.5.0/3");
@@ -40,6 +55,10 @@ void Beelance::BeelanceClass::_initConfig() {
 
   config.begin("BEELANCE", true);
 
+  // local time is needed before the modem syncs the clock to rebuild the history labels at boot
+  setenv("TZ", config.getString(KEY_TIMEZONE_INFO), 1);
+  tzset();
+
   // init logging
   configureDebugTask.forceRun();
 }
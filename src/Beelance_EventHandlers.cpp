@@ -109,19 +109,60 @@ void Beelance::BeelanceClass::_initEventHandlers() {
     } else if (key == KEY_MODEM_GPS_SYNC_TIMEOUT) {
       Mycila::Modem.setGpsSyncTimeout(config.getLong(KEY_MODEM_GPS_SYNC_TIMEOUT));
 
+    } else if (key == KEY_MODEM_GPS_REFRESH) {
+      Mycila::Modem.setGpsRefreshInterval(config.getLong(KEY_MODEM_GPS_REFRESH) * 86400);
+
+    } else if (key == KEY_MODEM_GPS_LBS) {
+      std::string lbs = config.getString(KEY_MODEM_GPS_LBS);
+      if (lbs == "first") {
+        Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_FIRST);
+      } else if (lbs == "off") {
+        Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_OFF);
+      } else {
+        Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_FALLBACK);
+      }
+
     } else if (key == KEY_TIMEZONE_INFO) {
       logger.info(TAG, "Setting timezone to %s", config.getString(KEY_TIMEZONE_INFO));
       Mycila::Modem.setTimeZoneInfo(config.getString(KEY_TIMEZONE_INFO));
       setenv("TZ", config.getString(KEY_TIMEZONE_INFO), 1);
       tzset();
 
+    } else if (key == KEY_HISTORY_LATEST_SIZE || key == KEY_HISTORY_HOURLY_SIZE || key == KEY_HISTORY_DAILY_SIZE) {
+      // buckets are reallocated and rebuilt from the history file
+      if (_historyLoaded)
+        _loadHistory();
+
+    } else if (key == KEY_HISTORY_FLUSH_CYCLES) {
+      _historyStore.setFlushCycles(config.getLong(KEY_HISTORY_FLUSH_CYCLES));
+
     } else if (key == KEY_HX711_OFFSET) {
-      logger.info(TAG, "Setting HX711 offset to %d", config.getLong(KEY_HX711_OFFSET));
-      hx711.setOffset(config.getLong(KEY_HX711_OFFSET));
+      logger.info(TAG, "Setting HX711 offset to %s", config.getString(KEY_HX711_OFFSET));
+      hx711ConfigTask.resume();
 
     } else if (key == KEY_HX711_SCALE) {
-      logger.info(TAG, "Setting HX711 scale to %f", config.getFloat(KEY_HX711_SCALE));
-      hx711.setScale(config.getFloat(KEY_HX711_SCALE));
+      logger.info(TAG, "Setting HX711 scale to %s", config.getString(KEY_HX711_SCALE));
+      hx711ConfigTask.resume();
+
+    } else if (key == KEY_HX711_CALIBRATION_PTS) {
+      logger.info(TAG, "Setting HX711 calibration points to %s", config.getString(KEY_HX711_CALIBRATION_PTS));
+      hx711ConfigTask.resume();
+
+    } else if (key == KEY_HX711_FILTER) {
+      logger.info(TAG, "Setting HX711 filter to %s", config.getString(KEY_HX711_FILTER));
+      hx711ConfigTask.resume();
+
+    } else if (key == KEY_HX711_SAMPLES) {
+      logger.info(TAG, "Setting HX711 max samples to %d", config.getLong(KEY_HX711_SAMPLES));
+      hx711ConfigTask.resume();
+
+    } else if (key == KEY_HX711_SETTLE_THRESHOLD) {
+      logger.info(TAG, "Setting HX711 settle threshold to %f g", config.getFloat(KEY_HX711_SETTLE_THRESHOLD));
+      hx711ConfigTask.resume();
+
+    } else if (key == KEY_PREVENT_SLEEP_ENABLE) {
+      // in eco mode, the load cells are powered down between readings
+      hx711ConfigTask.resume();
 
     } else if (key == KEY_PMU_CHARGING_CURRENT) {
       logger.info(TAG, "Setting charging current to %d mA", config.getLong(KEY_PMU_CHARGING_CURRENT));
@@ -134,6 +175,9 @@ void Beelance::BeelanceClass::_initEventHandlers() {
     restartTask.resume();
   });
 
+  Mycila::Modem.setMQTTClientId(Mycila::AppInfo.defaultHostname);
+  Mycila::Modem.setMQTTCallback([this](const std::string& topic, const std::string& payload) { _applyRemoteConfig(payload); });
+
   Mycila::Modem.setCallback([this](Mycila::ModemState state) {
     switch (state) {
       case Mycila::ModemState::MODEM_ERROR: {
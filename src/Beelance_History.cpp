@@ -0,0 +1,770 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <BeelanceArchive.h>
+#include <BeelanceHistory.h>
+
+#include <esp32-hal-psram.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+
+#define BEELANCE_HISTORY_MAGIC   0x42484953 // BHIS
+#define BEELANCE_HISTORY_VERSION 2
+
+// records read at once when iterating
+#define BEELANCE_HISTORY_READ_CHUNK 32
+
+void Beelance::HistoryStore::begin(fs::FS& fs, uint32_t capacity, uint32_t journalCapacity, HistoryStaging* staging, uint32_t flushCycles, HistoryArchive* archive) {
+  std::lock_guard<std::mutex> lck(_mutex);
+
+  _fs = &fs;
+  _capacity = capacity;
+  _journalCapacity = journalCapacity;
+  _staging = staging;
+  _flushCycles = flushCycles;
+  _archive = archive;
+  _loaded = false;
+
+  if (_staging) {
+    if (_staging->magic != BEELANCE_HISTORY_MAGIC || _staging->count > BEELANCE_HISTORY_STAGING_SIZE || _staging->crc != _crc(*_staging))
+      _resetStaging(); // power on
+    _staging->cycles++;
+    _staging->crc = _crc(*_staging);
+  }
+}
+
+bool Beelance::HistoryStore::append(const HistoryRecord& record) {
+  std::lock_guard<std::mutex> lck(_mutex);
+
+  if (!_fs || !_capacity)
+    return false;
+
+  if (!_staging)
+    return _load() && _appendJournal(&record, 1) == 1;
+
+  // previous flush failed
+  if (_staging->count == BEELANCE_HISTORY_STAGING_SIZE && !_flushStaging())
+    return false;
+
+  _staging->records[_staging->count++] = record;
+  _staging->crc = _crc(*_staging);
+
+  // on failure, records stay staged and the flush is retried on next append
+  if (_staging->count == BEELANCE_HISTORY_STAGING_SIZE || _staging->cycles >= _flushCycles)
+    _flushStaging();
+
+  return true;
+}
+
+bool Beelance::HistoryStore::flush() {
+  std::lock_guard<std::mutex> lck(_mutex);
+  return !_staging || !_staging->count || _flushStaging();
+}
+
+void Beelance::HistoryStore::forEach(HistoryRecordCallback callback, uint32_t from, uint32_t to) {
+  std::lock_guard<std::mutex> lck(_mutex);
+
+  if (!_load())
+    return;
+
+  if (_archive)
+    _archive->forEach(callback, from, to);
+  _forEachRecent(callback);
+}
+
+size_t Beelance::HistoryStore::read(uint32_t position, HistoryRecord* records, size_t count) {
+  std::lock_guard<std::mutex> lck(_mutex);
+
+  if (!_load())
+    return 0;
+
+  const uint32_t archived = _archive ? _archive->getCount() : 0;
+  size_t n = 0;
+  if (position < archived) {
+    n = _archive->read(position, records, count);
+    // unreadable archive: the stream ends there
+    if (n < std::min(count, static_cast<size_t>(archived - position)))
+      return n;
+  }
+
+  uint32_t index = archived;
+  _forEachRecent([&](const HistoryRecord& record) {
+    if (index++ >= position && n < count)
+      records[n++] = record;
+  });
+  return n;
+}
+
+bool Beelance::HistoryStore::clear() {
+  std::lock_guard<std::mutex> lck(_mutex);
+
+  if (_staging)
+    _resetStaging();
+
+  if (!_load())
+    return false;
+
+  if (_archive)
+    _archive->clear();
+
+  // the sequence continues so that a journal left behind is not replayed
+  _header.sequence += _journal.size();
+  _header.count = 0;
+  _journal.clear();
+  return _compact();
+}
+
+std::vector<Beelance::HistoryPoint> Beelance::HistoryStore::query(uint32_t from, uint32_t to, size_t maxPoints, HistoryAggregation aggregation, size_t& selected) {
+  std::vector<HistoryPoint> points;
+
+  // records of the time window: the archive blocks outside of it are not even decoded
+  const auto forEachSelected = [&](HistoryRecordCallback callback) {
+    forEach(
+      [&](const HistoryRecord& record) {
+        if (record.timestamp >= from && record.timestamp <= to)
+          callback(record);
+      },
+      from,
+      to);
+  };
+
+  // time window actually covered by the records
+  uint32_t first = UINT32_MAX;
+  uint32_t last = 0;
+  selected = 0;
+  forEachSelected([&](const HistoryRecord& record) {
+    first = std::min(first, record.timestamp);
+    last = std::max(last, record.timestamp);
+    selected++;
+  });
+
+  if (!selected || !maxPoints)
+    return points;
+
+  if (aggregation == HistoryAggregation::BUCKET) {
+    // equal time buckets over the covered window
+    const uint64_t span = static_cast<uint64_t>(last - first) + 1;
+    const size_t count = std::min(maxPoints, selected);
+    std::vector<float> temperatureSums(count, 0);
+    std::vector<int64_t> weightSums(count, 0);
+    std::vector<uint32_t> counts(count, 0);
+    points.resize(count);
+
+    forEachSelected([&](const HistoryRecord& record) {
+      const size_t i = static_cast<uint64_t>(record.timestamp - first) * count / span;
+      const float temperature = record.temperature / 100.0f;
+      HistoryPoint& point = points[i];
+      if (!counts[i]) {
+        point.timestamp = first + i * span / count;
+        point.temperatureMin = point.temperatureMax = temperature;
+        point.weightMin = point.weightMax = record.weight;
+      } else {
+        point.temperatureMin = std::min(point.temperatureMin, temperature);
+        point.temperatureMax = std::max(point.temperatureMax, temperature);
+        point.weightMin = std::min(point.weightMin, record.weight);
+        point.weightMax = std::max(point.weightMax, record.weight);
+      }
+      temperatureSums[i] += temperature;
+      weightSums[i] += record.weight;
+      counts[i]++;
+    });
+
+    // compact: drop the empty buckets
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (counts[i]) {
+        points[n] = points[i];
+        points[n].temperature = temperatureSums[i] / counts[i];
+        points[n].weight = static_cast<int32_t>(weightSums[i] / static_cast<int64_t>(counts[i]));
+        n++;
+      }
+    }
+    points.resize(n);
+    return points;
+  }
+
+  // LTTB, streamed so that the window (archive included) is never loaded in memory:
+  // the first and last records are kept, the others are split in maxPoints - 2 buckets of consecutive records.
+  // Below 3 points, only the first record, or the first and the last ones, are kept
+  const size_t n = selected;
+  if (maxPoints >= n || maxPoints < 3) {
+    size_t i = 0;
+    forEachSelected([&](const HistoryRecord& record) {
+      if (maxPoints >= n || i == 0 || (i == n - 1 && maxPoints == 2)) {
+        const float temperature = record.temperature / 100.0f;
+        points.push_back({record.timestamp, temperature, temperature, temperature, record.weight, record.weight, record.weight});
+      }
+      i++;
+    });
+    return points;
+  }
+
+  const size_t buckets = maxPoints - 2;
+  const auto bucketOf = [&](size_t i) { return static_cast<uint64_t>(i - 1) * buckets / (n - 2); };
+
+  // first pass: average of each bucket, and the last record
+  std::vector<double> avgX(buckets, 0);
+  std::vector<double> avgY(buckets, 0);
+  std::vector<uint32_t> counts(buckets, 0);
+  HistoryRecord firstRecord = {};
+  HistoryRecord lastRecord = {};
+  size_t i = 0;
+  forEachSelected([&](const HistoryRecord& record) {
+    if (i == 0) {
+      firstRecord = record;
+    } else if (i == n - 1) {
+      lastRecord = record;
+    } else if (i < n - 1) {
+      const size_t b = bucketOf(i);
+      avgX[b] += record.timestamp;
+      avgY[b] += record.weight;
+      counts[b]++;
+    }
+    i++;
+  });
+  for (size_t b = 0; b < buckets; b++) {
+    if (counts[b]) {
+      avgX[b] /= counts[b];
+      avgY[b] /= counts[b];
+    }
+  }
+
+  // second pass: in each bucket, the record forming the largest triangle with the previous selected record and the next bucket average
+  std::vector<HistoryRecord> records;
+  records.reserve(maxPoints);
+  records.push_back(firstRecord);
+  HistoryRecord best = {};
+  double maxArea = -1;
+  size_t current = 0;
+  i = 0;
+  forEachSelected([&](const HistoryRecord& record) {
+    if (i > 0 && i < n - 1) {
+      const size_t b = bucketOf(i);
+      if (b != current) {
+        records.push_back(best);
+        maxArea = -1;
+        current = b;
+      }
+      const double ax = records.back().timestamp;
+      const double ay = records.back().weight;
+      const double nx = b + 1 < buckets ? avgX[b + 1] : lastRecord.timestamp;
+      const double ny = b + 1 < buckets ? avgY[b + 1] : lastRecord.weight;
+      const double area = std::fabs((ax - nx) * (record.weight - ay) - (ax - record.timestamp) * (ny - ay));
+      if (area > maxArea) {
+        maxArea = area;
+        best = record;
+      }
+    }
+    i++;
+  });
+  records.push_back(best);
+  records.push_back(lastRecord);
+
+  points.reserve(records.size());
+  for (const HistoryRecord& record : records) {
+    const float temperature = record.temperature / 100.0f;
+    points.push_back({record.timestamp, temperature, temperature, temperature, record.weight, record.weight, record.weight});
+  }
+  return points;
+}
+
+void Beelance::HistoryStore::_forEachRecent(HistoryRecordCallback callback) {
+  const uint32_t staged = getStagedCount();
+  uint32_t skip;
+  if (_archive) {
+    // records over capacity will be archived at next compaction
+    skip = _archivedCount();
+  } else {
+    // oldest records overwritten by the journal and the staged records
+    const uint32_t total = _header.count + _journal.size() + staged;
+    skip = total > _capacity ? total - _capacity : 0;
+  }
+
+  if (skip < _header.count) {
+    File file = _fs->open(_path, "r");
+    if (file) {
+      HistoryRecord records[BEELANCE_HISTORY_READ_CHUNK];
+      uint32_t remaining = _header.count - skip;
+      if (file.seek(sizeof(Header) + skip * sizeof(HistoryRecord))) {
+        while (remaining) {
+          const uint32_t n = std::min(remaining, static_cast<uint32_t>(BEELANCE_HISTORY_READ_CHUNK));
+          if (file.read(reinterpret_cast<uint8_t*>(records), n * sizeof(HistoryRecord)) != n * sizeof(HistoryRecord))
+            break;
+          for (uint32_t i = 0; i < n; i++)
+            callback(records[i]);
+          remaining -= n;
+        }
+      }
+      file.close();
+    }
+    skip = 0;
+  } else {
+    skip -= _header.count;
+  }
+
+  if (skip < _journal.size()) {
+    for (size_t i = skip; i < _journal.size(); i++)
+      callback(_journal[i]);
+    skip = 0;
+  } else {
+    skip -= _journal.size();
+  }
+
+  for (size_t i = skip; i < staged; i++)
+    callback(_staging->records[i]);
+}
+
+bool Beelance::HistoryStore::_load() {
+  if (_loaded)
+    return true;
+
+  if (!_fs || !_capacity)
+    return false;
+
+  _header = {};
+  _journal.clear();
+  _journal.reserve(_journalCapacity);
+
+  // interrupted compaction: the previous snapshot and the journal are still there
+  if (_fs->exists(_tmpPath))
+    _fs->remove(_tmpPath);
+
+  File file = _fs->open(_path, "r");
+  if (file) {
+    Header header;
+    const bool valid = file.read(reinterpret_cast<uint8_t*>(&header), sizeof(Header)) == sizeof(Header) &&
+                       header.magic == BEELANCE_HISTORY_MAGIC &&
+                       header.version == BEELANCE_HISTORY_VERSION &&
+                       header.recordSize == sizeof(HistoryRecord) &&
+                       header.crc == _crc(header) &&
+                       file.size() == sizeof(Header) + header.count * sizeof(HistoryRecord);
+    file.close();
+    if (valid)
+      _header = header;
+  }
+
+  if (_archive)
+    _archive->begin(*_fs);
+
+  const bool formatted = _header.magic != BEELANCE_HISTORY_MAGIC;
+  if (formatted) {
+    _header.magic = BEELANCE_HISTORY_MAGIC;
+    _header.version = BEELANCE_HISTORY_VERSION;
+    _header.recordSize = sizeof(HistoryRecord);
+    // lost history file: new records must not be taken for archived ones
+    if (_archive && _archive->getCount())
+      _header.sequence = _archive->getNextSequence();
+  }
+
+  const bool clean = _replayJournal();
+
+  // new store, corrupted journal (appending after a torn entry would lose the next ones), journal full, or capacity changed: write a snapshot
+  if ((formatted || !clean || _journal.size() >= _journalCapacity || _header.count > _capacity) && !_compact())
+    return false;
+
+  _loaded = true;
+  return true;
+}
+
+size_t Beelance::HistoryStore::_appendJournal(const HistoryRecord* records, size_t count) {
+  File file = _fs->open(_journalPath, "a");
+  if (!file)
+    return 0;
+
+  size_t written = 0;
+  while (written < count) {
+    JournalEntry entry;
+    entry.sequence = _header.sequence + _journal.size();
+    entry.record = records[written];
+    entry.crc = _crc(entry);
+    if (file.write(reinterpret_cast<const uint8_t*>(&entry), sizeof(JournalEntry)) != sizeof(JournalEntry))
+      break;
+    _journal.push_back(records[written]);
+    written++;
+  }
+
+  file.close();
+
+  if (_journal.size() >= _journalCapacity)
+    _compact();
+
+  return written;
+}
+
+bool Beelance::HistoryStore::_flushStaging() {
+  if (!_load())
+    return false;
+
+  const size_t written = _appendJournal(_staging->records, _staging->count);
+
+  // keep the records which were not written
+  _staging->count -= written;
+  memmove(_staging->records, _staging->records + written, _staging->count * sizeof(HistoryRecord));
+  if (!_staging->count)
+    _staging->cycles = 0;
+  _staging->crc = _crc(*_staging);
+
+  return !_staging->count;
+}
+
+bool Beelance::HistoryStore::_replayJournal() {
+  File file = _fs->open(_journalPath, "r");
+  if (!file)
+    return true;
+
+  // a torn write leaves a partial entry at the end
+  bool clean = file.size() % sizeof(JournalEntry) == 0;
+  JournalEntry entry;
+  size_t skipped = 0;
+  while (file.read(reinterpret_cast<uint8_t*>(&entry), sizeof(JournalEntry)) == sizeof(JournalEntry)) {
+    if (entry.crc != _crc(entry)) {
+      clean = false;
+      break;
+    }
+    if (entry.sequence < _header.sequence + _journal.size()) {
+      skipped++; // already in the snapshot
+      continue;
+    }
+    _journal.push_back(entry.record);
+  }
+
+  file.close();
+
+  // the snapshot was written but the journal was not removed: everything is in the snapshot
+  if (clean && skipped && _journal.empty())
+    _fs->remove(_journalPath);
+
+  return clean;
+}
+
+bool Beelance::HistoryStore::_compact() {
+  const uint32_t total = _header.count + _journal.size();
+  uint32_t skip = total > _capacity ? total - _capacity : 0;
+
+  // evicted records are archived by whole blocks: small blocks would not compress well.
+  // The archive is written first: if the compaction is interrupted, the archive skips the records it already has
+  if (_archive && skip) {
+    skip = std::min(total, (skip + BEELANCE_ARCHIVE_BLOCK_SIZE - 1) / BEELANCE_ARCHIVE_BLOCK_SIZE * BEELANCE_ARCHIVE_BLOCK_SIZE);
+    _archiveOldest(skip);
+  }
+
+  Header header = _header;
+  header.count = total - skip;
+  header.sequence = _header.sequence + _journal.size();
+  header.crc = _crc(header);
+
+  File tmp = _fs->open(_tmpPath, "w");
+  if (!tmp)
+    return false;
+
+  bool success = tmp.write(reinterpret_cast<const uint8_t*>(&header), sizeof(Header)) == sizeof(Header);
+
+  // snapshot records still retained
+  if (success && skip < _header.count) {
+    File file = _fs->open(_path, "r");
+    success = file && file.seek(sizeof(Header) + skip * sizeof(HistoryRecord));
+    HistoryRecord records[BEELANCE_HISTORY_READ_CHUNK];
+    for (uint32_t remaining = _header.count - skip; success && remaining;) {
+      const uint32_t n = std::min(remaining, static_cast<uint32_t>(BEELANCE_HISTORY_READ_CHUNK));
+      success = file.read(reinterpret_cast<uint8_t*>(records), n * sizeof(HistoryRecord)) == n * sizeof(HistoryRecord) &&
+                tmp.write(reinterpret_cast<const uint8_t*>(records), n * sizeof(HistoryRecord)) == n * sizeof(HistoryRecord);
+      remaining -= n;
+    }
+    if (file)
+      file.close();
+  }
+
+  // journal records
+  const size_t first = skip > _header.count ? skip - _header.count : 0;
+  if (success && first < _journal.size()) {
+    const size_t n = _journal.size() - first;
+    success = tmp.write(reinterpret_cast<const uint8_t*>(_journal.data() + first), n * sizeof(HistoryRecord)) == n * sizeof(HistoryRecord);
+  }
+
+  tmp.close();
+
+  // atomic switch to the new snapshot: the journal is only removed once the snapshot is in place
+  if (!success || !_fs->rename(_tmpPath, _path)) {
+    _fs->remove(_tmpPath);
+    return false;
+  }
+
+  _fs->remove(_journalPath);
+  _header = header;
+  _journal.clear();
+  return true;
+}
+
+void Beelance::HistoryStore::_archiveOldest(uint32_t count) {
+  const uint32_t first = _header.sequence - _header.count;
+  std::vector<HistoryRecord> records;
+  records.reserve(BEELANCE_ARCHIVE_BLOCK_SIZE);
+
+  // snapshot records
+  const uint32_t fromSnapshot = std::min(count, _header.count);
+  if (fromSnapshot) {
+    File file = _fs->open(_path, "r");
+    if (!file || !file.seek(sizeof(Header))) {
+      if (file)
+        file.close();
+      return;
+    }
+    for (uint32_t offset = 0; offset < fromSnapshot;) {
+      const uint32_t n = std::min(fromSnapshot - offset, static_cast<uint32_t>(BEELANCE_ARCHIVE_BLOCK_SIZE));
+      records.resize(n);
+      if (file.read(reinterpret_cast<uint8_t*>(records.data()), n * sizeof(HistoryRecord)) != n * sizeof(HistoryRecord) ||
+          !_archive->append(records.data(), n, first + offset)) {
+        file.close();
+        return;
+      }
+      offset += n;
+    }
+    file.close();
+  }
+
+  // journal records
+  if (count > fromSnapshot)
+    _archive->append(_journal.data(), std::min(count - fromSnapshot, static_cast<uint32_t>(_journal.size())), _header.sequence);
+}
+
+uint32_t Beelance::HistoryStore::_archivedCount() const {
+  if (!_archive || !_archive->getCount())
+    return 0;
+  const uint32_t first = _header.sequence - _header.count;
+  const uint32_t next = _archive->getNextSequence();
+  return next > first ? std::min(next - first, static_cast<uint32_t>(_header.count + _journal.size())) : 0;
+}
+
+uint32_t Beelance::HistoryStore::getCount() const {
+  const uint32_t count = _header.count + _journal.size() + getStagedCount();
+  if (_archive)
+    return _archive->getCount() + count - _archivedCount();
+  return std::min(_capacity, count);
+}
+
+uint32_t Beelance::HistoryStore::_crc(const Header& header) {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&header), offsetof(Header, crc));
+}
+
+uint16_t Beelance::HistoryStore::_crc(const JournalEntry& entry) {
+  return esp_rom_crc16_le(0, reinterpret_cast<const uint8_t*>(&entry), offsetof(JournalEntry, crc));
+}
+
+uint32_t Beelance::HistoryStore::_crc(const HistoryStaging& staging) {
+  return esp_rom_crc32_le(0, reinterpret_cast<const uint8_t*>(&staging), offsetof(HistoryStaging, crc));
+}
+
+void Beelance::HistoryStore::_resetStaging() {
+  _staging->magic = BEELANCE_HISTORY_MAGIC;
+  _staging->count = 0;
+  _staging->cycles = 0;
+  _staging->crc = _crc(*_staging);
+}
+
+uint32_t Beelance::toBucketStart(HistoryResolution resolution, time_t timestamp) {
+  struct tm timeInfo;
+  localtime_r(&timestamp, &timeInfo);
+  switch (resolution) {
+    case HistoryResolution::MINUTE:
+      return timestamp - timeInfo.tm_sec;
+    case HistoryResolution::HOUR:
+      return timestamp - timeInfo.tm_sec - timeInfo.tm_min * 60;
+    case HistoryResolution::DAY:
+      // mktime handles the DST changes during the day
+      timeInfo.tm_sec = 0;
+      timeInfo.tm_min = 0;
+      timeInfo.tm_hour = 0;
+      timeInfo.tm_isdst = -1;
+      return mktime(&timeInfo);
+    default:
+      return timestamp;
+  }
+}
+
+std::string Beelance::toBucketLabel(HistoryResolution resolution, uint32_t start) {
+  const time_t timestamp = start;
+  struct tm timeInfo;
+  localtime_r(&timestamp, &timeInfo);
+  char buffer[16];
+  switch (resolution) {
+    case HistoryResolution::MINUTE:
+      strftime(buffer, sizeof(buffer), "%H:%M", &timeInfo);
+      break;
+    case HistoryResolution::HOUR:
+      strftime(buffer, sizeof(buffer), "%H:00", &timeInfo);
+      break;
+    default:
+      strftime(buffer, sizeof(buffer), "%Y-%m-%d", &timeInfo);
+      break;
+  }
+  return buffer;
+}
+
+bool Beelance::HistorySeries::begin(size_t capacity) {
+  end();
+
+  if (!capacity)
+    return false;
+
+  if (psramFound()) {
+    _buckets = static_cast<HistoryBucket*>(heap_caps_calloc(capacity, sizeof(HistoryBucket), MALLOC_CAP_SPIRAM));
+    _psram = _buckets != nullptr;
+  }
+  if (!_buckets)
+    _buckets = static_cast<HistoryBucket*>(heap_caps_calloc(capacity, sizeof(HistoryBucket), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT));
+  if (!_buckets)
+    return false;
+
+  _capacity = capacity;
+  return true;
+}
+
+void Beelance::HistorySeries::end() {
+  if (_buckets) {
+    heap_caps_free(_buckets);
+    _buckets = nullptr;
+  }
+  _capacity = 0;
+  _head = 0;
+  _count = 0;
+  _psram = false;
+}
+
+void Beelance::HistorySeries::add(uint32_t start, float temperature, int32_t weight) {
+  if (!_capacity)
+    return;
+
+  if (_count) {
+    HistoryBucket& newest = _at(_count - 1);
+    if (newest.start == start) {
+      _update(newest, temperature, weight);
+      return;
+    }
+    if (newest.start > start) {
+      // late measurement: update its bucket if still retained, otherwise drop it
+      for (size_t i = _count - 1; i > 0; i--) {
+        HistoryBucket& bucket = _at(i - 1);
+        if (bucket.start == start)
+          _update(bucket, temperature, weight);
+        if (bucket.start <= start)
+          break;
+      }
+      return;
+    }
+  }
+
+  _init(_buckets[_head], start, temperature, weight);
+  _head = (_head + 1) % _capacity;
+  if (_count < _capacity)
+    _count++;
+}
+
+void Beelance::HistorySeries::_init(HistoryBucket& bucket, uint32_t start, float temperature, int32_t weight) {
+  bucket.start = start;
+  bucket.count = 1;
+  bucket.temperatureMin = bucket.temperatureMax = bucket.temperatureSum = temperature;
+  bucket.weightMin = bucket.weightMax = weight;
+  bucket.weightSum = weight;
+}
+
+void Beelance::HistorySeries::_update(HistoryBucket& bucket, float temperature, int32_t weight) {
+  bucket.count++;
+  bucket.temperatureSum += temperature;
+  bucket.weightSum += weight;
+  if (temperature < bucket.temperatureMin)
+    bucket.temperatureMin = temperature;
+  if (temperature > bucket.temperatureMax)
+    bucket.temperatureMax = temperature;
+  if (weight < bucket.weightMin)
+    bucket.weightMin = weight;
+  if (weight > bucket.weightMax)
+    bucket.weightMax = weight;
+}
+
+size_t Beelance::HistoryJsonStream::read(uint8_t* buffer, size_t maxLen) {
+  size_t written = 0;
+  while (written < maxLen) {
+    if (_pieceOffset == _pieceLength && !_next())
+      break;
+    const size_t n = std::min(_pieceLength - _pieceOffset, maxLen - written);
+    memcpy(buffer + written, _piece + _pieceOffset, n);
+    _pieceOffset += n;
+    written += n;
+  }
+  return written;
+}
+
+bool Beelance::HistoryJsonStream::_next() {
+  static const char* names[] = {"latest", "hourly", "daily"};
+
+  _pieceLength = 0;
+  _pieceOffset = 0;
+
+  while (!_pieceLength) {
+    _piece = _buffer;
+    switch (_state) {
+      case State::PREFIX:
+        _piece = _prefix.c_str();
+        _pieceLength = _prefix.length();
+        _state = State::SERIES_OPEN;
+        break;
+
+      case State::SERIES_OPEN:
+        _pieceLength = snprintf(_buffer, sizeof(_buffer), "%s\"%s\":[", _seriesIndex ? "," : "{", names[_seriesIndex]);
+        _bucketIndex = 0;
+        _state = State::BUCKET;
+        break;
+
+      case State::BUCKET: {
+        std::lock_guard<std::mutex> lck(_mutex);
+        const HistorySeries& series = *_series[_seriesIndex];
+        if (_bucketIndex >= series.size()) {
+          _state = State::SERIES_CLOSE;
+          break;
+        }
+        const HistoryBucket& bucket = series[_bucketIndex];
+        _pieceLength = snprintf(_buffer,
+                                sizeof(_buffer),
+                                "%s{\"time\":\"%s\",\"ts\":%" PRIu32 ",\"n\":%" PRIu32 ",\"temp\":%.2f,\"temp_min\":%.2f,\"temp_max\":%.2f,\"wt\":%" PRId32 ",\"wt_min\":%" PRId32 ",\"wt_max\":%" PRId32 "}",
+                                _bucketIndex ? "," : "",
+                                series.getLabel(_bucketIndex).c_str(),
+                                bucket.start,
+                                bucket.count,
+                                bucket.getTemperature(),
+                                bucket.temperatureMin,
+                                bucket.temperatureMax,
+                                bucket.getWeight(),
+                                bucket.weightMin,
+                                bucket.weightMax);
+        _bucketIndex++;
+        break;
+      }
+
+      case State::SERIES_CLOSE:
+        _seriesIndex++;
+        _piece = _seriesIndex < 3 ? "]" : "]}";
+        _pieceLength = strlen(_piece);
+        _state = _seriesIndex < 3 ? State::SERIES_OPEN : State::SUFFIX;
+        break;
+
+      case State::SUFFIX:
+        _piece = _suffix.c_str();
+        _pieceLength = _suffix.length();
+        _state = State::DONE;
+        break;
+
+      default:
+        return false;
+    }
+  }
+
+  return true;
+}
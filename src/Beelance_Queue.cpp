@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) Mathieu Carbou
+ */
+#include <BeelanceQueue.h>
+
+#include <esp_rom_crc.h>
+
+#include <algorithm>
+
+// bytes copied at once when rewriting the queue
+#define BEELANCE_QUEUE_COPY_CHUNK 64
+
+bool Beelance::UploadQueue::push(const JsonDocument& payload) {
+  if (!_load())
+    return false;
+
+  const size_t length = measureMsgPack(payload);
+  if (!length || sizeof(EntryHeader) + length > _maxSize || length > UINT16_MAX)
+    return false;
+
+  std::vector<uint8_t> buffer(length);
+  serializeMsgPack(payload, buffer.data(), length);
+
+  // drop the oldest entries to make room
+  const uint32_t needed = sizeof(EntryHeader) + length;
+  size_t from = 0;
+  while (from < _offsets.size() && _size - _offsets[from] + needed > _maxSize)
+    from++;
+  if (_size + needed > _maxSize && !_rewrite(from))
+    return false;
+
+  EntryHeader header;
+  header.length = length;
+  header.crc = esp_rom_crc16_le(0, buffer.data(), length);
+
+  File file = _fs->open(_path, "a");
+  if (!file)
+    return false;
+  const bool success = file.write(reinterpret_cast<const uint8_t*>(&header), sizeof(EntryHeader)) == sizeof(EntryHeader) &&
+                       file.write(buffer.data(), length) == length;
+  file.close();
+
+  if (!success) {
+    // drop the torn entry on next load
+    _loaded = false;
+    return false;
+  }
+
+  _offsets.push_back(_size);
+  _size += needed;
+  return true;
+}
+
+size_t Beelance::UploadQueue::peek(size_t maxCount, const JsonArray& batch) {
+  if (!_load() || _offsets.empty())
+    return 0;
+
+  File file = _fs->open(_path, "r");
+  if (!file)
+    return 0;
+
+  const size_t count = std::min(maxCount, _offsets.size());
+  std::vector<uint8_t> buffer;
+  size_t n = 0;
+
+  for (; n < count; n++) {
+    EntryHeader header;
+    if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(EntryHeader)) != sizeof(EntryHeader))
+      break;
+    buffer.resize(header.length);
+    if (file.read(buffer.data(), header.length) != header.length)
+      break;
+    JsonDocument doc;
+    if (deserializeMsgPack(doc, buffer.data(), header.length) || !batch.add(doc))
+      break;
+  }
+
+  file.close();
+  return n;
+}
+
+bool Beelance::UploadQueue::pop(size_t count) {
+  if (!_load())
+    return false;
+  return _rewrite(std::min(count, _offsets.size()));
+}
+
+bool Beelance::UploadQueue::clear() {
+  if (!_fs)
+    return false;
+  _offsets.clear();
+  _size = 0;
+  _loaded = true;
+  return !_fs->exists(_path) || _fs->remove(_path);
+}
+
+size_t Beelance::UploadQueue::getCount() {
+  return _load() ? _offsets.size() : 0;
+}
+
+uint32_t Beelance::UploadQueue::getSize() {
+  return _load() ? _size : 0;
+}
+
+bool Beelance::UploadQueue::_load() {
+  if (_loaded)
+    return true;
+
+  if (!_fs)
+    return false;
+
+  _offsets.clear();
+  _size = 0;
+
+  // interrupted rewrite: the previous file is still there
+  if (_fs->exists(_tmpPath))
+    _fs->remove(_tmpPath);
+
+  File file = _fs->open(_path, "r");
+  if (!file) {
+    _loaded = true;
+    return true;
+  }
+
+  const uint32_t size = file.size();
+  std::vector<uint8_t> buffer;
+  EntryHeader header;
+  while (_size + sizeof(EntryHeader) <= size) {
+    if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(EntryHeader)) != sizeof(EntryHeader) ||
+        !header.length || _size + sizeof(EntryHeader) + header.length > size)
+      break;
+    buffer.resize(header.length);
+    if (file.read(buffer.data(), header.length) != header.length || esp_rom_crc16_le(0, buffer.data(), header.length) != header.crc)
+      break;
+    _offsets.push_back(_size);
+    _size += sizeof(EntryHeader) + header.length;
+  }
+  file.close();
+
+  _loaded = true;
+
+  // torn entry at the end: entries appended after it would be lost
+  return _size == size || _rewrite(0);
+}
+
+bool Beelance::UploadQueue::_rewrite(size_t from) {
+  if (from >= _offsets.size()) {
+    _offsets.clear();
+    _size = 0;
+    return !_fs->exists(_path) || _fs->remove(_path);
+  }
+
+  const uint32_t start = _offsets[from];
+
+  File file = _fs->open(_path, "r");
+  if (!file)
+    return false;
+  File tmp = _fs->open(_tmpPath, "w");
+  if (!tmp) {
+    file.close();
+    return false;
+  }
+
+  bool success = file.seek(start);
+  uint8_t buffer[BEELANCE_QUEUE_COPY_CHUNK];
+  for (uint32_t remaining = _size - start; success && remaining;) {
+    const size_t n = std::min(remaining, static_cast<uint32_t>(BEELANCE_QUEUE_COPY_CHUNK));
+    success = file.read(buffer, n) == n && tmp.write(buffer, n) == n;
+    remaining -= n;
+  }
+
+  file.close();
+  tmp.close();
+
+  if (!success || !_fs->rename(_tmpPath, _path)) {
+    _fs->remove(_tmpPath);
+    return false;
+  }
+
+  _offsets.erase(_offsets.begin(), _offsets.begin() + from);
+  for (uint32_t& offset : _offsets)
+    offset -= start;
+  _size -= start;
+  return true;
+}
@@ -8,6 +8,9 @@
 
 #define TAG "BEELANCE"
 
+extern const uint8_t cacerts_bin_start[] asm("_binary__pio_data_cacerts_bin_start");
+extern const uint8_t cacerts_bin_end[] asm("_binary__pio_data_cacerts_bin_end");
+
 static const Mycila::TaskPredicate DEBUG_ENABLED = []() {
   return logger.isDebugEnabled();
 };
@@ -32,30 +35,56 @@ Mycila::Task serialDebugATTask("serialDebugAT", [](void* params) {
   }
 });
 
-Mycila::Task temperatureTask("temperatureSensor.read()", [](void* params) { temperatureSensor.read(); });
+Mycila::Task temperatureTask("temperatureSensor.read()", [](void* params) {
+  temperatureSensor.read();
+  if (temperatureSensor.isValid())
+    hx711.setTemperature(temperatureSensor.getTemperature().value_or(0));
+});
 
 Mycila::Task pmuTask("Mycila::PMU.read()", [](void* params) { Mycila::PMU.read(); });
 
 Mycila::Task hx711Task("hx711.read()", [](void* params) { hx711.read(); });
 
+// applied between 2 reads: the filter and the calibration must not change while read() uses them
+Mycila::Task hx711ConfigTask("hx711.configure()", Mycila::TaskType::ONCE, [](void* params) {
+  hx711.setOffsets(config.getString(KEY_HX711_OFFSET));
+  hx711.setScales(config.getString(KEY_HX711_SCALE));
+  hx711.setCalibrationPoints(config.getString(KEY_HX711_CALIBRATION_PTS));
+  hx711.setFilter(Mycila::HX711Filter::parse(config.getString(KEY_HX711_FILTER)));
+  hx711.setMaxSamples(config.getLong(KEY_HX711_SAMPLES));
+  hx711.setSettleThreshold(config.getFloat(KEY_HX711_SETTLE_THRESHOLD));
+  hx711.setPowerSave(!config.getBool(KEY_PREVENT_SLEEP_ENABLE));
+});
+
 Mycila::Task hx711TareTask("hx711.tare()", Mycila::TaskType::ONCE, [](void* params) {
   hx711.tare();
-  config.setString(KEY_HX711_OFFSET, std::to_string(hx711.getOffset()));
-  config.setString(KEY_HX711_SCALE, std::to_string(hx711.getScale()));
+  config.setString(KEY_HX711_OFFSET, hx711.getOffsets());
+  config.setString(KEY_HX711_SCALE, hx711.getScales());
+  config.setString(KEY_HX711_CALIBRATION_PTS, hx711.getCalibrationPoints());
 });
 
 Mycila::Task hx711ScaleTask("hx711.calibrate()", Mycila::TaskType::ONCE, [](void* params) {
-  config.setString(KEY_HX711_SCALE, Mycila::string::to_string(hx711.calibrate(calibrationWeight), 6));
+  hx711.calibrate(calibrationWeight);
+  config.setString(KEY_HX711_SCALE, hx711.getScales());
+  config.setString(KEY_HX711_CALIBRATION_PTS, hx711.getCalibrationPoints());
   calibrationWeight = 0;
 });
 
-Mycila::Task sendTask("Beelance.sendMeasurements()", Mycila::TaskType::ONCE, [](void* params) {
-  if (Mycila::Modem.activateData() && Beelance::Beelance.sendMeasurements()) {
-    Mycila::Modem.activateGPS();
-  } else {
-    logger.error(TAG, "Failed to send measurements. Restarting...");
-    restartTask.resume();
+Mycila::Task hx711CompensationTask("hx711.addCalibrationPoint()", Mycila::TaskType::ONCE, [](void* params) {
+  if (!temperatureSensor.isValid()) {
+    logger.error(TAG, "Unable to add HX711 calibration point: temperature not available");
+  } else if (hx711.addCalibrationPoint(compensationWeight, temperatureSensor.getTemperature().value_or(0))) {
+    config.setString(KEY_HX711_CALIBRATION_PTS, hx711.getCalibrationPoints());
   }
+  compensationWeight = 0;
+});
+
+Mycila::Task sendTask("Beelance.sendMeasurements()", Mycila::TaskType::ONCE, [](void* params) {
+  // measurements which cannot be sent are queued and sent with the next ones: no need to restart
+  Beelance::Beelance.sendMeasurements(Mycila::Modem.activateData());
+  // after the measurements: they are not delayed by the download
+  Mycila::Modem.updateGPSAssistance();
+  Mycila::Modem.activateGPS();
 });
 
 Mycila::Task restartTask("restartTask", Mycila::TaskType::ONCE, [](void* params) {
@@ -66,7 +95,9 @@ Mycila::Task restartTask("restartTask", Mycila::TaskType::ONCE, [](void* params)
 Mycila::Task resetTask("resetTask", Mycila::TaskType::ONCE, [](void* params) {
   logger.warn(TAG, "Resetting %s...", Mycila::AppInfo.nameModelVersion.c_str());
   Beelance::Beelance.clearHistory();
+  Beelance::Beelance.clearQueue();
   config.clear();
+  Mycila::Modem.clearCaches();
   Mycila::PMU.reset();
   Mycila::System::restart(500);
 });
@@ -76,6 +107,17 @@ Mycila::Task startModemTask("startModemTask", Mycila::TaskType::ONCE, [](void* p
   Mycila::Modem.setAPN(config.getString(KEY_MODEM_APN));
   Mycila::Modem.setTimeZoneInfo(config.getString(KEY_TIMEZONE_INFO));
   Mycila::Modem.setGpsSyncTimeout(config.getLong(KEY_MODEM_GPS_SYNC_TIMEOUT));
+  Mycila::Modem.setGpsRefreshInterval(config.getLong(KEY_MODEM_GPS_REFRESH) * 86400);
+  std::string lbs = config.getString(KEY_MODEM_GPS_LBS);
+  if (lbs == "first") {
+    Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_FIRST);
+  } else if (lbs == "off") {
+    Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_OFF);
+  } else {
+    Mycila::Modem.setLBSMode(Mycila::ModemLBSMode::MODEM_LBS_FALLBACK);
+  }
+  // https:// verified with the embedded root certificates
+  Mycila::Modem.setCABundle(cacerts_bin_start, cacerts_bin_end - cacerts_bin_start);
   // mode
   std::string tech = config.getString(KEY_MODEM_MODE);
   if (tech == "LTE-M") {
@@ -143,6 +185,8 @@ void Beelance::BeelanceClass::_initTasks() {
   websiteTask.setManager(loopTaskManager);
 
   // hx711TaskManager
+  hx711CompensationTask.setManager(hx711TaskManager);
+  hx711ConfigTask.setManager(hx711TaskManager);
   hx711ScaleTask.setManager(hx711TaskManager);
   hx711TareTask.setManager(hx711TaskManager);
   hx711Task.setManager(hx711TaskManager);
@@ -33,6 +33,7 @@ static dash::StatisticValue<int32_t> _hx711WeightStat(dashboard, "HX711: Weight
 static dash::StatisticValue<int32_t> _hx711TareStat(dashboard, "HX711: Tare (g)");
 static dash::StatisticValue<int32_t> _hx711OffsetStat(dashboard, "HX711: Offset");
 static dash::StatisticValue<float, 6> _hx711ScaleStat(dashboard, "HX711: Scale");
+static dash::StatisticValue<uint8_t> _hx711ChannelsStat(dashboard, "HX711: Load Cells");
 
 static dash::StatisticValue _modemModelStat(dashboard, "Modem: Model");
 static dash::StatisticValue _modemICCIDStat(dashboard, "Modem: ICCID");
@@ -42,6 +43,10 @@ static dash::StatisticValue _modemModePrefStat(dashboard, "Modem: Preferred Mode
 static dash::StatisticValue _modemLTEMBandsStat(dashboard, "Modem: LTE-M Bands");
 static dash::StatisticValue _modemNBIoTBandsStat(dashboard, "Modem: NB-IoT Bands");
 static dash::StatisticValue _modemIpStat(dashboard, "Modem: Local IP Address");
+static dash::StatisticValue<uint16_t> _modemBandStat(dashboard, "Modem: Band");
+static dash::StatisticValue<float, 1> _modemRegistrationTimeStat(dashboard, "Modem: Registration Time (s)");
+static dash::StatisticValue<float, 1> _modemGPSTTFFStat(dashboard, "Modem: GPS Time To First Fix (s)");
+static dash::StatisticValue<bool> _modemGPSAssistedStat(dashboard, "Modem: GPS Assisted");
 
 static dash::StatisticValue _hostnameStat(dashboard, "Network: Hostname");
 static dash::StatisticValue _apIPStat(dashboard, "Network: Access Point IP Address");
@@ -83,16 +88,17 @@ static dash::ToggleButtonCard _noSleepMode(dashboard, "Prevent Sleep");
 static dash::ToggleButtonCard _resetHistory(dashboard, "Reset Graph History");
 static dash::ToggleButtonCard _restart(dashboard, "Restart");
 static dash::ToggleButtonCard _safeBoot(dashboard, "Update Firmware");
+static dash::ToggleButtonCard _refreshGPS(dashboard, "Refresh GPS Position");
 
 // graphs
 
 static dash::BarChart<std::string, float> _chartLatestWeight(dashboard, "Weight (g) - Latest");
-static dash::BarChart<std::string, float> _chartHourlyWeight(dashboard, "Weight (g) - Hourly Max");
-static dash::BarChart<std::string, float> _chartDailyWeight(dashboard, "Weight (g) - Daily Max");
+static dash::BarChart<std::string, float> _chartHourlyWeight(dashboard, "Weight (g) - Hourly Avg");
+static dash::BarChart<std::string, float> _chartDailyWeight(dashboard, "Weight (g) - Daily Avg");
 
 static dash::BarChart<std::string, float> _chartLatestTemp(dashboard, "Temperature (C) - Latest");
-static dash::BarChart<std::string, float> _chartHourlyTemp(dashboard, "Temperature (C) - Hourly Max");
-static dash::BarChart<std::string, float> _chartDailyTemp(dashboard, "Temperature (C) - Daily Max");
+static dash::BarChart<std::string, float> _chartHourlyTemp(dashboard, "Temperature (C) - Hourly Avg");
+static dash::BarChart<std::string, float> _chartDailyTemp(dashboard, "Temperature (C) - Daily Avg");
 
 void Beelance::WebsiteClass::init() {
   authMiddleware.setAuthType(AsyncAuthType::AUTH_DIGEST);
@@ -196,6 +202,12 @@ void Beelance::WebsiteClass::init() {
     dashboard.refresh(_weight);
   });
 
+  _refreshGPS.onChange([this](bool value) {
+    Mycila::Modem.requestGPSFix();
+    _refreshGPS.setValue(false);
+    dashboard.refresh(_refreshGPS);
+  });
+
   _resetHistory.onChange([this](bool value) {
     Beelance::Beelance.clearHistory();
     _resetHistory.setValue(false);
@@ -255,6 +267,10 @@ void Beelance::WebsiteClass::_update(bool skipWebSocketPush) {
   _modemLTEMBandsStat.setValue(Mycila::Modem.getBands(Mycila::ModemMode::MODEM_MODE_LTE_M));
   _modemNBIoTBandsStat.setValue(Mycila::Modem.getBands(Mycila::ModemMode::MODEM_MODE_NB_IOT));
   _modemIpStat.setValue(Mycila::Modem.getLocalIP());
+  _modemBandStat.setValue(Mycila::Modem.getBand());
+  _modemRegistrationTimeStat.setValue(Mycila::Modem.getRegistrationTime() / 1000.0f);
+  _modemGPSTTFFStat.setValue(Mycila::Modem.getGPSTimeToFirstFix() / 1000.0f);
+  _modemGPSAssistedStat.setValue(Mycila::Modem.isGPSAssisted());
 
   _apIPStat.setValue(espConnect.getIPAddress(Mycila::ESPConnect::Mode::AP).toString().c_str());
   _apMACStat.setValue(espConnect.getMACAddress(Mycila::ESPConnect::Mode::AP));
@@ -267,6 +283,7 @@ void Beelance::WebsiteClass::_update(bool skipWebSocketPush) {
   _hx711TareStat.setValue(static_cast<int32_t>(hx711.getTare()));
   _hx711OffsetStat.setValue(hx711.getOffset());
   _hx711ScaleStat.setValue(hx711.getScale());
+  _hx711ChannelsStat.setValue(static_cast<uint8_t>(hx711.getChannelCount()));
 
   _pmuLowBatShutThreshold.setValue(Mycila::PMU.readLowBatteryShutdownThreshold());
 
@@ -348,6 +365,18 @@ void Beelance::WebsiteClass::_update(bool skipWebSocketPush) {
       _longitude.setFeedback(Mycila::string::to_string(Mycila::Modem.getGPSData().longitude, 6), dash::Status::SUCCESS);
       _altitude.setFeedback(std::to_string(Mycila::Modem.getGPSData().altitude) + " m", dash::Status::SUCCESS);
       break;
+    case Mycila::ModemGPSState::MODEM_GPS_CACHED:
+      _latitude.setFeedback(Mycila::string::to_string(Mycila::Modem.getGPSData().latitude, 6) + " (cached)", dash::Status::INFO);
+      _longitude.setFeedback(Mycila::string::to_string(Mycila::Modem.getGPSData().longitude, 6) + " (cached)", dash::Status::INFO);
+      _altitude.setFeedback(std::to_string(Mycila::Modem.getGPSData().altitude) + " m (cached)", dash::Status::INFO);
+      break;
+    case Mycila::ModemGPSState::MODEM_GPS_LBS: {
+      const std::string uncertainty = " (cells, " + std::to_string(lroundf(Mycila::Modem.getGPSData().uncertainty)) + " m)";
+      _latitude.setFeedback(Mycila::string::to_string(Mycila::Modem.getGPSData().latitude, 6) + uncertainty, dash::Status::WARNING);
+      _longitude.setFeedback(Mycila::string::to_string(Mycila::Modem.getGPSData().longitude, 6) + uncertainty, dash::Status::WARNING);
+      _altitude.setFeedback("Unknown (cells)", dash::Status::WARNING);
+      break;
+    }
     case Mycila::ModemGPSState::MODEM_GPS_TIMEOUT:
       _latitude.setFeedback("Timeout!", dash::Status::DANGER);
       _longitude.setFeedback("Timeout!", dash::Status::DANGER);
@@ -454,11 +483,12 @@ void Beelance::WebsiteClass::_update(bool skipWebSocketPush) {
   _noSleepMode.setValue(config.getBool(KEY_PREVENT_SLEEP_ENABLE));
   _tare.setValue(hx711TareTask.isRunning() || (hx711TareTask.isEnabled() && !hx711TareTask.isPaused()));
 
-  if (_requestChartUpdate || skipWebSocketPush) {
+  // the history is loaded from the filesystem once a client is watching
+  if ((_requestChartUpdate || skipWebSocketPush) && dashboard.hasClient()) {
     _requestChartUpdate = false;
 
-    int idx = 0;
-    while (idx < BEELANCE_MAX_HISTORY_SIZE) {
+    size_t idx = 0;
+    while (idx < BEELANCE_CHART_SIZE) {
       _chartLatestX[idx] = std::string();
       _chartLatestTempY[idx] = 0;
       _chartLatestWeightY[idx] = 0;
@@ -474,53 +504,45 @@ void Beelance::WebsiteClass::_update(bool skipWebSocketPush) {
       idx++;
     }
 
-    idx = 0;
-    for (const auto& entry : Beelance::Beelance.latestHistory) {
-      if (idx < BEELANCE_MAX_HISTORY_SIZE) {
-        _chartLatestX[idx] = entry.time;
-        _chartLatestTempY[idx] = entry.temperature;
-        _chartLatestWeightY[idx] = entry.weight;
-        idx++;
-      }
+    // copies: the series are updated and reallocated by other tasks
+    const std::vector<Beelance::HistoryBucket> latest = Beelance::Beelance.getHistory(Beelance::HistoryResolution::MINUTE, BEELANCE_CHART_SIZE);
+    for (idx = 0; idx < latest.size(); idx++) {
+      _chartLatestX[idx] = Beelance::toBucketLabel(Beelance::HistoryResolution::MINUTE, latest[idx].start);
+      _chartLatestTempY[idx] = latest[idx].getTemperature();
+      _chartLatestWeightY[idx] = latest[idx].getWeight();
     }
 
-    idx = 0;
-    for (const auto& entry : Beelance::Beelance.hourlyHistory) {
-      if (idx < BEELANCE_MAX_HISTORY_SIZE) {
-        _chartHourlyX[idx] = entry.time;
-        _chartHourlyTempY[idx] = entry.temperature;
-        _chartHourlyWeightY[idx] = entry.weight;
-        idx++;
-      }
+    const std::vector<Beelance::HistoryBucket> hourly = Beelance::Beelance.getHistory(Beelance::HistoryResolution::HOUR, BEELANCE_CHART_SIZE);
+    for (idx = 0; idx < hourly.size(); idx++) {
+      _chartHourlyX[idx] = Beelance::toBucketLabel(Beelance::HistoryResolution::HOUR, hourly[idx].start);
+      _chartHourlyTempY[idx] = hourly[idx].getTemperature();
+      _chartHourlyWeightY[idx] = hourly[idx].getWeight();
     }
 
-    idx = 0;
-    for (const auto& entry : Beelance::Beelance.dailyHistory) {
-      if (idx < BEELANCE_MAX_HISTORY_SIZE) {
-        _chartDailyX[idx] = entry.time;
-        _chartDailyTempY[idx] = entry.temperature;
-        _chartDailyWeightY[idx] = entry.weight;
-        idx++;
-      }
+    const std::vector<Beelance::HistoryBucket> daily = Beelance::Beelance.getHistory(Beelance::HistoryResolution::DAY, BEELANCE_CHART_SIZE);
+    for (idx = 0; idx < daily.size(); idx++) {
+      _chartDailyX[idx] = Beelance::toBucketLabel(Beelance::HistoryResolution::DAY, daily[idx].start);
+      _chartDailyTempY[idx] = daily[idx].getTemperature();
+      _chartDailyWeightY[idx] = daily[idx].getWeight();
     }
 
-    _chartLatestWeight.setX(_chartLatestX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartLatestWeight.setY(_chartLatestWeightY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartLatestWeight.setX(_chartLatestX, BEELANCE_CHART_SIZE);
+    _chartLatestWeight.setY(_chartLatestWeightY, BEELANCE_CHART_SIZE);
 
-    _chartLatestTemp.setX(_chartLatestX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartLatestTemp.setY(_chartLatestTempY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartLatestTemp.setX(_chartLatestX, BEELANCE_CHART_SIZE);
+    _chartLatestTemp.setY(_chartLatestTempY, BEELANCE_CHART_SIZE);
 
-    _chartHourlyWeight.setX(_chartHourlyX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartHourlyWeight.setY(_chartHourlyWeightY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartHourlyWeight.setX(_chartHourlyX, BEELANCE_CHART_SIZE);
+    _chartHourlyWeight.setY(_chartHourlyWeightY, BEELANCE_CHART_SIZE);
 
-    _chartHourlyTemp.setX(_chartHourlyX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartHourlyTemp.setY(_chartHourlyTempY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartHourlyTemp.setX(_chartHourlyX, BEELANCE_CHART_SIZE);
+    _chartHourlyTemp.setY(_chartHourlyTempY, BEELANCE_CHART_SIZE);
 
-    _chartDailyWeight.setX(_chartDailyX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartDailyWeight.setY(_chartDailyWeightY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartDailyWeight.setX(_chartDailyX, BEELANCE_CHART_SIZE);
+    _chartDailyWeight.setY(_chartDailyWeightY, BEELANCE_CHART_SIZE);
 
-    _chartDailyTemp.setX(_chartDailyX, BEELANCE_MAX_HISTORY_SIZE);
-    _chartDailyTemp.setY(_chartDailyTempY, BEELANCE_MAX_HISTORY_SIZE);
+    _chartDailyTemp.setX(_chartDailyX, BEELANCE_CHART_SIZE);
+    _chartDailyTemp.setY(_chartDailyTempY, BEELANCE_CHART_SIZE);
   }
 
   if (!skipWebSocketPush && dashboard.hasClient()) {
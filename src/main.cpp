@@ -27,6 +27,7 @@ Mycila::HX711 hx711;
 Mycila::DS18 temperatureSensor;
 
 float calibrationWeight = 0;
+float compensationWeight = 0;
 
 // setup
 void setup() {
@@ -70,10 +71,29 @@ void setup() {
 
   // HX711
   logger.info(TAG, "Configure HX711...");
-  hx711.setOffset(config.getLong(KEY_HX711_OFFSET));
-  hx711.setScale(config.getFloat(KEY_HX711_SCALE));
+  hx711.setOffsets(config.getString(KEY_HX711_OFFSET));
+  hx711.setScales(config.getString(KEY_HX711_SCALE));
+  hx711.setCalibrationPoints(config.getString(KEY_HX711_CALIBRATION_PTS));
   hx711.setExpirationDelay(10);
-  hx711.begin(config.getLong(KEY_HX711_DATA_PIN), config.getLong(KEY_HX711_CLOCK_PIN));
+  hx711.setFilter(Mycila::HX711Filter::parse(config.getString(KEY_HX711_FILTER)));
+  hx711.setMaxSamples(config.getLong(KEY_HX711_SAMPLES));
+  hx711.setSettleThreshold(config.getFloat(KEY_HX711_SETTLE_THRESHOLD));
+  hx711.setPowerSave(!config.getBool(KEY_PREVENT_SLEEP_ENABLE));
+  {
+    // first load cell, then the optional other ones sharing the same clock line
+    uint8_t dataPins[MYCILA_HX711_MAX_CHANNELS];
+    size_t count = 0;
+    dataPins[count++] = config.getLong(KEY_HX711_DATA_PIN);
+    for (const char* p = config.getString(KEY_HX711_DATA_PINS_EXTRA); *p && count < MYCILA_HX711_MAX_CHANNELS;) {
+      char* end;
+      const long pin = strtol(p, &end, 10);
+      if (end == p)
+        break;
+      dataPins[count++] = pin;
+      p = *end == ',' ? end + 1 : end;
+    }
+    hx711.begin(dataPins, count, config.getLong(KEY_HX711_CLOCK_PIN));
+  }
 
   // stack monitor
   Mycila::TaskMonitor.addTask("async_tcp"); // ESPAsyncTCP
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# Minimal CoAP server receiving the Beelance measurements sent to a coap:// URL, for local tests.
+# Acknowledges each confirmable POST with a piggybacked 2.04 (Changed) response and prints the decoded payload.
+# No dependency: the payload is decoded with decode_payload.py from the same directory.
+#
+# Usage:
+#   coap_server.py [--host HOST] [--port PORT] [--separate] [--drop N]
+#
+#   --separate   acknowledge with an empty ACK first, then send the response separately
+#   --drop N     ignore the first N transmissions of each message, to exercise the retransmissions
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+import argparse
+import json
+import socket
+
+from decode_payload import decode
+
+CON, NON, ACK, RST = range(4)
+CHANGED = 0x44  # 2.04
+
+OPTION_URI_PATH = 11
+OPTION_CONTENT_FORMAT = 12
+OPTION_URI_QUERY = 15
+
+CONTENT_TYPES = {
+    0: "text/plain",
+    42: "application/octet-stream",
+    50: "application/json",
+    60: "application/cbor",
+}
+
+
+def extended(data, pos, nibble):
+    if nibble == 13:
+        return data[pos] + 13, pos + 1
+    if nibble == 14:
+        return int.from_bytes(data[pos : pos + 2], "big") + 269, pos + 2
+    if nibble == 15:
+        raise ValueError("invalid option")
+    return nibble, pos
+
+
+def parse(data):
+    if len(data) < 4 or data[0] >> 6 != 1:
+        raise ValueError("not a CoAP message")
+    tkl = data[0] & 0x0F
+    message = {
+        "type": data[0] >> 4 & 0x03,
+        "code": data[1],
+        "mid": int.from_bytes(data[2:4], "big"),
+        "token": data[4 : 4 + tkl],
+        "options": [],
+        "payload": b"",
+    }
+    pos, number = 4 + tkl, 0
+    while pos < len(data):
+        if data[pos] == 0xFF:
+            message["payload"] = data[pos + 1 :]
+            break
+        b = data[pos]
+        delta, pos = extended(data, pos + 1, b >> 4)
+        length, pos = extended(data, pos, b & 0x0F)
+        number += delta
+        message["options"].append((number, data[pos : pos + length]))
+        pos += length
+    return message
+
+
+def header(type, code, mid, token=b""):
+    return bytes([0x40 | type << 4 | len(token), code]) + mid.to_bytes(2, "big") + token
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local CoAP server for Beelance measurements")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=5683)
+    parser.add_argument("--separate", action="store_true", help="send separate responses")
+    parser.add_argument("--drop", type=int, default=0, help="transmissions to ignore per message")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind((args.host, args.port))
+    print("Listening on coap://%s:%d" % (args.host, args.port), flush=True)
+
+    seen = {}  # (address, message id) => transmissions, for the deduplication and --drop
+    mid = 0
+
+    while True:
+        data, address = sock.recvfrom(2048)
+        try:
+            message = parse(data)
+        except ValueError as e:
+            print("%s: %s" % (address, e), flush=True)
+            continue
+
+        if message["type"] in (ACK, RST):
+            continue
+
+        key = (address, message["mid"])
+        seen[key] = seen.get(key, 0) + 1
+        if seen[key] <= args.drop:
+            print("%s: dropping transmission %d of message %d" % (address, seen[key], message["mid"]), flush=True)
+            continue
+
+        if seen[key] == args.drop + 1:
+            path = "/".join(v.decode() for n, v in message["options"] if n == OPTION_URI_PATH)
+            query = "&".join(v.decode() for n, v in message["options"] if n == OPTION_URI_QUERY)
+            formats = [int.from_bytes(v, "big") for n, v in message["options"] if n == OPTION_CONTENT_FORMAT]
+            content_type = CONTENT_TYPES.get(formats[0]) if formats else "application/msgpack"
+            print("%s: POST /%s%s (%s, %d bytes)" % (address, path, "?" + query if query else "", content_type, len(message["payload"])))
+            try:
+                print(json.dumps(decode(message["payload"], content_type), indent=2), flush=True)
+            except Exception as e:
+                print("Unable to decode payload: %s" % e, flush=True)
+        else:
+            print("%s: duplicate of message %d" % (address, message["mid"]), flush=True)
+
+        if message["type"] != CON:
+            continue
+
+        if args.separate:
+            sock.sendto(header(ACK, 0, message["mid"]), address)
+            mid = (mid + 1) & 0xFFFF
+            sock.sendto(header(CON, CHANGED, mid, message["token"]), address)
+        else:
+            sock.sendto(header(ACK, CHANGED, message["mid"], message["token"]), address)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Minimal connector server receiving the Beelance measurements sent to a tcp:// or udp:// URL, for local tests.
+# Listens on the same TCP and UDP port, acknowledges each frame and prints the decoded payload.
+# No dependency: the payload is decoded with decode_payload.py from the same directory.
+#
+#   frame: [payload length (u16, big endian)][sequence (u16, big endian)][payload]
+#   ACK:   [0x0000][sequence]
+#
+# Usage:
+#   connector_server.py [--host HOST] [--port PORT] [--content-type TYPE] [--drop N]
+#
+#   --content-type   encoding of the payloads (send_codec), default: application/json
+#   --drop N         ignore the first N transmissions of each UDP frame, to exercise the retransmissions
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+import argparse
+import json
+import select
+import socket
+import struct
+
+from decode_payload import decode
+
+HEADER = struct.Struct(">HH")
+
+
+def ack(sequence):
+    return HEADER.pack(0, sequence)
+
+
+def show(address, sequence, payload, content_type):
+    print("%s: frame %d (%d bytes)" % (address, sequence, len(payload)))
+    try:
+        print(json.dumps(decode(payload, content_type), indent=2), flush=True)
+    except Exception as e:
+        print("Unable to decode payload: %s" % e, flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local connector server for Beelance measurements")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=4000)
+    parser.add_argument("--content-type", default="application/json", help="encoding of the payloads")
+    parser.add_argument("--drop", type=int, default=0, help="UDP transmissions to ignore per frame")
+    args = parser.parse_args()
+
+    tcp = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    tcp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    tcp.bind((args.host, args.port))
+    tcp.listen()
+    udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    udp.bind((args.host, args.port))
+    print("Listening on tcp://%s:%d and udp://%s:%d" % (args.host, args.port, args.host, args.port), flush=True)
+
+    clients = {}  # socket => (address, buffer)
+    seen = {}  # (address, sequence) => UDP transmissions, for the deduplication and --drop
+
+    while True:
+        readable, _, _ = select.select([tcp, udp] + list(clients), [], [])
+        for s in readable:
+            if s is tcp:
+                conn, address = tcp.accept()
+                clients[conn] = (address, b"")
+                print("%s: connected" % (address,), flush=True)
+
+            elif s is udp:
+                data, address = udp.recvfrom(65535)
+                if len(data) < HEADER.size:
+                    continue
+                length, sequence = HEADER.unpack_from(data)
+                key = (address, sequence)
+                seen[key] = seen.get(key, 0) + 1
+                if seen[key] <= args.drop:
+                    print("%s: dropping transmission %d of frame %d" % (address, seen[key], sequence), flush=True)
+                    continue
+                if seen[key] == args.drop + 1:
+                    show(address, sequence, data[HEADER.size : HEADER.size + length], args.content_type)
+                else:
+                    print("%s: duplicate of frame %d" % (address, sequence), flush=True)
+                udp.sendto(ack(sequence), address)
+
+            else:
+                address, buffer = clients[s]
+                data = s.recv(4096)
+                if not data:
+                    print("%s: disconnected" % (address,), flush=True)
+                    del clients[s]
+                    s.close()
+                    continue
+                buffer += data
+                while len(buffer) >= HEADER.size:
+                    length, sequence = HEADER.unpack_from(buffer)
+                    if len(buffer) < HEADER.size + length:
+                        break
+                    show(address, sequence, buffer[HEADER.size : HEADER.size + length], args.content_type)
+                    buffer = buffer[HEADER.size + length :]
+                    s.sendall(ack(sequence))
+                clients[s] = (address, buffer)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+#
+# Decodes a Beelance payload (JSON, CBOR, MessagePack or binary frames) and prints it as JSON.
+# No dependency: this script can be copied as is to a backend.
+#
+# Usage:
+#   decode_payload.py [--content-type TYPE] [FILE]
+#
+# The content type is the Content-Type header of the request (application/json, application/cbor,
+# application/msgpack or application/octet-stream). The payload is read from FILE or from stdin.
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+import argparse
+import json
+import struct
+import sys
+
+# frame layout per version: the device is identified by its chip ID (v1) or its key (v2), v3 adds the age of the location
+FRAMES = {
+    1: struct.Struct("<BBIhiiihIIBH6s"),
+    2: struct.Struct("<BBIhiiihIIBHI"),
+    3: struct.Struct("<BBIhiiihIIBHII"),
+}
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise ValueError("truncated payload")
+        chunk = self.data[self.pos : self.pos + n]
+        self.pos += n
+        return chunk
+
+    def uint(self, n):
+        return int.from_bytes(self.take(n), "big")
+
+
+def decode_cbor(r):
+    head = r.uint(1)
+    major, info = head >> 5, head & 0x1F
+    if major == 7:
+        if info == 20:
+            return False
+        if info == 21:
+            return True
+        if info in (22, 23):
+            return None
+        if info == 25:
+            return struct.unpack(">e", r.take(2))[0]
+        if info == 26:
+            return struct.unpack(">f", r.take(4))[0]
+        if info == 27:
+            return struct.unpack(">d", r.take(8))[0]
+        raise ValueError("unsupported CBOR simple value %d" % info)
+    if info < 24:
+        value = info
+    elif info <= 27:
+        value = r.uint(1 << (info - 24))
+    else:
+        raise ValueError("unsupported CBOR length %d" % info)
+    if major == 0:
+        return value
+    if major == 1:
+        return -1 - value
+    if major == 2:
+        return r.take(value).hex()
+    if major == 3:
+        return r.take(value).decode("utf-8")
+    if major == 4:
+        return [decode_cbor(r) for _ in range(value)]
+    if major == 5:
+        return {decode_cbor(r): decode_cbor(r) for _ in range(value)}
+    if major == 6:
+        return decode_cbor(r)  # tag: ignored
+    raise ValueError("unsupported CBOR major type %d" % major)
+
+
+def decode_msgpack(r):
+    b = r.uint(1)
+    if b <= 0x7F:
+        return b
+    if b >= 0xE0:
+        return b - 0x100
+    if 0x80 <= b <= 0x8F:
+        return {decode_msgpack(r): decode_msgpack(r) for _ in range(b & 0x0F)}
+    if 0x90 <= b <= 0x9F:
+        return [decode_msgpack(r) for _ in range(b & 0x0F)]
+    if 0xA0 <= b <= 0xBF:
+        return r.take(b & 0x1F).decode("utf-8")
+    if b == 0xC0:
+        return None
+    if b == 0xC2:
+        return False
+    if b == 0xC3:
+        return True
+    if b in (0xC4, 0xC5, 0xC6):
+        return r.take(r.uint(1 << (b - 0xC4))).hex()
+    if b == 0xCA:
+        return struct.unpack(">f", r.take(4))[0]
+    if b == 0xCB:
+        return struct.unpack(">d", r.take(8))[0]
+    if 0xCC <= b <= 0xCF:
+        return r.uint(1 << (b - 0xCC))
+    if 0xD0 <= b <= 0xD3:
+        n = 1 << (b - 0xD0)
+        return int.from_bytes(r.take(n), "big", signed=True)
+    if b in (0xD9, 0xDA, 0xDB):
+        return r.take(r.uint(1 << (b - 0xD9))).decode("utf-8")
+    if b in (0xDC, 0xDD):
+        return [decode_msgpack(r) for _ in range(r.uint(2 if b == 0xDC else 4))]
+    if b in (0xDE, 0xDF):
+        return {decode_msgpack(r): decode_msgpack(r) for _ in range(r.uint(2 if b == 0xDE else 4))}
+    raise ValueError("unsupported MessagePack type 0x%02x" % b)
+
+
+def decode_frames(data):
+    measurements = []
+    offset = 0
+    while offset < len(data):
+        frame = FRAMES.get(data[offset])
+        if not frame:
+            raise ValueError("unsupported frame version %d" % data[offset])
+        if offset + frame.size > len(data):
+            raise ValueError("truncated frame")
+        values = frame.unpack_from(data, offset)
+        version, flags, ts, temp, wt, lat, lon, alt, boot, up, bat, volt, device = values[:13]
+        offset += frame.size
+        measurements.append(
+            {
+                "ts": ts,
+                "temp": temp / 100,
+                "wt": wt,
+                "boot": boot,
+                "up": up,
+                "pow": "ext" if flags & 0x01 else "bat",
+                "bat": bat,
+                "volt": volt / 1000,
+                "eco": bool(flags & 0x02),
+            }
+        )
+        if version == 1 or flags & 0x04:
+            measurements[-1].update({"lat": lat / 1e6, "long": lon / 1e6, "alt": alt})
+            if version >= 3 and values[13] != 0xFFFFFFFF:
+                measurements[-1]["fix_age"] = values[13]
+            if version >= 3:
+                measurements[-1]["fix_src"] = "lbs" if flags & 0x08 else "gps"
+        if version == 1:
+            measurements[-1]["dev"] = "%012X" % int.from_bytes(device, "little")
+        else:
+            measurements[-1]["k"] = device
+    # a single measurement is sent as an object, like with the other encodings
+    return measurements[0] if len(measurements) == 1 else measurements
+
+
+def decode(data, content_type):
+    content_type = content_type.split(";")[0].strip().lower()
+    if content_type == "application/cbor":
+        r = Reader(data)
+        return decode_cbor(r)
+    if content_type in ("application/msgpack", "application/x-msgpack", "application/vnd.msgpack"):
+        r = Reader(data)
+        return decode_msgpack(r)
+    if content_type == "application/octet-stream":
+        return decode_frames(data)
+    return json.loads(data.decode("utf-8"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a Beelance payload")
+    parser.add_argument("--content-type", default="application/json", help="Content-Type of the request")
+    parser.add_argument("file", nargs="?", help="payload file (default: stdin)")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    print(json.dumps(decode(data, args.content_type), indent=2))
+
+
+if __name__ == "__main__":
+    main()